@@ -0,0 +1,382 @@
+// The compact sidecar of the decoded alignments of a BAM file, so the later passes
+// over the file read small records instead of inflating and parsing the BAM again.
+
+#ifndef _LSONG_CLASSES_ALIGNMENT_CACHE_HEADER
+#define _LSONG_CLASSES_ALIGNMENT_CACHE_HEADER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <vector>
+#include <string>
+
+#define ALIGNMENT_CACHE_MAGIC "PSICDAC1"
+#define ALIGNMENT_CACHE_WINDOW_SHIFT 14 // 16kb windows in the linear index, as in the .bai file
+
+// bits of _cachedAlignment.info
+#define CACHE_HAS_NH 1
+#define CACHE_HAS_XS 2
+#define CACHE_HAS_SA 4
+#define CACHE_HAS_XZ 8
+#define CACHE_CLIP_HEAD 16
+#define CACHE_CLIP_TAIL 32
+#define CACHE_CLIP_MIDDLE 64
+#define CACHE_QLEN_MISMATCH 128 // the cigar does not agree with the read length
+
+// One mapped record. It is followed by segCnt pairs of int32 (start, end) offsets from pos.
+// The records whose read or mate is unmapped are not kept, only counted in skippedPrimary.
+struct _cachedAlignment
+{
+	int64_t pos ;
+	int64_t mpos ;
+	uint64_t nameHash ; // hash of the read id without the mate suffix
+	int32_t tid ;
+	int32_t mtid ;
+	int32_t NM ; // -1 if absent
+	int32_t readLen ;
+	int32_t gcCnt ;
+	int32_t clipSum ;
+	uint32_t skippedPrimary ; // the primary records not cached right before this one.
+	uint16_t flag ;
+	uint16_t NH ;
+	uint8_t segCnt ;
+	uint8_t info ;
+	char XS ;
+	char nameSuffix[2] ; // such as ".1" or "/2", 0 if the id has no mate suffix.
+	char padding[3] ;
+} ;
+
+struct _cacheChrom
+{
+	int64_t offset ; // the first record
+	int64_t endOffset ;
+	int64_t recordCnt ;
+	std::vector<int64_t> windows ; // the first record overlapping each window
+} ;
+
+class AlignmentCache
+{
+private:
+	FILE *fp ;
+	bool writing ;
+	char path[1024] ;
+	char tmpPath[1200] ;
+	int64_t offset ; // of the next record
+	int64_t recordsEnd ;
+	int64_t tailSkippedPrimary ;
+	bool suspended ;
+	std::vector<struct _cacheChrom> chroms ;
+
+	bool ReadHeader( const char *bamFile )
+	{
+		char magic[8] ;
+		int64_t size, mtime, bamSize, bamMtime ;
+		int i, n ;
+
+		if ( fread( magic, 8, 1, fp ) != 1 || memcmp( magic, ALIGNMENT_CACHE_MAGIC, 8 ) )
+			return false ;
+		if ( fread( &size, sizeof( size ), 1, fp ) != 1 || fread( &mtime, sizeof( mtime ), 1, fp ) != 1 )
+			return false ;
+		// A cache from another version of the BAM file is stale.
+		if ( !GetFileStat( bamFile, bamSize, bamMtime ) || bamSize != size || bamMtime != mtime )
+			return false ;
+		if ( fread( &n, sizeof( n ), 1, fp ) != 1 || n < 0 )
+			return false ;
+		chrNames.resize( n ) ;
+		chrLengths.resize( n ) ;
+		for ( i = 0 ; i < n ; ++i )
+		{
+			int len ;
+			char name[1024] ;
+			if ( fread( &len, sizeof( len ), 1, fp ) != 1 || len < 0 || len >= (int)sizeof( name )
+				|| fread( name, 1, len, fp ) != (size_t)len || fread( &chrLengths[i], sizeof( int ), 1, fp ) != 1 )
+				return false ;
+			name[len] = '\0' ;
+			chrNames[i] = name ;
+		}
+		return true ;
+	}
+
+	bool ReadIndex()
+	{
+		int64_t indexOffset ;
+		char magic[8] ;
+		int i, n ;
+
+		if ( fseeko( fp, -24, SEEK_END ) != 0 )
+			return false ;
+		if ( fread( &indexOffset, sizeof( indexOffset ), 1, fp ) != 1
+			|| fread( &tailSkippedPrimary, sizeof( tailSkippedPrimary ), 1, fp ) != 1
+			|| fread( magic, 8, 1, fp ) != 1 || memcmp( magic, ALIGNMENT_CACHE_MAGIC, 8 ) )
+			return false ;
+		if ( fseeko( fp, indexOffset, SEEK_SET ) != 0 )
+			return false ;
+
+		n = chrNames.size() ;
+		chroms.resize( n ) ;
+		for ( i = 0 ; i < n ; ++i )
+		{
+			int wcnt ;
+			struct _cacheChrom &c = chroms[i] ;
+			if ( fread( &c.offset, sizeof( int64_t ), 1, fp ) != 1 || fread( &c.endOffset, sizeof( int64_t ), 1, fp ) != 1
+				|| fread( &c.recordCnt, sizeof( int64_t ), 1, fp ) != 1 || fread( &wcnt, sizeof( int ), 1, fp ) != 1
+				|| wcnt < 0 )
+				return false ;
+			c.windows.resize( wcnt ) ;
+			if ( wcnt > 0 && fread( &c.windows[0], sizeof( int64_t ), wcnt, fp ) != (size_t)wcnt )
+				return false ;
+		}
+		recordsEnd = indexOffset ;
+		return true ;
+	}
+public:
+	std::vector<std::string> chrNames ;
+	std::vector<int> chrLengths ;
+
+	AlignmentCache()
+	{
+		fp = NULL ;
+		writing = false ;
+		path[0] = tmpPath[0] = '\0' ;
+		offset = recordsEnd = 0 ;
+		tailSkippedPrimary = 0 ;
+		suspended = false ;
+	}
+	// No destructor: the Alignments holding the cache are copied around, Close() releases the file.
+
+	// The size and modification time tell whether a sidecar was made from this version of the file.
+	static bool GetFileStat( const char *file, int64_t &size, int64_t &mtime )
+	{
+		struct stat st ;
+		if ( stat( file, &st ) != 0 )
+			return false ;
+		size = st.st_size ;
+		mtime = st.st_mtime ;
+		return true ;
+	}
+
+	bool IsOpened()
+	{
+		return fp != NULL || suspended ;
+	}
+
+	bool IsWriting()
+	{
+		return fp != NULL && writing ;
+	}
+
+	// Open an existing cache for reading. Return false if it is missing, truncated or older than the BAM file.
+	bool OpenRead( const char *cacheFile, const char *bamFile )
+	{
+		fp = fopen( cacheFile, "rb" ) ;
+		if ( fp == NULL )
+			return false ;
+		writing = false ;
+		if ( !ReadHeader( bamFile ) )
+		{
+			Close() ;
+			return false ;
+		}
+		int64_t recordsBegin = ftello( fp ) ;
+		if ( !ReadIndex() || fseeko( fp, recordsBegin, SEEK_SET ) != 0 )
+		{
+			Close() ;
+			return false ;
+		}
+		strcpy( path, cacheFile ) ;
+		offset = recordsBegin ;
+		setvbuf( fp, NULL, _IOFBF, 1 << 20 ) ;
+		return true ;
+	}
+
+	// Read the next record. Return 0 at the end of the records or of the chromosome set by Seek.
+	int Read( struct _cachedAlignment &r, int32_t *segOffsets )
+	{
+		if ( offset >= recordsEnd )
+			return 0 ;
+		if ( fread( &r, sizeof( r ), 1, fp ) != 1
+			|| ( r.segCnt > 0 && fread( segOffsets, sizeof( int32_t ) * 2, r.segCnt, fp ) != r.segCnt ) )
+		{
+			fprintf( stderr, "The alignment cache %s is truncated.\n", path ) ;
+			exit( 1 ) ;
+		}
+		offset += sizeof( r ) + sizeof( int32_t ) * 2 * r.segCnt ;
+		return 1 ;
+	}
+
+	int64_t GetTailSkippedPrimary()
+	{
+		return tailSkippedPrimary ;
+	}
+
+	// Move to the first record that may overlap position start on chromosome tid.
+	void Seek( int tid, int64_t start )
+	{
+		int64_t o ;
+		struct _cacheChrom &c = chroms[tid] ;
+		int64_t w = start >> ALIGNMENT_CACHE_WINDOW_SHIFT ;
+
+		if ( c.recordCnt == 0 )
+			o = recordsEnd ;
+		else if ( w < (int64_t)c.windows.size() )
+			o = c.windows[w] ;
+		else
+			o = c.endOffset ;
+		if ( fseeko( fp, o, SEEK_SET ) != 0 )
+		{
+			fprintf( stderr, "Failed to seek in the alignment cache %s.\n", path ) ;
+			exit( 1 ) ;
+		}
+		offset = o ;
+	}
+
+	// Start a new cache. The records go to a temporary file renamed to cacheFile by EndWrite,
+	// so a partial pass or another process writing the same cache never leaves a broken file.
+	bool BeginWrite( const char *cacheFile, const char *bamFile, const std::vector<std::string> &names,
+		const std::vector<int> &lengths )
+	{
+		int64_t size, mtime ;
+		int i, n ;
+		if ( !GetFileStat( bamFile, size, mtime ) )
+			return false ;
+		strcpy( path, cacheFile ) ;
+		snprintf( tmpPath, sizeof( tmpPath ), "%s.tmp.%d", cacheFile, (int)getpid() ) ;
+		fp = fopen( tmpPath, "wb" ) ;
+		if ( fp == NULL )
+		{
+			fprintf( stderr, "Can not write the alignment cache %s, continue without it.\n", tmpPath ) ;
+			return false ;
+		}
+		setvbuf( fp, NULL, _IOFBF, 1 << 20 ) ;
+		writing = true ;
+
+		chrNames = names ;
+		chrLengths = lengths ;
+		n = names.size() ;
+		fwrite( ALIGNMENT_CACHE_MAGIC, 8, 1, fp ) ;
+		fwrite( &size, sizeof( size ), 1, fp ) ;
+		fwrite( &mtime, sizeof( mtime ), 1, fp ) ;
+		fwrite( &n, sizeof( n ), 1, fp ) ;
+		for ( i = 0 ; i < n ; ++i )
+		{
+			int len = names[i].length() ;
+			fwrite( &len, sizeof( len ), 1, fp ) ;
+			fwrite( names[i].c_str(), 1, len, fp ) ;
+			fwrite( &lengths[i], sizeof( int ), 1, fp ) ;
+		}
+		offset = ftello( fp ) ;
+
+		chroms.clear() ;
+		chroms.resize( n ) ;
+		for ( i = 0 ; i < n ; ++i )
+		{
+			chroms[i].offset = chroms[i].endOffset = -1 ;
+			chroms[i].recordCnt = 0 ;
+		}
+		return true ;
+	}
+
+	// The records should come in the order of the sorted BAM file.
+	void Write( const struct _cachedAlignment &r, const int32_t *segOffsets )
+	{
+		struct _cacheChrom &c = chroms[ r.tid ] ;
+		int64_t w, wend ;
+
+		if ( c.recordCnt == 0 )
+			c.offset = offset ;
+		++c.recordCnt ;
+
+		wend = r.pos ;
+		if ( r.segCnt > 0 )
+			wend += segOffsets[ 2 * r.segCnt - 1 ] ;
+		wend >>= ALIGNMENT_CACHE_WINDOW_SHIFT ;
+		if ( (int64_t)c.windows.size() <= wend )
+			c.windows.resize( wend + 1, -1 ) ;
+		for ( w = r.pos >> ALIGNMENT_CACHE_WINDOW_SHIFT ; w <= wend ; ++w )
+			if ( c.windows[w] == -1 )
+				c.windows[w] = offset ;
+
+		fwrite( &r, sizeof( r ), 1, fp ) ;
+		if ( r.segCnt > 0 )
+			fwrite( segOffsets, sizeof( int32_t ) * 2, r.segCnt, fp ) ;
+		offset += sizeof( r ) + sizeof( int32_t ) * 2 * r.segCnt ;
+		c.endOffset = offset ;
+	}
+
+	// Write the chromosome index and move the finished cache in place.
+	void EndWrite( int64_t tailSkipped )
+	{
+		int i, n ;
+		int64_t indexOffset = offset ;
+		n = chroms.size() ;
+		for ( i = 0 ; i < n ; ++i )
+		{
+			struct _cacheChrom &c = chroms[i] ;
+			int wcnt = c.windows.size() ;
+			// The windows no read starts or spans go to the next record on the chromosome.
+			for ( int w = wcnt - 1 ; w >= 0 ; --w )
+				if ( c.windows[w] == -1 )
+					c.windows[w] = ( w == wcnt - 1 ) ? c.endOffset : c.windows[w + 1] ;
+			fwrite( &c.offset, sizeof( int64_t ), 1, fp ) ;
+			fwrite( &c.endOffset, sizeof( int64_t ), 1, fp ) ;
+			fwrite( &c.recordCnt, sizeof( int64_t ), 1, fp ) ;
+			fwrite( &wcnt, sizeof( int ), 1, fp ) ;
+			if ( wcnt > 0 )
+				fwrite( &c.windows[0], sizeof( int64_t ), wcnt, fp ) ;
+		}
+		fwrite( &indexOffset, sizeof( indexOffset ), 1, fp ) ;
+		fwrite( &tailSkipped, sizeof( tailSkipped ), 1, fp ) ;
+		fwrite( ALIGNMENT_CACHE_MAGIC, 8, 1, fp ) ;
+
+		if ( fclose( fp ) != 0 || rename( tmpPath, path ) != 0 )
+		{
+			fprintf( stderr, "Failed to write the alignment cache %s.\n", path ) ;
+			unlink( tmpPath ) ;
+		}
+		fp = NULL ;
+		writing = false ;
+		chroms.clear() ;
+	}
+
+	// Release the file descriptor of a cache opened for reading, keeping the position and the index.
+	void Suspend()
+	{
+		if ( fp == NULL || writing )
+			return ;
+		fclose( fp ) ;
+		fp = NULL ;
+		suspended = true ;
+	}
+
+	void Resume()
+	{
+		if ( !suspended )
+			return ;
+		fp = fopen( path, "rb" ) ;
+		if ( fp == NULL || fseeko( fp, offset, SEEK_SET ) != 0 )
+		{
+			fprintf( stderr, "Can not reopen the alignment cache %s.\n", path ) ;
+			exit( 1 ) ;
+		}
+		setvbuf( fp, NULL, _IOFBF, 1 << 20 ) ;
+		suspended = false ;
+	}
+
+	// Close the file. An unfinished cache is removed.
+	void Close()
+	{
+		suspended = false ;
+		if ( fp == NULL )
+			return ;
+		fclose( fp ) ;
+		if ( writing )
+			unlink( tmpPath ) ;
+		fp = NULL ;
+		writing = false ;
+	}
+} ;
+
+#endif
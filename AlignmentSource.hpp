@@ -0,0 +1,353 @@
+// The alignment source concept, and a source that keeps its records in memory.
+//
+// The consumers of the alignments (Blocks, Constraints, Support) are templates over the source type T.
+// A source provides:
+//	struct _pair segments[], int segCnt: the aligned segments of the current record.
+//	int readLen, fragLen, fragStdev, totalReadCnt: the library statistics.
+//	int Next(): move to the next record, 0 at the end. void Rewind(). bool IsAtBegin(), IsAtEnd().
+//	void Acquire(), Release(): bracket a run of reads, e.g. to keep a pooled file open.
+//	int GetChromId(), GetChromCount(), GetChromLength( tid ), char *GetChromName( tid ).
+//	void GetMatePosition( int &chrId, int64_t &pos ): chrId is -1 if the mate is unmapped.
+//	char *GetReadId(), bool IsFirstMate(), IsPrimary(), IsUnique(), IsGCRich(), HasClipHead(), HasClipTail().
+//	int GetNumberOfHits(), GetRefCoverLength(), GetReadLength(), GetStrand().
+//	int GetFieldI( "NM" ), char *GetFieldZ( "SA" ).
+// Alignments implements it for BAM files, for SAM text on the standard input or in a file,
+// and for the decoded alignment cache.
+
+#ifndef _LSONG_CLASSES_ALIGNMENT_SOURCE_HEADER
+#define _LSONG_CLASSES_ALIGNMENT_SOURCE_HEADER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <string>
+
+#include "defs.h"
+#include "alignments.hpp"
+
+// bits of _memoryAlignment.info
+#define MEMORY_ALIGNMENT_FIRST_MATE 1
+#define MEMORY_ALIGNMENT_PRIMARY 2
+#define MEMORY_ALIGNMENT_UNIQUE 4
+#define MEMORY_ALIGNMENT_GC_RICH 8
+#define MEMORY_ALIGNMENT_CLIP_HEAD 16
+#define MEMORY_ALIGNMENT_CLIP_TAIL 32
+#define MEMORY_ALIGNMENT_HAS_SA 64
+
+struct _memoryAlignment
+{
+	int tid, mtid ;
+	int64_t mpos ;
+	int segStart, segCnt ; // in MemoryAlignments.segPool
+	int readIdOffset ; // in MemoryAlignments.readIdPool
+	int readLen ;
+	int NH, NM ;
+	int strand ;
+	int info ;
+} ;
+
+// The records are added by the caller, or copied from another source with Load().
+// Used for the synthetic inputs, and to replay a stream that can not be rewound.
+class MemoryAlignments
+{
+private:
+	std::vector<struct _memoryAlignment> records ;
+	std::vector<struct _pair> segPool ;
+	std::vector<char> readIdPool ;
+	std::vector<std::string> chrNames ;
+	std::vector<int> chrLengths ;
+	int idx ; // the current record
+	bool atBegin, atEnd ;
+
+	struct _memoryAlignment &Cur()
+	{
+		return records[idx] ;
+	}
+public:
+	struct _pair segments[MAX_SEG_COUNT] ;
+	int segCnt ;
+
+	int totalReadCnt ;
+	int fragLen, fragStdev ;
+	int readLen ;
+	bool matePaired ;
+
+	MemoryAlignments()
+	{
+		idx = -1 ;
+		atBegin = true ;
+		atEnd = false ;
+		segCnt = 0 ;
+		totalReadCnt = 0 ;
+		fragLen = fragStdev = readLen = 0 ;
+		matePaired = false ;
+	}
+
+	~MemoryAlignments()
+	{
+	}
+
+	int AddChrom( const char *name, int length )
+	{
+		chrNames.push_back( std::string( name ) ) ;
+		chrLengths.push_back( length ) ;
+		return chrNames.size() - 1 ;
+	}
+
+	// The records must be added in the coordinate order. info is a combination of the MEMORY_ALIGNMENT_* bits.
+	void Add( int tid, struct _pair *segs, int segCnt, const char *readId, int readLen, int info,
+		int mtid = -1, int64_t mpos = -1, int NH = 1, int NM = -1, int strand = 0 )
+	{
+		struct _memoryAlignment r ;
+		int i ;
+		if ( segCnt > MAX_SEG_COUNT )
+		{
+			fprintf( stderr, "Too many segments in the alignment of %s.\n", readId ) ;
+			exit( 1 ) ;
+		}
+		r.tid = tid ;
+		r.mtid = mtid ;
+		r.mpos = mpos ;
+		r.segStart = segPool.size() ;
+		r.segCnt = segCnt ;
+		for ( i = 0 ; i < segCnt ; ++i )
+			segPool.push_back( segs[i] ) ;
+		r.readIdOffset = readIdPool.size() ;
+		readIdPool.insert( readIdPool.end(), readId, readId + strlen( readId ) + 1 ) ;
+		r.readLen = readLen ;
+		r.NH = NH ;
+		r.NM = NM ;
+		r.strand = strand ;
+		r.info = info ;
+		records.push_back( r ) ;
+		if ( info & MEMORY_ALIGNMENT_PRIMARY )
+			++totalReadCnt ;
+	}
+
+	// Copy the remaining records of another source, and its library statistics.
+	template <class T>
+	void Load( T &source )
+	{
+		int i ;
+		int chrCnt = source.GetChromCount() ;
+		for ( i = 0 ; i < chrCnt ; ++i )
+			AddChrom( source.GetChromName( i ), source.GetChromLength( i ) ) ;
+		while ( source.Next() )
+		{
+			int info = 0 ;
+			int mtid ;
+			int64_t mpos ;
+			if ( source.IsFirstMate() )
+				info |= MEMORY_ALIGNMENT_FIRST_MATE ;
+			if ( source.IsPrimary() )
+				info |= MEMORY_ALIGNMENT_PRIMARY ;
+			if ( source.IsUnique() )
+				info |= MEMORY_ALIGNMENT_UNIQUE ;
+			if ( source.IsGCRich() )
+				info |= MEMORY_ALIGNMENT_GC_RICH ;
+			if ( source.HasClipHead() )
+				info |= MEMORY_ALIGNMENT_CLIP_HEAD ;
+			if ( source.HasClipTail() )
+				info |= MEMORY_ALIGNMENT_CLIP_TAIL ;
+			if ( source.GetFieldZ( "SA" ) != NULL )
+				info |= MEMORY_ALIGNMENT_HAS_SA ;
+			source.GetMatePosition( mtid, mpos ) ;
+			Add( source.GetChromId(), source.segments, source.segCnt, source.GetReadId(), source.GetReadLength(),
+				info, mtid, mpos, source.GetNumberOfHits(), source.GetFieldI( "NM" ), source.GetStrand() ) ;
+		}
+		// The source counts the primary reads it filtered out too.
+		totalReadCnt = source.totalReadCnt ;
+		readLen = source.readLen ;
+		fragLen = source.fragLen ;
+		fragStdev = source.fragStdev ;
+		matePaired = source.matePaired ;
+		Rewind() ;
+	}
+
+	// The same estimate as Alignments::GetGeneralInfo, over the primary records kept in memory.
+	// All the records are in memory already, so stopEarly does not matter.
+	void GetGeneralInfo( bool stopEarly = false )
+	{
+		const int sampleMax = 1000000 ;
+		int size = records.size() ;
+		int *lens = new int[sampleMax] ;
+		int *mateDiff = new int[sampleMax] ;
+		int lensCnt = 0 ;
+		int mateDiffCnt = 0 ;
+		int i ;
+
+		for ( i = 0 ; i < size && lensCnt < sampleMax ; ++i )
+		{
+			struct _memoryAlignment &r = records[i] ;
+			if ( !( r.info & MEMORY_ALIGNMENT_PRIMARY ) )
+				continue ;
+			lens[ lensCnt ] = r.readLen ;
+			++lensCnt ;
+			int64_t pos = segPool[ r.segStart ].a ;
+			if ( r.tid == r.mtid && pos < r.mpos && mateDiffCnt < sampleMax )
+			{
+				mateDiff[ mateDiffCnt ] = r.mpos - pos ;
+				++mateDiffCnt ;
+			}
+		}
+		Alignments::EstimateLengths( lens, lensCnt, mateDiff, mateDiffCnt, readLen, fragLen, fragStdev, matePaired ) ;
+		delete[] lens ;
+		delete[] mateDiff ;
+	}
+
+	int GetRecordCount()
+	{
+		return records.size() ;
+	}
+
+	void Rewind()
+	{
+		idx = -1 ;
+		atBegin = true ;
+		atEnd = false ;
+	}
+
+	int Next()
+	{
+		int i ;
+		atBegin = false ;
+		if ( idx + 1 >= (int)records.size() )
+		{
+			idx = records.size() ;
+			atEnd = true ;
+			return 0 ;
+		}
+		++idx ;
+		struct _memoryAlignment &r = Cur() ;
+		segCnt = r.segCnt ;
+		for ( i = 0 ; i < segCnt ; ++i )
+			segments[i] = segPool[ r.segStart + i ] ;
+		return 1 ;
+	}
+
+	bool IsAtBegin()
+	{
+		return atBegin ;
+	}
+
+	bool IsAtEnd()
+	{
+		return atEnd ;
+	}
+
+	void Acquire()
+	{
+	}
+
+	void Release()
+	{
+	}
+
+	int GetChromId()
+	{
+		return Cur().tid ;
+	}
+
+	char *GetChromName( int tid )
+	{
+		return (char *)chrNames[ tid ].c_str() ;
+	}
+
+	int GetChromLength( int tid )
+	{
+		return chrLengths[ tid ] ;
+	}
+
+	int GetChromCount()
+	{
+		return chrNames.size() ;
+	}
+
+	void GetMatePosition( int &chrId, int64_t &pos )
+	{
+		chrId = Cur().mtid ;
+		pos = Cur().mpos ;
+	}
+
+	char *GetReadId()
+	{
+		return &readIdPool[ Cur().readIdOffset ] ;
+	}
+
+	int GetReadLength()
+	{
+		return Cur().readLen ;
+	}
+
+	int GetRefCoverLength()
+	{
+		int i ;
+		int sum = 0 ;
+		for ( i = 0 ; i < segCnt ; ++i )
+			sum += segments[i].b - segments[i].a + 1 ;
+		return sum ;
+	}
+
+	bool IsFirstMate()
+	{
+		return ( Cur().info & MEMORY_ALIGNMENT_FIRST_MATE ) != 0 ;
+	}
+
+	bool IsPrimary()
+	{
+		return ( Cur().info & MEMORY_ALIGNMENT_PRIMARY ) != 0 ;
+	}
+
+	bool IsUnique()
+	{
+		return ( Cur().info & MEMORY_ALIGNMENT_UNIQUE ) != 0 ;
+	}
+
+	bool IsGCRich()
+	{
+		return ( Cur().info & MEMORY_ALIGNMENT_GC_RICH ) != 0 ;
+	}
+
+	bool HasClipHead()
+	{
+		return ( Cur().info & MEMORY_ALIGNMENT_CLIP_HEAD ) != 0 ;
+	}
+
+	bool HasClipTail()
+	{
+		return ( Cur().info & MEMORY_ALIGNMENT_CLIP_TAIL ) != 0 ;
+	}
+
+	int GetNumberOfHits()
+	{
+		return Cur().NH ;
+	}
+
+	// -1:minus, 0: unknown, 1:plus
+	int GetStrand()
+	{
+		return Cur().strand ;
+	}
+
+	int GetFieldI( const char *f )
+	{
+		if ( !strcmp( f, "NM" ) )
+			return Cur().NM ;
+		else if ( !strcmp( f, "NH" ) )
+			return Cur().NH ;
+		return -1 ;
+	}
+
+	// Only the presence of SA is kept.
+	char *GetFieldZ( const char *f )
+	{
+		static char empty[1] = "" ;
+		if ( !strcmp( f, "SA" ) && ( Cur().info & MEMORY_ALIGNMENT_HAS_SA ) )
+			return empty ;
+		return NULL ;
+	}
+} ;
+
+#endif
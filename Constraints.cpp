@@ -149,7 +149,7 @@ void Constraints::CoalesceSameConstraints()
 	mateReadIds.UpdateIdx( newIdx ) ;
 }
 
-void Constraints::ComputeNormAbund( struct _subexon *subexons )
+void Constraints::ComputeNormAbund( struct _subexon *subexons, int readLen )
 {
 	int i, j ;
 	int ctSize = constraints.size() ;
@@ -200,8 +200,8 @@ void Constraints::ComputeNormAbund( struct _subexon *subexons )
 		//printf( "%d: effectiveLength=%d support=%d\n", i, effectiveLength, constraints[i].support ) ;	
 		constraints[i].normAbund = (double)constraints[i].weight / (double)effectiveLength ;
 
-		if ( ( subexons[ constraints[i].first ].leftType == 0 && subexons[ constraints[i].first ].end - subexons[ constraints[i].first ].start + 1 >= 8 * pAlignments->readLen ) 
-			|| ( subexons[ constraints[i].last ].rightType == 0 && subexons[ constraints[i].last ].end - subexons[ constraints[i].last ].start + 1 >= 8 * pAlignments->readLen ) ) // some random elongation of the sequence might make unnecessary long effective length.	
+		if ( ( subexons[ constraints[i].first ].leftType == 0 && subexons[ constraints[i].first ].end - subexons[ constraints[i].first ].start + 1 >= 8 * readLen ) 
+			|| ( subexons[ constraints[i].last ].rightType == 0 && subexons[ constraints[i].last ].end - subexons[ constraints[i].last ].start + 1 >= 8 * readLen ) ) // some random elongation of the sequence might make unnecessary long effective length.	
 		{
 			constraints[i].normAbund *= 2 ;
 		}
@@ -238,11 +238,13 @@ void Constraints::ComputeNormAbund( struct _subexon *subexons )
 }
 
 int Constraints::BuildConstraints( struct _subexon *subexons, int seCnt, int start, int end )
+{
+	return BuildConstraints( *pAlignments, subexons, seCnt, start, end ) ;
+}
+
+void Constraints::BeginConstraints()
 {
 	int i ;
-	int tag = 0 ;
-	int coalesceThreshold = 16384 ;
-	Alignments &alignments = *pAlignments ;
 	// Release the memory from previous gene.
 	int size = constraints.size() ;
 	
@@ -254,147 +256,130 @@ int Constraints::BuildConstraints( struct _subexon *subexons, int seCnt, int sta
 	}
 	std::vector<struct _matePairConstraint>().swap( matePairs ) ;
 	mateReadIds.Clear() ;
+	coalesceThreshold = 16384 ;
+}
+
+// Add the current alignment, which overlaps subexons[tag].
+template <class T>
+void Constraints::AddConstraint( T &alignments, struct _subexon *subexons, int seCnt, int tag )
+{
+	int uniqSupport = 0 ;
+	if ( usePrimaryAsUnique )
+		uniqSupport = alignments.IsPrimary() ? 1 : 0 ;
+	else
+		uniqSupport = alignments.IsUnique() ? 1 : 0 ;
+
+	struct _constraint ct ;
+	ct.vector.Init( seCnt ) ;
+	//printf( "%s %d: %lld-%lld | %d-%d\n", __func__, alignments.segCnt, alignments.segments[0].a, alignments.segments[0].b, subexons[tag].start, subexons[tag].end ) ;
+	ct.weight = 1.0 / alignments.GetNumberOfHits() ;
+	if ( alignments.IsGCRich() )
+		ct.weight *= 10 ;
+	ct.normAbund = 0 ;
+	ct.support = 1 ;
+	ct.uniqSupport = uniqSupport ;
+	ct.maxReadLen = alignments.GetRefCoverLength() ;
 	
-	// Start to build the constraints. 
-	bool callNext = false ; // the last used alignment
-	if ( alignments.IsAtBegin() )
-		callNext = true ;
-	while ( !alignments.IsAtEnd() )
+	if ( alignments.IsPrimary() && ConvertAlignmentToBitTable( alignments.segments, alignments.segCnt, 
+			subexons, seCnt, tag, ct ) )
 	{
-		if ( callNext )
+	
+		//printf( "%s ", alignments.GetReadId() ) ;
+		//ct.vector.Print() ;
+
+
+		// If the alignment has clipped end or tail. We only keep those clipped in the 3'/5'-end
+		bool validClip = true ;
+		if ( alignments.HasClipHead() )
 		{
-			if ( !alignments.Next() )
-				break ;
+			if ( ( ct.first < seCnt - 1 && subexons[ct.first].end + 1 == subexons[ct.first + 1].start )
+				|| subexons[ct.first].prevCnt > 0 
+				|| alignments.segments[0].b - alignments.segments[0].a + 1 <= alignments.GetRefCoverLength() / 3.0  )	
+				validClip = false ;
 		}
-		else
-			callNext = true ;
-
-		if ( alignments.GetChromId() < subexons[0].chrId )
-			continue ;
-		else if ( alignments.GetChromId() > subexons[0].chrId )
-			break ;
-		// locate the first subexon in this region that overlapps with current alignment.
-		for ( ; tag < seCnt && subexons[tag].end < alignments.segments[0].a ; ++tag )
-			;
-		
-		if ( tag >= seCnt )
-			break ;
-		if ( alignments.segments[ alignments.segCnt - 1 ].b < subexons[tag].start )
-			continue ;
-		
-		int uniqSupport = 0 ;
-		if ( usePrimaryAsUnique )
-			uniqSupport = alignments.IsPrimary() ? 1 : 0 ;
-		else
-			uniqSupport = alignments.IsUnique() ? 1 : 0 ;
-
-		struct _constraint ct ;
-		ct.vector.Init( seCnt ) ;
-		//printf( "%s %d: %lld-%lld | %d-%d\n", __func__, alignments.segCnt, alignments.segments[0].a, alignments.segments[0].b, subexons[tag].start, subexons[tag].end ) ;
-		ct.weight = 1.0 / alignments.GetNumberOfHits() ;
-		if ( alignments.IsGCRich() )
-			ct.weight *= 10 ;
-		ct.normAbund = 0 ;
-		ct.support = 1 ;
-		ct.uniqSupport = uniqSupport ;
-		ct.maxReadLen = alignments.GetRefCoverLength() ;
-		
-		if ( alignments.IsPrimary() && ConvertAlignmentToBitTable( alignments.segments, alignments.segCnt, 
-				subexons, seCnt, tag, ct ) )
+		if ( alignments.HasClipTail() )
 		{
-		
-			//printf( "%s ", alignments.GetReadId() ) ;
-			//ct.vector.Print() ;
-
-
-			// If the alignment has clipped end or tail. We only keep those clipped in the 3'/5'-end
-			bool validClip = true ;
-			if ( alignments.HasClipHead() )
-			{
-				if ( ( ct.first < seCnt - 1 && subexons[ct.first].end + 1 == subexons[ct.first + 1].start )
-					|| subexons[ct.first].prevCnt > 0 
-					|| alignments.segments[0].b - alignments.segments[0].a + 1 <= alignments.GetRefCoverLength() / 3.0  )	
-					validClip = false ;
-			}
-			if ( alignments.HasClipTail() )
-			{
-				int tmp = alignments.segCnt - 1 ;
-				if ( ( ct.last > 0 && subexons[ct.last].start - 1 == subexons[ct.last - 1].end ) 
-					|| subexons[ct.last].nextCnt > 0 
-					|| alignments.segments[tmp].b - alignments.segments[tmp].a + 1 <= alignments.GetRefCoverLength() / 3.0 )
-					validClip = false ;
-			}
+			int tmp = alignments.segCnt - 1 ;
+			if ( ( ct.last > 0 && subexons[ct.last].start - 1 == subexons[ct.last - 1].end ) 
+				|| subexons[ct.last].nextCnt > 0 
+				|| alignments.segments[tmp].b - alignments.segments[tmp].a + 1 <= alignments.GetRefCoverLength() / 3.0 )
+				validClip = false ;
+		}
 
-			if ( validClip )
+		if ( validClip )
+		{
+			constraints.push_back( ct ) ; // if we just coalesced but the list size does not decrease, this will force capacity increase.
+			//if ( !strcmp( alignments.GetReadId(), "ERR188021.8489052" ) )
+			//	ct.vector.Print()  ;
+			// Add the mate-pair information.
+			int mateChrId ;
+			int64_t matePos ;
+			alignments.GetMatePosition( mateChrId, matePos ) ;
+			if ( alignments.GetChromId() == mateChrId )
 			{
-				constraints.push_back( ct ) ; // if we just coalesced but the list size does not decrease, this will force capacity increase.
-				//if ( !strcmp( alignments.GetReadId(), "ERR188021.8489052" ) )
-				//	ct.vector.Print()  ;
-				// Add the mate-pair information.
-				int mateChrId ;
-				int64_t matePos ;
-				alignments.GetMatePosition( mateChrId, matePos ) ;
-				if ( alignments.GetChromId() == mateChrId )
+				if ( matePos < alignments.segments[0].a )
 				{
-					if ( matePos < alignments.segments[0].a )
-					{
-						int mateIdx = mateReadIds.Query( alignments.GetReadId(), alignments.segments[0].a ) ;
-						if ( mateIdx != -1 )
-						{
-							struct _matePairConstraint nm ;
-							nm.i = mateIdx ;
-							nm.j = constraints.size() - 1 ;
-							nm.abundance = 0 ;
-							nm.support = 1 ;
-							nm.uniqSupport = uniqSupport ; 
-							nm.effectiveCount = 2 ;
-							matePairs.push_back( nm ) ;
-						}
-					}
-					else if ( matePos > alignments.segments[0].a )
+					int mateIdx = mateReadIds.Query( alignments.GetReadId(), alignments.segments[0].a ) ;
+					if ( mateIdx != -1 )
 					{
-						mateReadIds.Insert( alignments.GetReadId(), alignments.segments[0].a, constraints.size() - 1, matePos ) ;					
-					}
-					else // two mates have the same coordinate.
-					{	
-						if ( alignments.IsFirstMate() )
-						{
-							struct _matePairConstraint nm ;
-							nm.i = constraints.size() - 1 ;
-							nm.j = constraints.size() - 1 ;
-							nm.abundance = 0 ;
-							nm.support = 1 ;
-							nm.uniqSupport = uniqSupport ; 
-							nm.effectiveCount = 2 ;
-							matePairs.push_back( nm ) ;
-						}
+						struct _matePairConstraint nm ;
+						nm.i = mateIdx ;
+						nm.j = constraints.size() - 1 ;
+						nm.abundance = 0 ;
+						nm.support = 1 ;
+						nm.uniqSupport = uniqSupport ; 
+						nm.effectiveCount = 2 ;
+						matePairs.push_back( nm ) ;
 					}
 				}
-			}
-			else
-				ct.vector.Release() ;
-
-			// Coalesce if necessary.
-			size = constraints.size() ;			
-			if ( (int)size > coalesceThreshold && size == (int)constraints.capacity() )
-			{
-				
-				//printf( "start coalescing. %d\n", constraints.capacity() ) ;
-				CoalesceSameConstraints() ;	
-
-				// Not coalesce enough
-				if ( constraints.size() >= constraints.capacity() / 2 )
+				else if ( matePos > alignments.segments[0].a )
 				{
-					coalesceThreshold *= 2 ;
+					mateReadIds.Insert( alignments.GetReadId(), alignments.segments[0].a, constraints.size() - 1, matePos ) ;					
+				}
+				else // two mates have the same coordinate.
+				{	
+					if ( alignments.IsFirstMate() )
+					{
+						struct _matePairConstraint nm ;
+						nm.i = constraints.size() - 1 ;
+						nm.j = constraints.size() - 1 ;
+						nm.abundance = 0 ;
+						nm.support = 1 ;
+						nm.uniqSupport = uniqSupport ; 
+						nm.effectiveCount = 2 ;
+						matePairs.push_back( nm ) ;
+					}
 				}
 			}
 		}
 		else
-		{
-			//printf( "not compatible\n" ) ;
 			ct.vector.Release() ;
+
+		// Coalesce if necessary.
+		int size = constraints.size() ;			
+		if ( size > coalesceThreshold && size == (int)constraints.capacity() )
+		{
+			
+			//printf( "start coalescing. %d\n", constraints.capacity() ) ;
+			CoalesceSameConstraints() ;	
+
+			// Not coalesce enough
+			if ( constraints.size() >= constraints.capacity() / 2 )
+			{
+				coalesceThreshold *= 2 ;
+			}
 		}
 	}
+	else
+	{
+		//printf( "not compatible\n" ) ;
+		ct.vector.Release() ;
+	}
+}
+
+void Constraints::EndConstraints( struct _subexon *subexons, int fragStdev, int readLen )
+{
+	int i ;
 	//printf( "start coalescing. %d %d\n", constraints.size(), matePairs.size() ) ;
 	CoalesceSameConstraints() ;
 	//printf( "after coalescing. %d %d\n", constraints.size(), matePairs.size() ) ;
@@ -402,7 +387,7 @@ int Constraints::BuildConstraints( struct _subexon *subexons, int seCnt, int sta
 	//	printf( "matePair: %d %d %d\n", matePairs[i].i, matePairs[i].j, matePairs[i].support ) ;
 	// single-end data set
 	//if ( matePairs.size() == 0 )
-	if ( alignments.fragStdev == 0 )
+	if ( fragStdev == 0 )
 	{
 		int size = constraints.size() ;
 		matePairs.clear() ;
@@ -421,7 +406,7 @@ int Constraints::BuildConstraints( struct _subexon *subexons, int seCnt, int sta
 		}
 	}
 	
-	ComputeNormAbund( subexons ) ;
+	ComputeNormAbund( subexons, readLen ) ;
 
 	/*for ( i = 0 ; i < constraints.size() ; ++i )
 	{
@@ -434,5 +419,82 @@ int Constraints::BuildConstraints( struct _subexon *subexons, int seCnt, int sta
 		printf( "mates %d: %lf %d %d %d %d\n", i, matePairs[i].normAbund, matePairs[i].i, matePairs[i].j, matePairs[i].support, matePairs[i].uniqSupport ) ;
 	}*/
 
+}
+
+// Move to the next alignment overlapping the subexons. Return false once the alignments are past them.
+template <class T>
+static bool NextGeneAlignment( T &alignments, struct _subexon *subexons, int seCnt, int &tag, bool &callNext )
+{
+	while ( !alignments.IsAtEnd() )
+	{
+		if ( callNext )
+		{
+			if ( !alignments.Next() )
+				return false ;
+		}
+		else
+			callNext = true ;
+
+		if ( alignments.GetChromId() < subexons[0].chrId )
+			continue ;
+		else if ( alignments.GetChromId() > subexons[0].chrId )
+			return false ;
+		// locate the first subexon in this region that overlapps with current alignment.
+		for ( ; tag < seCnt && subexons[tag].end < alignments.segments[0].a ; ++tag )
+			;
+		
+		if ( tag >= seCnt )
+			return false ;
+		if ( alignments.segments[ alignments.segCnt - 1 ].b < subexons[tag].start )
+			continue ;
+		return true ;
+	}
+	return false ;
+}
+
+template <class T>
+int Constraints::BuildConstraints( T &alignments, struct _subexon *subexons, int seCnt, int start, int end )
+{
+	int tag = 0 ;
+	alignments.Acquire() ;
+	BeginConstraints() ;
+	
+	// Start to build the constraints. 
+	bool callNext = false ; // the last used alignment
+	if ( alignments.IsAtBegin() )
+		callNext = true ;
+	while ( NextGeneAlignment( alignments, subexons, seCnt, tag, callNext ) )
+		AddConstraint( alignments, subexons, seCnt, tag ) ;
+	alignments.Release() ;
+	EndConstraints( subexons, alignments.fragStdev, alignments.readLen ) ;
+	return 0 ;
+}
+
+int Constraints::BuildReadGroupConstraints( Alignments &merged, std::vector<Constraints> &multiSampleConstraints, 
+	struct _subexon *subexons, int seCnt, int start, int end )
+{
+	int i ;
+	int tag = 0 ;
+	int sampleCnt = multiSampleConstraints.size() ;
+	for ( i = 0 ; i < sampleCnt ; ++i )
+		multiSampleConstraints[i].BeginConstraints() ;
+
+	bool callNext = merged.IsAtBegin() ;
+	while ( NextGeneAlignment( merged, subexons, seCnt, tag, callNext ) )
+	{
+		int k = merged.GetReadGroupIdx() ;
+		if ( k >= 0 && k < sampleCnt )
+			multiSampleConstraints[k].AddConstraint( merged, subexons, seCnt, tag ) ;
+	}
+
+	// The statistics of each sample are kept in its view of the merged file.
+	for ( i = 0 ; i < sampleCnt ; ++i )
+	{
+		Alignments *sample = multiSampleConstraints[i].pAlignments ;
+		multiSampleConstraints[i].EndConstraints( subexons, sample->fragStdev, sample->readLen ) ;
+	}
 	return 0 ;
 }
+
+template int Constraints::BuildConstraints<Alignments>( Alignments &, struct _subexon *, int, int, int ) ;
+template int Constraints::BuildConstraints<MemoryAlignments>( MemoryAlignments &, struct _subexon *, int, int, int ) ;
@@ -9,6 +9,7 @@
 
 #include "BitTable.hpp"
 #include "alignments.hpp"
+#include "AlignmentSource.hpp"
 #include "SubexonGraph.hpp"
 
 struct _constraint
@@ -238,6 +239,7 @@ private:
 	int prevStart, prevEnd ;	
 	bool usePrimaryAsUnique ;
 	MateReadIds mateReadIds ;
+	int coalesceThreshold ;
 
 	Alignments *pAlignments ;
 	
@@ -279,7 +281,13 @@ private:
 	}
 
 	void CoalesceSameConstraints() ;
-	void ComputeNormAbund( struct _subexon *subexons ) ;
+	void ComputeNormAbund( struct _subexon *subexons, int readLen ) ;
+
+	// BuildConstraints in steps: the alignments of a merged file are added to the constraints of their samples.
+	void BeginConstraints() ;
+	template <class T>
+	void AddConstraint( T &alignments, struct _subexon *subexons, int seCnt, int tag ) ;
+	void EndConstraints( struct _subexon *subexons, int fragStdev, int readLen ) ;
 public:
 	std::vector<struct _constraint> constraints ;
 	std::vector<struct _matePairConstraint> matePairs ; 
@@ -439,7 +447,14 @@ public:
 	}
 
 	int BuildConstraints( struct _subexon *subexons, int seCnt, int start, int end ) ;
-
+	// Build from any alignment source, see AlignmentSource.hpp. Instantiated for Alignments and MemoryAlignments.
+	template <class T>
+	int BuildConstraints( T &alignments, struct _subexon *subexons, int seCnt, int start, int end ) ;
+
+	// Build the constraints of every sample from one merged file, whose read groups are the samples. 
+	// multiSampleConstraints[k] is the sample of read group k.
+	static int BuildReadGroupConstraints( Alignments &merged, std::vector<Constraints> &multiSampleConstraints, 
+		struct _subexon *subexons, int seCnt, int start, int end ) ;
 } ;
 
 #endif
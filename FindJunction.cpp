@@ -9,27 +9,53 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
 
 #include "sam.h"
+#include "ReadGroups.hpp"
+#include "SeqComposition.hpp"
+#include "IntronTable.hpp"
 
 #define LINE_SIZE 8193
-#define QUEUE_SIZE 10001
+#define SAM_BLOCK_SIZE 4194304
 #define HASH_MAX 1000003
+#define MAX_CIGAR_SEG 2000
 
-struct _readTree
+// A read supporting a junction.
+struct _juncRead
 {
-	char id[256] ;
+	uint64_t hash ; // of the read id
+	char *id ; // interned in the slabs of the junction
 	int leftAnchor, rightAnchor ;
-	int pos ;
-	//bool secondary ;
 	bool valid ;
 	int editDistance ;
 	int NH, cnt ; // if cnt < NH, then it has real secondary match for this splice junction 
-	struct _readTree *left, *right ;
-
 	int flag ;// The flag from sam head.
 } ;
 
+struct _slab
+{
+	struct _slab *next ;
+	int size, used ;
+} ;
+
+// The reads of a junction: an open-addressing table over the hash of the read id. 
+// The reads, their ids and the table itself are carved from a chain of slabs, 
+// so a junction leaving the queue frees them in one step.
+struct _readSet
+{
+	struct _juncRead **table ;
+	int capacity, cnt ;
+	struct _slab *slabs ;
+} ;
+
 // The structure of a junction
 struct _junction
 {
@@ -40,31 +66,54 @@ struct _junction
 	int leftAnchor, rightAnchor ; // The longest left and right anchor
 	int oppositeAnchor ; // The longest anchor of the shorter side.
 	int uniqEditDistance, secEditDistance ;
-	struct _readTree head ;
+	struct _readSet reads ;
 } ;
 
-char line[LINE_SIZE] ;
-char col[11][LINE_SIZE] ; // The option fields is not needed.
-char strand ; // Extract XS field
-signed char noncanonStrandInfo ;
+// The current read. With --bamList each worker thread reads its own file, so these are per thread.
+__thread char *line ; // the SAM text record, in the block of the reader
+__thread char samReadId[LINE_SIZE] ;
+__thread char samChrome[LINE_SIZE] ;
+__thread char *samSeq ; // the sequence field of the SAM text record
+__thread char strand ; // Extract XS field
+__thread signed char noncanonStrandInfo ;
 //bool secondary ;
-int NH ;
-int editDistance ;
-int mateStart ;
+__thread int NH ;
+__thread int editDistance ;
+__thread int mateStart ;
 int filterYS ;
-int samFlag ;
-
-struct _junction junctionQueue[QUEUE_SIZE] ; // Expected only a few junctions in it for each read. This queue is sorted.
+__thread int samFlag ;
+__thread char *readId ; // samReadId for SAM text, or the read name in the BAM record
+__thread char *chrome ; // samChrome for SAM text, or the name in the BAM header
+__thread bool mateSameChrome ;
+__thread uint8_t *bamSeq ; // the packed sequence of the BAM record, NULL for SAM text
+__thread int readSeqLen ;
+
+// The state of one sample. A merged BAM file has one per read group, and each read goes to the state of its sample.
+struct _juncState
+{
+	// The open junctions, ordered by (start, end), and their (end, start) to find the junctions sharing an end.
+	std::map< std::pair<int, int>, struct _junction > junctions ;
+	std::set< std::pair<int, int> > junctionEnds ;
+	// The reads whose mate falls in their intron, by (mate position, hash of the read id). 
+	// Only the mate positions ahead of the scan are kept.
+	std::set< std::pair<int, uint64_t> > contradictedReads ;
+	char prevChrome[103] ;
+	IntronTableWriter *out ;
+} ;
 
-int qHead, qTail ;
+__thread struct _juncState *curState ; // the sample of the current read
 
 bool flagPrintJunction ;
 bool flagPrintAll ;
 bool flagStrict ; 
-int junctionCnt ;
+bool flagRemove ;
+bool hasMateReadIdSuffix ;
+bool binaryOutput ;
+__thread int junctionCnt ;
 bool anchorBoth ; 
-bool validRead ;
+__thread bool validRead ;
 int strandedLib ; // 0-unstranded, 1-rf, 2-fr
+int readThreads ;
 
 int flank ;
 struct _cigarSeg
@@ -73,8 +122,6 @@ struct _cigarSeg
 	char type ;
 } ;
 
-struct _readTree *contradictedReads ;
-
 char nucToNum[26] = { 0, 4, 1, 4, 4, 4, 2, 
 	4, 4, 4, 4, 4, 4, 4,
 		4, 4, 4, 4, 4, 3,
@@ -90,13 +137,16 @@ void PrintHelp()
 	    "\t-a: Output all the junctions, and use non-positive support number to indicate unqualified junctions.\n"
 	    "\t-y: If the bits from YS field of bam matches the argument, we filter the alignment (default: 4).\n"
 			"\t--stranded un/rf/fr: stranded library fr-firststrand/secondstrand (default: not set).\n"
+			"\t--readThreads INT: number of threads decompressing the BAM file ahead of the reader (default: 0, not used).\n"
+			"\t--readGroups STRING: the BAM file holds one sample per read group. The junctions of the k-th read group go to STRING_k.raw_splice (default: not used).\n"
+			"\t--bamList STRING: the input is a list of BAM files, one per line. The junctions of the k-th file go to STRING_k.raw_splice (default: not used).\n"
+			"\t-p INT: number of threads. With --bamList, the BAM files are processed at the same time; otherwise, or for a single BAM file in the list, the chromosomes of the indexed BAM file are (default: 1).\n"
+			"\t--binary: write the junctions as the binary intron table instead of text (default: not set).\n"
 	      ) ;
 }
 
-void GetJunctionInfo( struct _junction &junc, struct _readTree *p )
+void GetJunctionInfo( struct _junction &junc, struct _juncRead *p )
 {
-	if ( p == NULL )
-		return ;
 
 	if ( p->valid )
 	{
@@ -143,19 +193,17 @@ void GetJunctionInfo( struct _junction &junc, struct _readTree *p )
 				junc.oppositeAnchor = r ;
 		}
 	}
-	GetJunctionInfo( junc, p->left ) ;
-	GetJunctionInfo( junc, p->right ) ;
 }
 
-void PrintJunctionReads( struct _junction &junc, struct _readTree *p )
+void PrintJunctionReads( struct _junction &junc )
 {
-	if ( p == NULL )
-		return ;
-
-	if ( p->valid )
-		printf( "%s\n", p->id ) ;
-	PrintJunctionReads( junc, p->left ) ;
-	PrintJunctionReads( junc, p->right ) ;
+	int i ;
+	for ( i = 0 ; i < junc.reads.capacity ; ++i )
+	{
+		struct _juncRead *p = junc.reads.table[i] ;
+		if ( p != NULL && p->valid )
+			printf( "%s\n", p->id ) ;
+	}
 }
 
 void PrintJunction( char *chrome, struct _junction &junc )
@@ -168,7 +216,9 @@ void PrintJunction( char *chrome, struct _junction &junc )
 	junc.secReadCnt = 0 ;
 	junc.uniqEditDistance = 0 ;
 	junc.secEditDistance = 0 ;
-	GetJunctionInfo( junc, &junc.head ) ;
+	for ( int i = 0 ; i < junc.reads.capacity ; ++i )
+		if ( junc.reads.table[i] != NULL )
+			GetJunctionInfo( junc, junc.reads.table[i] ) ;
 
 	sum = junc.readCnt + junc.secReadCnt ;
 
@@ -196,308 +246,278 @@ void PrintJunction( char *chrome, struct _junction &junc )
 			junc.secReadCnt = 0 ;
 	}*/
 
-	printf( "%s %d %d %d %c %d %d %d %d\n", chrome, junc.start - 1, junc.end + 1, sum, junc.strand, 
-		junc.readCnt, junc.secReadCnt, junc.uniqEditDistance, junc.secEditDistance ) ;
-	//PrintJunctionReads( junc, &junc.head ) ;
+	struct _intronRecord r ;
+	r.start = junc.start - 1 ;
+	r.end = junc.end + 1 ;
+	r.support = sum ;
+	r.strand = junc.strand ;
+	r.uniqSupport = junc.readCnt ;
+	r.secSupport = junc.secReadCnt ;
+	r.uniqEditDist = junc.uniqEditDistance ;
+	r.secEditDist = junc.secEditDistance ;
+	curState->out->Add( chrome, r ) ;
+	//PrintJunctionReads( junc ) ;
 }
 
-void ClearReadTree( struct _readTree *p )
+uint64_t HashReadId( const char *id )
 {
-	if ( p == NULL )
-		return ;
-	ClearReadTree( p->left ) ;
-	ClearReadTree( p->right ) ;
-	free( p ) ;
+	uint64_t h = 14695981039346656037ULL ; // FNV-1a
+	for ( ; *id ; ++id )
+		h = ( h ^ (unsigned char)*id ) * 1099511628211ULL ;
+	return h ;
 }
 
-// Insert to the read tree
-bool InsertReadTree( struct _readTree *p, char *id, int l, int r )
+void InitReadSet( struct _readSet &set )
 {
-	int tmp = strcmp( p->id, id ) ;
-	if ( tmp == 0 )
+	set.table = NULL ;
+	set.capacity = set.cnt = 0 ;
+	set.slabs = NULL ;
+}
+
+void ClearReadSet( struct _readSet &set )
+{
+	while ( set.slabs != NULL )
 	{
-		p->cnt += 1 ;
-		return true ;
+		struct _slab *next = set.slabs->next ;
+		free( set.slabs ) ;
+		set.slabs = next ;
 	}
-	else if ( tmp < 0 )
+	InitReadSet( set ) ;
+}
+
+// Bump allocation from the newest slab. The slabs double in size, so a junction with few reads stays small.
+void *SlabAlloc( struct _readSet &set, int size )
+{
+	size = ( size + 7 ) & ~7 ;
+	struct _slab *slab = set.slabs ;
+	if ( slab == NULL || slab->used + size > slab->size )
 	{
-		if ( p->left )
-			return InsertReadTree( p->left, id, l, r ) ;
-		else
-		{
-			p->left = (struct _readTree *)malloc( sizeof( struct _readTree ) ) ;	
-			strcpy( p->left->id, id ) ;
-			p->left->leftAnchor = l ;
-			p->left->rightAnchor = r ;
-			//p->left->secondary = secondary ;
-			p->left->editDistance = editDistance ;
-			p->left->left = p->left->right = NULL ;
-			p->left->valid = validRead ;
-			p->left->cnt = 1 ;
-			p->left->NH = NH ;
-			p->left->flag = samFlag ;
-			return false ;
-		}
+		int slabSize = ( slab == NULL ) ? 512 : 2 * slab->size ;
+		if ( slabSize > 65536 )
+			slabSize = 65536 ;
+		if ( slabSize < size )
+			slabSize = size ;
+		slab = (struct _slab *)malloc( sizeof( struct _slab ) + slabSize ) ;
+		slab->next = set.slabs ;
+		slab->size = slabSize ;
+		slab->used = 0 ;
+		set.slabs = slab ;
 	}
-	else
+	void *ret = (char *)( slab + 1 ) + slab->used ;
+	slab->used += size ;
+	return ret ;
+}
+
+// The slot of the read, or the empty slot where it belongs.
+int ReadSetSlot( struct _readSet &set, const char *id, uint64_t hash )
+{
+	int mask = set.capacity - 1 ;
+	int i = (int)( hash & mask ) ;
+	while ( set.table[i] != NULL )
 	{
-		if ( p->right )
-			return InsertReadTree( p->right, id, l, r ) ;
-		else
-		{
-			p->right = (struct _readTree *)malloc( sizeof( struct _readTree ) ) ;	
-			strcpy( p->right->id, id ) ;
-			p->right->leftAnchor = l ;
-			p->right->rightAnchor = r ;
-			//p->right->secondary = secondary ;
-			p->right->editDistance = editDistance ;
-			p->right->left = p->right->right = NULL ;
-			p->right->valid = validRead ;
-			p->right->cnt = 1 ;
-			p->right->NH = NH ;
-			p->right->flag = samFlag ;
-			return false ;
-		}
+		if ( set.table[i]->hash == hash && !strcmp( set.table[i]->id, id ) )
+			break ;
+		i = ( i + 1 ) & mask ;
 	}
+	return i ;
 }
 
-
-bool SearchContradictedReads( struct _readTree *p, char *id, int pos )
+struct _juncRead *GetJuncRead( struct _readSet &set, const char *id, uint64_t hash )
 {
-	if ( p == NULL )
-		return false ;
-	int tmp = strcmp( p->id, id ) ;
-	if ( tmp == 0 && p->pos == pos )
-		return true ;
-	else if ( tmp <= 0 )
-		return SearchContradictedReads( p->left, id, pos ) ;
-	else
-		return SearchContradictedReads( p->right, id, pos ) ;
+	if ( set.cnt == 0 )
+		return NULL ;
+	return set.table[ ReadSetSlot( set, id, hash ) ] ;
 }
 
-bool InsertContradictedReads( struct _readTree *p, char *id, int pos )
+// Add the current read to the junction. Return true if the read is already there.
+bool InsertJuncRead( struct _readSet &set, const char *id, uint64_t hash, int l, int r )
 {
-	if ( p == NULL )
-	{
-		contradictedReads = (struct _readTree *)malloc( sizeof( struct _readTree ) ) ;	
-		strcpy( contradictedReads->id, id ) ;
-		contradictedReads->pos = pos ;
-		contradictedReads->left = contradictedReads->right = NULL ;
-		return false ;
-	}
-	int tmp = strcmp( p->id, id ) ;
-	if ( tmp == 0 && p->pos == pos )
-		return true ;
-	else if ( tmp <= 0 )
+	int i ;
+	if ( 2 * ( set.cnt + 1 ) > set.capacity )
 	{
-		if ( p->left )
-			return InsertContradictedReads( p->left, id, pos ) ;
-		else
-		{
-			p->left = (struct _readTree *)malloc( sizeof( struct _readTree ) ) ;	
-			strcpy( p->left->id, id ) ;
-			p->left->pos = pos ;
-			p->left->left = p->left->right = NULL ;
-			return false ;
-		}
+		// The old table stays in the slabs until the junction is cleared.
+		struct _juncRead **old = set.table ;
+		int oldCapacity = set.capacity ;
+		set.capacity = ( oldCapacity == 0 ) ? 4 : 2 * oldCapacity ;
+		set.table = (struct _juncRead **)SlabAlloc( set, sizeof( struct _juncRead * ) * set.capacity ) ;
+		memset( set.table, 0, sizeof( struct _juncRead * ) * set.capacity ) ;
+		for ( i = 0 ; i < oldCapacity ; ++i )
+			if ( old[i] != NULL )
+				set.table[ ReadSetSlot( set, old[i]->id, old[i]->hash ) ] = old[i] ;
 	}
-	else
+
+	i = ReadSetSlot( set, id, hash ) ;
+	if ( set.table[i] != NULL )
 	{
-		if ( p->right )
-			return InsertContradictedReads( p->right, id, pos ) ;
-		else
-		{
-			p->right = (struct _readTree *)malloc( sizeof( struct _readTree ) ) ;	
-			strcpy( p->right->id, id ) ;
-			p->right->pos = pos ;
-			p->right->left = p->right->right = NULL ;
-			return false ;
-		}
+		set.table[i]->cnt += 1 ;
+		return true ;
 	}
+	
+	int len = strlen( id ) ;
+	struct _juncRead *p = (struct _juncRead *)SlabAlloc( set, sizeof( struct _juncRead ) ) ;
+	p->id = (char *)SlabAlloc( set, len + 1 ) ;
+	memcpy( p->id, id, len + 1 ) ;
+	p->hash = hash ;
+	p->leftAnchor = l ;
+	p->rightAnchor = r ;
+	//p->secondary = secondary ;
+	p->editDistance = editDistance ;
+	p->valid = validRead ;
+	p->cnt = 1 ;
+	p->NH = NH ;
+	p->flag = samFlag ;
+	set.table[i] = p ;
+	++set.cnt ;
+	return false ;
+}
+
+
+bool SearchContradictedReads( uint64_t idHash, int pos )
+{
+	std::set< std::pair<int, uint64_t> > &contradictedReads = curState->contradictedReads ;
+	return contradictedReads.find( std::make_pair( pos, idHash ) ) != contradictedReads.end() ;
 }
 
-struct _readTree *GetReadTreeNode( struct _readTree *p, char *id )
+void InsertContradictedReads( uint64_t idHash, int pos )
 {
-	if ( p == NULL )
-		return NULL ;
-	int tmp = strcmp( p->id, id ) ;
-	if ( tmp == 0 )
-		return p ;
-	else if ( tmp < 0 )
-		return GetReadTreeNode( p->left, id ) ;
-	else
-		return GetReadTreeNode( p->right, id ) ;
+	curState->contradictedReads.insert( std::make_pair( pos, idHash ) ) ;
+}
+
+// Drop the reads whose mate is before pos. The input is sorted, so they are never searched again.
+void EvictContradictedReads( int pos )
+{
+	std::set< std::pair<int, uint64_t> > &contradictedReads = curState->contradictedReads ;
+	contradictedReads.erase( contradictedReads.begin(), 
+		contradictedReads.lower_bound( std::make_pair( pos, (uint64_t)0 ) ) ) ;
 }
 
-// Insert the new junction into the queue, 
-// and make sure the queue is sorted.
+// Insert the new junction.
 // Assume each junction range is only on one strand. 
 // l, r is the left and right anchor from a read
-void InsertQueue( int start, int end, int l, int r )
+void InsertQueue( int start, int end, int l, int r, uint64_t idHash )
 {
-	int i, j ;
-	i = qTail ;
-	
-
-	while ( i != qHead )
-	{
-		j = i - 1 ;
-		if ( j < 0 )
-			j = QUEUE_SIZE - 1 ;
-		
-		if ( junctionQueue[j].start < start 
-			|| ( junctionQueue[j].start == start && junctionQueue[j].end < end ) )
-			break ;
-		
-		junctionQueue[i] = junctionQueue[j] ;
-		--i ;
-		
-		if ( i < 0 )
-			i = QUEUE_SIZE - 1 ;
-	}
+	struct _junction &junc = curState->junctions[ std::make_pair( start, end ) ] ;
+	curState->junctionEnds.insert( std::make_pair( end, start ) ) ;
 	
-	junctionQueue[i].start = start ;
-	junctionQueue[i].end = end ;
+	junc.start = start ;
+	junc.end = end ;
 	/*if ( !secondary )
 	{
-		junctionQueue[i].readCnt = 1 ;
-		junctionQueue[i].secReadCnt = 0 ;
+		junc.readCnt = 1 ;
+		junc.secReadCnt = 0 ;
 	}
 	else
 	{
-		junctionQueue[i].readCnt = 0 ;
-		junctionQueue[i].secReadCnt = 1 ;
+		junc.readCnt = 0 ;
+		junc.secReadCnt = 1 ;
 	}*/
-	junctionQueue[i].strand = strand ;
-	junctionQueue[i].leftAnchor = l ;
-	junctionQueue[i].rightAnchor = r ;
+	junc.strand = strand ;
+	junc.leftAnchor = l ;
+	junc.rightAnchor = r ;
 	
-	strcpy( junctionQueue[i].head.id, col[0] ) ;
-	junctionQueue[i].head.valid = validRead ;
-	junctionQueue[i].head.leftAnchor = l ;
-	junctionQueue[i].head.rightAnchor = r ;
-	junctionQueue[i].head.left = junctionQueue[i].head.right = NULL ;
-	//junctionQueue[i].head.secondary = secondary ;
-	junctionQueue[i].head.NH = NH ;
-	junctionQueue[i].head.cnt = 1 ;
-	junctionQueue[i].head.editDistance = editDistance ;
-
-	++qTail ;
-	if ( qTail >= QUEUE_SIZE )
-		qTail = 0 ;
+	InitReadSet( junc.reads ) ;
+	InsertJuncRead( junc.reads, readId, idHash, l, r ) ;
 }
 
-// Search the queue, and remove the heads if its end(start) is smaller than prune.(Because it is impossible to have that junction again) 
-// Add the junction to the queue, if it is not in it. 
-// Return true, if it finds the junction. Otherwise, return false.
-bool SearchQueue( int start, int end, int prune, int l, int r )
+// The read has a junction sharing the start or the end with junc. 
+// If readIsLonger, the other end of the read's junction is farther out, and the read's alignment is the false one.
+void TestFalseAlignment( struct _junction &junc, bool readIsLonger, int l, int r, uint64_t idHash )
 {
-	int i ;
-	
-	// Test whether this read might be a false alignment.
-	i = qHead ;
-	while ( i != qTail )
+	struct _juncRead *rt = GetJuncRead( junc.reads, readId, idHash ) ;
+	// the commented out logic because it is handled by contradicted reads
+	if ( rt == NULL ) //|| ( rt->flag & 0x40 ) == ( samFlag & 0x40 ) )
+		return ;
+	if ( readIsLonger )
 	{
-		struct _readTree *rt ;
-		if ( ( junctionQueue[i].start == start && junctionQueue[i].end < end ) ||
-			( junctionQueue[i].start > start && junctionQueue[i].end == end ) )
+		// This alignment is false ;
+		if ( rt->leftAnchor <= flank || rt->rightAnchor <= flank )//|| rt->secondary )
 		{
-			// This alignment is false ;
-			rt = GetReadTreeNode( &junctionQueue[i].head, col[0] ) ;
-			// the commented out logic because it is handled by contradicted reads
-			if ( rt != NULL ) //&& ( rt->flag & 0x40 ) != ( samFlag & 0x40 ) )
-			{
-				if ( rt->leftAnchor <= flank || rt->rightAnchor <= flank )//|| rt->secondary )
-				{
-					if ( l > flank && r > flank )//&& !secondary ) 
-						rt->valid = false ;
-					else
-						validRead = false ;
-				}
-				else
-				{
-					// Ignore this read
-					//return true ;
-					validRead = false ;
-				}
-			}
+			if ( l > flank && r > flank )//&& !secondary ) 
+				rt->valid = false ;
+			else
+				validRead = false ;
 		}
-		else if ( ( junctionQueue[i].start == start && junctionQueue[i].end > end ) ||
-			( junctionQueue[i].start < start && junctionQueue[i].end == end ) )
+		else
 		{
-			// This other alignment is false ;
-			rt = GetReadTreeNode( &junctionQueue[i].head, col[0] ) ;
-			//if ( rt != NULL )
-			if ( rt != NULL ) //&& ( rt->flag & 0x40 ) != ( samFlag & 0x40 ) )
-			{
-				if ( l <= flank || r <= flank )//|| secondary )
-				{
-					if ( rt->leftAnchor > flank && rt->rightAnchor > flank )//&& !rt->secondary )
-						validRead = false ;
-					else
-						rt->valid = false ;
-				}
-				else	
-					rt->valid = false ;
-			}
+			// Ignore this read
+			//return true ;
+			validRead = false ;
+		}
+	}
+	else
+	{
+		// This other alignment is false ;
+		if ( l <= flank || r <= flank )//|| secondary )
+		{
+			if ( rt->leftAnchor > flank && rt->rightAnchor > flank )//&& !rt->secondary )
+				validRead = false ;
+			else
+				rt->valid = false ;
 		}
-		++i ;
-		if ( i >= QUEUE_SIZE )
-			i = 0 ;
+		else	
+			rt->valid = false ;
+	}
+}
+
+// Remove the junctions in the front if its end is smaller than prune.(Because it is impossible to have that junction again) 
+// Add the junction, if it is not there.
+// Return true, if it finds the junction. Otherwise, return false.
+bool SearchQueue( int start, int end, int prune, int l, int r, uint64_t idHash )
+{
+	std::map< std::pair<int, int>, struct _junction > &junctions = curState->junctions ;
+	std::set< std::pair<int, int> > &junctionEnds = curState->junctionEnds ;
+	std::map< std::pair<int, int>, struct _junction >::iterator it ;
+	std::set< std::pair<int, int> >::iterator eit ;
+	
+	// Test whether this read might be a false alignment.
+	// Only the junctions with the same start or the same end matter.
+	for ( it = junctions.lower_bound( std::make_pair( start, INT_MIN ) ) ; it != junctions.end() && it->first.first == start ; ++it )
+	{
+		if ( it->first.second != end )
+			TestFalseAlignment( it->second, it->first.second < end, l, r, idHash ) ;
+	}
+	for ( eit = junctionEnds.lower_bound( std::make_pair( end, INT_MIN ) ) ; eit != junctionEnds.end() && eit->first == end ; ++eit )
+	{
+		if ( eit->second != start )
+			TestFalseAlignment( junctions[ std::make_pair( eit->second, end ) ], eit->second > start, l, r, idHash ) ;
 	}
 	
 	//if ( start == 8077108 && end == 8078439 )
 	//	exit( 1 ) ;
-	i = qHead ;
+	
+	// The output is sorted, so only the front can be popped.
+	while ( !junctions.empty() && junctions.begin()->second.end < prune )
+	{
+		// pop
+		struct _junction &junc = junctions.begin()->second ;
+		PrintJunction( chrome, junc ) ;
+		ClearReadSet( junc.reads ) ;
+		junctionEnds.erase( std::make_pair( junc.end, junc.start ) ) ;
+		junctions.erase( junctions.begin() ) ;
+	}
 
-	while ( i != qTail )
+	it = junctions.find( std::make_pair( start, end ) ) ;
+	if ( it != junctions.end() )
 	{
-		if ( junctionQueue[i].start == start && 
-			junctionQueue[i].end == end )
-		{
-			if (junctionQueue[i].strand == '?' && junctionQueue[i].strand != strand )
-			{
-				junctionQueue[i].strand = strand ;
-			}
-			InsertReadTree( &junctionQueue[i].head, col[0], l, r ) ; 
-			return true ;
-		}
-		
-		if ( junctionQueue[i].end < prune && i == qHead )
+		if ( it->second.strand == '?' && it->second.strand != strand )
 		{
-			// pop
-			PrintJunction( col[2], junctionQueue[i] ) ;
-			ClearReadTree( junctionQueue[i].head.left ) ;
-			ClearReadTree( junctionQueue[i].head.right ) ;
-			++qHead ;
-			if ( qHead >= QUEUE_SIZE )
-				qHead = 0 ;
+			it->second.strand = strand ;
 		}
-		++i ;
-		if ( i >= QUEUE_SIZE )
-			i = 0 ;
+		InsertJuncRead( it->second.reads, readId, idHash, l, r ) ; 
+		return true ;
 	}
 	
-	InsertQueue( start, end, l, r ) ;
+	InsertQueue( start, end, l, r, idHash ) ;
 	return false ;
 }
 
-// Compute the junctions based on the CIGAR  
-bool CompareJunctions( int startLocation, char *cigar )
+// Split the CIGAR text of length len into segments. Return the number of segments, or -1 if there are too many.
+int ParseCigarString( const char *cigar, int len, struct _cigarSeg *cigarSeg )
 {
-	int currentLocation = startLocation ; // Current location on the reference genome
-	int i, j ;
-	int num ;
-	int newJuncCnt = 0 ; // The # of junctions in the read, and the # of new junctions among them.
-	
-	struct _cigarSeg cigarSeg[2000] ; // A segment of the cigar.
-	int ccnt = 0 ; // cigarSeg cnt
-
-	j = 0 ;
-	num = 0 ;
-	validRead = true ;
-
-	for ( i = 0 ; cigar[i] ; ++i )
+	int i ;
+	int num = 0 ;
+	int ccnt = 0 ;
+	for ( i = 0 ; i < len ; ++i )
 	{
 		if ( cigar[i] >= '0' && cigar[i] <= '9' )
 		{
@@ -505,12 +525,72 @@ bool CompareJunctions( int startLocation, char *cigar )
 		}
 		else
 		{
+			if ( ccnt >= MAX_CIGAR_SEG - 1 )
+				return -1 ;
 			cigarSeg[ccnt].len = num ;
 			cigarSeg[ccnt].type = cigar[i] ;
 			++ccnt ;
 			num = 0 ;
 		}
 	}
+	cigarSeg[ccnt].len = 0 ;
+	cigarSeg[ccnt].type = '\0' ;
+	return ccnt ;
+}
+
+// The same from the binary CIGAR of a BAM record.
+int ParseBamCigar( bam1_t *b, struct _cigarSeg *cigarSeg )
+{
+	int i ;
+	int ccnt = b->core.n_cigar ;
+	uint32_t *cigar = bam1_cigar( b ) ;
+	if ( ccnt >= MAX_CIGAR_SEG )
+		return -1 ;
+	for ( i = 0 ; i < ccnt ; ++i )
+	{
+		cigarSeg[i].len = cigar[i] >> BAM_CIGAR_SHIFT ;
+		cigarSeg[i].type = BAM_CIGAR_STR[ cigar[i] & BAM_CIGAR_MASK ] ;
+	}
+	cigarSeg[ccnt].len = 0 ;
+	cigarSeg[ccnt].type = '\0' ;
+	return ccnt ;
+}
+
+bool HasIntron( struct _cigarSeg *cigarSeg, int ccnt )
+{
+	int i ;
+	for ( i = 0 ; i < ccnt ; ++i )
+		if ( cigarSeg[i].type == 'N' )
+			return true ;
+	return false ;
+}
+
+// Add the composition of the bases [from, to) of the read to count, stopping at the end of the read.
+void CountReadBases( int from, int to, int count[5] )
+{
+	int i ;
+	if ( to > readSeqLen )
+		to = readSeqLen ;
+	if ( bamSeq != NULL )
+	{
+		CountPackedBases( bamSeq, from, to, count ) ;
+		return ;
+	}
+	for ( i = from ; i < to ; ++i )
+		++count[ (unsigned char) nucToNum[ samSeq[i] - 'A' ] ] ;
+}
+
+// Compute the junctions based on the CIGAR  
+bool CompareJunctions( int startLocation, struct _cigarSeg *cigarSeg, int ccnt )
+{
+	int currentLocation = startLocation ; // Current location on the reference genome
+	int i, j ;
+	int newJuncCnt = 0 ; // The # of junctions in the read, and the # of new junctions among them.
+	std::map< std::pair<int, int>, struct _junction > &junctions = curState->junctions ;
+	uint64_t idHash = HashReadId( readId ) ;
+
+	validRead = true ;
+	EvictContradictedReads( startLocation ) ;
 
 	// Filter low complex alignment.
 	// Only applies this to alignments does not have a strand information.
@@ -545,9 +625,8 @@ bool CompareJunctions( int startLocation, char *cigar )
 					case 'M':
 					case 'I':
 						{
-							for ( j = 0 ; j < cigarSeg[i].len ; ++j )
-								++count[ (unsigned char) nucToNum[  col[9][pos + j] - 'A' ] ] ;
-							pos += j ;
+							CountReadBases( pos, pos + cigarSeg[i].len, count ) ;
+							pos += cigarSeg[i].len ;
 						} break ;
 					case 'N':
 						{
@@ -606,7 +685,7 @@ bool CompareJunctions( int startLocation, char *cigar )
 	}
 
 	// Test whether contradict with mate pair
-	if ( col[6][0] == '=' )
+	if ( mateSameChrome )
 	{
 		currentLocation = startLocation ;
 		for ( i = 0 ; i < ccnt ; ++i )
@@ -625,7 +704,7 @@ bool CompareJunctions( int startLocation, char *cigar )
 				}*/
 					// ignore this read
 					//return false ;
-					InsertContradictedReads( contradictedReads, col[0], mateStart ) ;
+					InsertContradictedReads( idHash, mateStart ) ;
 					validRead = false ;
 					break ;
 				}
@@ -633,20 +712,19 @@ bool CompareJunctions( int startLocation, char *cigar )
 			currentLocation += cigarSeg[i].len ;
 		}
 
-		i = qHead ;
 		// Search if it falls in the splices junction created by its mate.
-		while ( i != qTail )
+		if ( SearchContradictedReads( idHash, startLocation ) )
 		{
-			if ( mateStart < junctionQueue[i].start && junctionQueue[i].start <= startLocation 
-				&& startLocation <= junctionQueue[i].end 
-				&& SearchContradictedReads( contradictedReads, col[0], startLocation ) )
+			std::map< std::pair<int, int>, struct _junction >::iterator it ;
+			for ( it = junctions.upper_bound( std::make_pair( mateStart, INT_MAX ) ) ; 
+				it != junctions.end() && it->first.first <= startLocation ; ++it )
 			{
-				validRead = false ;
-				break ;
+				if ( startLocation <= it->second.end )
+				{
+					validRead = false ;
+					break ;
+				}
 			}
-			++i ;
-			if ( i >= QUEUE_SIZE )
-				i = 0 ;
 		}
 	}
 
@@ -688,7 +766,7 @@ bool CompareJunctions( int startLocation, char *cigar )
 			else
 				right = 0 ;
 			i = tmp ;
-			if ( !SearchQueue( currentLocation, currentLocation + cigarSeg[i].len - 1, startLocation, left, right ) )
+			if ( !SearchQueue( currentLocation, currentLocation + cigarSeg[i].len - 1, startLocation, left, right, idHash ) )
 			{
 				++newJuncCnt ;
 			}
@@ -762,149 +840,248 @@ char GetStrandFromStrandedLib(int flag)
 	}
 }
 
-int main( int argc, char *argv[] ) 
+bool IsBamFile( const char *file )
 {
-	FILE *fp ;
- 	samfile_t *fpsam ;
-	bam1_t *b = NULL ;
-	bool useSam = true ;
+	int len = strlen( file ) ;
+	return len >= 3 && ( file[len-3] == 'b' || file[len-3] == 'B' ) ;
+}
 
- 	int i, len ;
- 	int startLocation ; 
-	bool flagRemove = false ;
-	char prevChrome[103] ;
+// Reads the lines of SAM text in large blocks. 
+// A line is terminated in place and stays valid until the next call.
+struct _samTextReader
+{
+	FILE *fp ;
+	char *buffer ;
+	int size ;
+	int begin, end ; // the bytes not returned yet
+	bool eof ;
+} ;
 
-	anchorBoth = false ;	
-	
-	flagPrintJunction = false ;
-	flagPrintAll = false ;
-	flagStrict = false ;
-	junctionCnt = 0 ;
-	bool hasMateReadIdSuffix = false ;
+void InitSamTextReader( struct _samTextReader &reader, FILE *fp )
+{
+	reader.fp = fp ;
+	reader.size = SAM_BLOCK_SIZE ;
+	reader.buffer = (char *)malloc( reader.size ) ;
+	reader.begin = reader.end = 0 ;
+	reader.eof = false ;
+}
 
-	strcpy( prevChrome, "" ) ;
-	flagRemove = true ;
-	flagPrintJunction = true ;
-	flank = 8 ;
-	filterYS = 4 ;
-	strandedLib = 0 ;
+void ReleaseSamTextReader( struct _samTextReader &reader )
+{
+	free( reader.buffer ) ;
+	reader.buffer = NULL ;
+}
 
-	contradictedReads = NULL ;
-	
-	// processing the argument list
-	for ( i = 1 ; i < argc ; ++i )
+// Return the next line without the line break, or NULL at the end.
+char *ReadSamLine( struct _samTextReader &reader )
+{
+	while ( 1 )
 	{
-		if ( !strcmp( argv[i], "-h" ) )
+		char *s = reader.buffer + reader.begin ;
+		char *newLine = (char *)memchr( s, '\n', reader.end - reader.begin ) ;
+		if ( newLine != NULL )
 		{
-			PrintHelp() ;
-			return 0 ;
+			*newLine = '\0' ;
+			reader.begin = newLine - reader.buffer + 1 ;
+			return s ;
 		}
-		else if ( !strcmp( argv[i], "-r" ) )
+		if ( reader.eof )
 		{
-			flagRemove = true ;
+			if ( reader.begin >= reader.end )
+				return NULL ;
+			// The last line has no line break. There is always a byte left after the data.
+			reader.buffer[ reader.end ] = '\0' ;
+			reader.begin = reader.end ;
+			return s ;
 		}
-		else if ( !strcmp( argv[i], "-j" ) )
+
+		// Move the partial line to the front, and fill the rest of the block.
+		if ( reader.begin > 0 )
 		{
-			strcpy( prevChrome, "" ) ;
-			flagRemove = true ;
-			flagPrintJunction = true ;
-			flank = atoi( argv[i + 1] ) ;
-			if ( i + 2 < argc && !strcmp( argv[i+2], "-B" ) )
-			{
-				anchorBoth = true ;
-				++i ;		
-			}
-			++i ;
+			memmove( reader.buffer, s, reader.end - reader.begin ) ;
+			reader.end -= reader.begin ;
+			reader.begin = 0 ;
 		}
-		else if ( !strcmp( argv[i], "-a" ) )
+		if ( reader.end + 1 >= reader.size )
 		{
-			flagPrintAll = true ;
+			reader.size *= 2 ;
+			reader.buffer = (char *)realloc( reader.buffer, reader.size ) ;
 		}
-		else if ( !strcmp( argv[i], "--strict" ) )
+		int cnt = fread( reader.buffer + reader.end, 1, reader.size - reader.end - 1, reader.fp ) ;
+		if ( cnt <= 0 )
+			reader.eof = true ;
+		reader.end += cnt > 0 ? cnt : 0 ;
+	}
+}
+
+// Find the fields of a SAM text line without copying them. fields[i] is not terminated, its length is lens[i].
+// Return the number of fields found, up to maxFieldCnt. The rest of the line goes to the last one,
+// and the fields not found are empty.
+int SplitSamLine( char *line, char **fields, int *lens, int maxFieldCnt )
+{
+	int i ;
+	int cnt = 0 ;
+	char *p = line ;
+	while ( cnt < maxFieldCnt )
+	{
+		char *tab = ( cnt < maxFieldCnt - 1 ) ? strchr( p, '\t' ) : NULL ;
+		fields[cnt] = p ;
+		if ( tab == NULL )
 		{
-			flagStrict = true ;
+			lens[cnt] = strlen( p ) ;
+			++cnt ;
+			break ;
 		}
-		else if ( !strcmp( argv[i], "-y" ) )
+		lens[cnt] = tab - p ;
+		++cnt ;
+		p = tab + 1 ;
+	}
+	for ( i = cnt ; i < maxFieldCnt ; ++i )
+	{
+		fields[i] = fields[cnt - 1] + lens[cnt - 1] ;
+		lens[i] = 0 ;
+	}
+	return cnt ;
+}
+
+// An opened SAM/BAM input. If iter is set, only the records of one region of the BAM file are read.
+struct _juncInput
+{
+	FILE *fp ;
+	samfile_t *fpsam ;
+	bool useSam ;
+	bam1_t *b ;
+	bam_iter_t iter ;
+	struct _samTextReader text ;
+} ;
+
+// Return false if the file can not be opened. readThreads decompress the BAM file ahead of the reader.
+bool OpenJuncInput( const char *file, struct _juncInput &in, int readThreads )
+{
+	in.fp = NULL ;
+	in.fpsam = NULL ;
+	in.useSam = true ;
+	in.b = NULL ;
+	in.iter = NULL ;
+	if ( IsBamFile( file ) )
+	{	
+		if ( !( in.fpsam = samopen( file, "rb", 0 ) ) )
+			return false ;
+
+		if ( !in.fpsam->header )
 		{
-			filterYS = atoi( argv[i + 1] ) ;
-			++i ;
+			//samclose( fpsam ) ;
+			//fpsam = samopen( file, "r", 0 ) ;
+			//if ( !fpsam->header )
+			//{
+			in.useSam = false ;
+			in.fp = fopen( file, "r" ) ;
+			//}
 		}
-		else if ( !strcmp( argv[i], "--hasMateIdSuffix" ) )
+		else if ( readThreads > 0 )
+			bgzf_mt_read( in.fpsam->x.bam, readThreads, 8 ) ;
+	}
+	else
+	{
+		in.useSam = false ;
+		if ( !strcmp( file, "-" ) )
+			in.fp = stdin ;
+		else
+			in.fp = fopen( file, "r" ) ;
+		if ( in.fp == NULL )
 		{
-			hasMateReadIdSuffix = true ;
-			++i ;
-		}
-		else if ( !strcmp( argv[i], "--stranded" ) )
-		{
-			if ( !strcmp(argv[i + 1], "un") ) 
-				strandedLib = 0 ;
-			else if ( !strcmp(argv[i + 1], "rf") )
-				strandedLib = 1 ;
-			else if ( !strcmp(argv[i + 1], "fr" ) )
-				strandedLib = 2 ;
-			++i ;
-		}
-		else if ( i > 1 )
-		{
-			printf( "Unknown option %s\n", argv[i] ) ;
-			exit( 1 ) ;
+			printf( "Could not open file %s\n", file ) ;
+			return false ;
 		}
 	}
-	if ( argc == 1 )
+	if ( in.useSam )
+		in.b = bam_init1() ;
+	else
+		InitSamTextReader( in.text, in.fp ) ;
+	return true ;
+}
+
+void CloseJuncInput( struct _juncInput &in )
+{
+	if ( in.iter != NULL )
+		bam_iter_destroy( in.iter ) ;
+	if ( in.useSam )
+		samclose( in.fpsam ) ;
+	else
 	{
-		PrintHelp() ;
-		return 0 ;
+		ReleaseSamTextReader( in.text ) ;
+		if ( in.fp != NULL && in.fp != stdin )
+			fclose( in.fp ) ;
 	}
+	if ( in.b != NULL )
+		bam_destroy1( in.b ) ;
+}
 
-	len = strlen( argv[1] ) ;
-	if ( argv[1][len-3] == 'b' || argv[1][len-3] == 'B' )
-	{	
-		if ( !( fpsam = samopen( argv[1], "rb", 0 ) ) )
-			return 0 ;
+void InitJuncState( struct _juncState *state, IntronTableWriter *out )
+{
+	state->junctions.clear() ;
+	state->junctionEnds.clear() ;
+	state->contradictedReads.clear() ;
+	state->prevChrome[0] = '\0' ;
+	state->out = out ;
+}
 
-		if ( !fpsam->header )
-		{
-			//samclose( fpsam ) ;
-			//fpsam = samopen( argv[1], "r", 0 ) ;
-			//if ( !fpsam->header )
-			//{
-			useSam = false ;
-			fp = fopen( argv[1], "r" ) ;
-			//}
-		}
-	}
-	else
+// Print the junctions still open, and empty the state for the next chromosome.
+void FlushJuncState( struct _juncState *state )
+{
+	std::map< std::pair<int, int>, struct _junction >::iterator it ;
+	curState = state ;
+	// Print the remaining junctions
+	for ( it = state->junctions.begin() ; it != state->junctions.end() ; ++it )
 	{
-		useSam = false ;
-		fp = NULL ;
-		if ( !strcmp( argv[1], "-" ) )
-			fp = stdin ;
-		else
-			fp = fopen( argv[1], "r" ) ;
-		if ( fp == NULL )
-		{
-			printf( "Could not open file %s\n", argv[1] ) ;
-			return 0 ;
-		}
+		if ( flagPrintJunction )
+			PrintJunction( state->prevChrome, it->second ) ;
+		ClearReadSet( it->second.reads ) ;
 	}
+	state->junctions.clear() ;
+	state->junctionEnds.clear() ;
+	state->contradictedReads.clear() ;
+}
+
+// Go through the records of the input. Each record goes to the state of its read group if readGroups is set,
+// or to states[0] otherwise.
+void ScanJunctions( struct _juncInput &in, struct _juncState *states, ReadGroups *readGroups )
+{
+ 	samfile_t *fpsam = in.fpsam ;
+	bam1_t *b = in.b ;
+	bool useSam = in.useSam ;
+ 	int startLocation ; 
+	struct _cigarSeg cigarSeg[MAX_CIGAR_SEG] ; // The segments of the cigar.
+	int ccnt = 0 ;
+	char textXS = '\0' ; // the XS, YS fields and the position of SAM text
+	int textYS = -1 ;
+	int textStart = 0 ;
 
+	curState = &states[0] ;
 	while ( 1 )
 	{
 		int flag = 0 ;
 		if ( useSam )
 		{
-			if ( b )
-				bam_destroy1( b ) ;
-			b = bam_init1() ;
-			if ( samread( fpsam, b ) <= 0 )
+			if ( ( in.iter != NULL ? bam_iter_read( fpsam->x.bam, in.iter, b ) : samread( fpsam, b ) ) <= 0 )
 				break ;
 			if ( b->core.tid >= 0 )
-				strcpy( col[2], fpsam->header->target_name[b->core.tid] ) ;
+				chrome = fpsam->header->target_name[b->core.tid] ;
 			else
 				continue ;
-				//strcpy( col[2], "-1" ) ;
-			cigar2string( &(b->core), bam1_cigar( b ), col[5] ) ;
-			strcpy( col[0], bam1_qname( b ) ) ;	
+			// Most reads have no intron, so check it before anything else.
+			ccnt = ParseBamCigar( b, cigarSeg ) ;
+			if ( ccnt < 0 || !HasIntron( cigarSeg, ccnt ) )
+				continue ;
+			if ( readGroups != NULL )
+			{
+				uint8_t *rg = bam_aux_get( b, "RG" ) ;
+				int k = readGroups->GetIdx( rg == NULL ? NULL : bam_aux2Z( rg ) ) ;
+				if ( k < 0 )
+					continue ;
+				curState = &states[k] ;
+			}
+			readId = bam1_qname( b ) ;
 			flag = b->core.flag ;	
 			if ( bam_aux_get( b, "NH" ) )
 			{	
@@ -935,28 +1112,12 @@ int main( int argc, char *argv[] )
 				editDistance = 0 ;
 
 			mateStart = b->core.mpos + 1 ;
-			if ( b->core.mtid == b->core.tid )
-				col[6][0] = '=' ;
-			else
-				col[6][0] = '*' ;		
+			mateSameChrome = ( b->core.mtid == b->core.tid ) ;
 
 			if ( b->core.l_qseq < 20 )
 				continue ;
-			
-			for ( i = 0 ; i < b->core.l_qseq ; ++i )
-			{
-				int bit = bam1_seqi( bam1_seq( b ), i ) ;
-				switch ( bit )
-				{
-					case 1: col[9][i] = 'A' ; break ;
-					case 2: col[9][i] = 'C' ; break ;
-					case 4: col[9][i] = 'G' ; break ;
-					case 8: col[9][i] = 'T' ; break ;
-					case 15: col[9][i] = 'N' ; break ;
-					default: col[9][i] = 'A' ; break ;
-				}	
-			}
-			col[9][i] = '\0' ;
+			bamSeq = bam1_seq( b ) ;
+			readSeqLen = b->core.l_qseq ;
 
 			/*if ( flag & 0x100 )
 				secondary = true ;
@@ -965,52 +1126,69 @@ int main( int argc, char *argv[] )
 		}
 		else
 		{
+			char *fields[12] ;
+			int lens[12] ;
+			int fieldCnt ;
+			int k ;
 			char *p ;
-			if ( !fgets( line, LINE_SIZE, fp ) )
+			bool hasNM = false ;
+			if ( ( line = ReadSamLine( in.text ) ) == NULL )
 				break ;
 			if ( line[0] == '\0' || line[0] == '@' )
 				continue ;
-			sscanf( line, "%s%s%s%s%s%s%s%s%s%s%s", col[0], col[1], col[2], col[3], col[4], 
-					col[5], col[6], col[7], col[8], col[9],  col[10] ) ;
+			// The 12th field holds all the optional fields.
+			fieldCnt = SplitSamLine( line, fields, lens, 12 ) ;
+			if ( fieldCnt < 11 || lens[0] >= LINE_SIZE || lens[2] >= LINE_SIZE )
+				continue ;
+			// Most reads have no intron, so check it before anything else.
+			ccnt = ParseCigarString( fields[5], lens[5], cigarSeg ) ;
+			if ( ccnt < 0 || !HasIntron( cigarSeg, ccnt ) )
+				continue ;
 					
-			flag = atoi( col[1] ) ;
-			if ( (p = strstr( line, "NH" )) )
-			{
-				int k = 0 ;
-				p += 5 ;
-				while ( *p != ' ' && *p != '\t' && *p != '\0')
-				{
-					k = k * 10 + *p - '0' ;
-					++p ;
-				}
-				/*if ( k >= 2 )
-				{
-					secondary = true ;
-				}
-				else
-					secondary = false ;*/
-				NH = k ;
-			}
-			else
-			{
-				//secondary = false ;
-				NH = 1 ;
-			}
-			if ( ( p = strstr( line, "NM" ) ) || ( p = strstr( line, "nM" ) ) )
+			flag = atoi( fields[1] ) ;
+			NH = 1 ;
+			editDistance = 0 ;
+			textXS = '\0' ;
+			textYS = -1 ;
+			// The optional fields are TAG:TYPE:VALUE, separated by tabs.
+			p = fields[11] ;
+			for ( k = 0 ; p[k] ; )
 			{
-				int k = 0 ;
-				p += 5 ;
-				while ( *p != ' ' && *p != '\t' && *p != '\0')
+				char *tag = p + k ;
+				if ( tag[0] && tag[1] && tag[2] == ':' && tag[3] && tag[4] == ':' )
 				{
-					k = k * 10 + *p - '0' ;
-					++p ;
+					if ( tag[0] == 'N' && tag[1] == 'H' )
+						NH = atoi( tag + 5 ) ;
+					else if ( tag[0] == 'N' && tag[1] == 'M' )
+					{
+						editDistance = atoi( tag + 5 ) ;
+						hasNM = true ;
+					}
+					else if ( tag[0] == 'n' && tag[1] == 'M' && !hasNM )
+						editDistance = atoi( tag + 5 ) ;
+					else if ( tag[0] == 'X' && tag[1] == 'S' && tag[3] == 'A' )
+						textXS = tag[5] ;
+					else if ( tag[0] == 'Y' && tag[1] == 'S' )
+						textYS = atoi( tag + 5 ) ;
 				}
-				editDistance = k ;
+				while ( p[k] && p[k] != '\t' )
+					++k ;
+				if ( p[k] == '\t' )
+					++k ;
 			}
-			else
-				editDistance = 0 ;
 
-			mateStart = atoi( col[7] ) ;
+			mateStart = atoi( fields[7] ) ;
+			mateSameChrome = ( fields[6][0] == '=' ) ;
+			memcpy( samReadId, fields[0], lens[0] ) ;
+			samReadId[ lens[0] ] = '\0' ;
+			readId = samReadId ;
+			memcpy( samChrome, fields[2], lens[2] ) ;
+			samChrome[ lens[2] ] = '\0' ;
+			chrome = samChrome ;
+			bamSeq = NULL ;
+			samSeq = fields[9] ;
+			readSeqLen = lens[9] ;
+			textStart = atoi( fields[3] ) ;
 			/*if ( flag & 0x100 )
 				secondary = true ;
 			else 
@@ -1018,17 +1196,11 @@ int main( int argc, char *argv[] )
 			
 		}
 		samFlag = flag ;
-		for ( i = 0 ; col[5][i] ; ++i )
-			if ( col[5][i] == 'N' )
-				break ;
-
-		if ( !col[5][i] )
-			continue ;
 		
 		// remove .1, .2 or /1, /2 suffix
 		if ( hasMateReadIdSuffix )
 		{
-			char *s = col[0] ;
+			char *s = readId ;
 			int len = strlen( s ) ;
 			if ( len >= 2 && ( s[len - 1] == '1' || s[len - 1] == '2' ) 
 				&& ( s[len - 2] == '.' || s[len - 2] == '/' ) )
@@ -1065,9 +1237,9 @@ int main( int argc, char *argv[] )
 		}
 		else
 		{
-			if ( strstr( line, "XS:A:-" ) ) // on negative strand
+			if ( textXS == '-' ) // on negative strand
 				strand = '-' ;
-			else if ( strstr( line, "XS:A:+" ) )
+			else if ( textXS == '+' )
 				strand = '+' ;
 			else if ( strandedLib != 0) 
 			{
@@ -1077,73 +1249,488 @@ int main( int argc, char *argv[] )
 			else
 			{
 				strand = '?' ;
-				char *p = strstr( line, "YS:i:" ) ;
-				if ( p != NULL )
-				{
-					p += 5 ;
-					noncanonStrandInfo = atoi( p ) ;
-				}
-				else
-					noncanonStrandInfo = -1 ;
+				noncanonStrandInfo = textYS ;
 			}
-			startLocation = atoi( col[3] ) ;  
+			startLocation = textStart ;
 		}
 		
 		// Found the junctions from the read.
-		if ( strcmp( prevChrome, col[2] ) )
+		if ( strcmp( curState->prevChrome, chrome ) )
 		{
-			if ( flagPrintJunction )
-			{
-				// Print the remaining elements in the queue
-				i = qHead ;
-				while ( i != qTail )
-				{
-					PrintJunction( prevChrome, junctionQueue[i] ) ;
-					++i ;
-					if ( i >= QUEUE_SIZE )
-						i = 0 ;
-				}
-			}
-
 			// new chromosome
-			ClearReadTree( contradictedReads ) ;
-			contradictedReads = NULL ;
-			qHead = qTail = 0 ;
-			strcpy( prevChrome, col[2] ) ;
+			FlushJuncState( curState ) ;
+			strcpy( curState->prevChrome, chrome ) ;
 		}
 
 		if ( flagRemove )
 		{
-			if ( CompareJunctions( startLocation, col[5] ) )
+			if ( CompareJunctions( startLocation, cigarSeg, ccnt ) )
 			{
 				// Test whether this read has new junctions
 				//++junctionCnt ;
 				if ( !flagPrintJunction )
-					printf( "%s", line ) ;
+					printf( "%s\n", line ) ;
 			}
 		}
 		else
 		{
 			++junctionCnt ;
-			printf( "%s", line ) ;
+			printf( "%s\n", line ) ;
+		}
+		//printf( "hi2 %s\n", readId ) ;
+	}
+}
+
+// Find the junctions of one SAM/BAM file. They go to out, or to one file per read group if readGroupPrefix is set.
+// Return 0 if the file can not be opened.
+int FindJunctions( const char *file, const char *readGroupPrefix, IntronTableWriter *out )
+{
+	struct _juncInput in ;
+	ReadGroups readGroups ;
+	struct _juncState *states = NULL ;
+	int stateCnt = 1 ;
+	int i ;
+
+	junctionCnt = 0 ;
+	if ( !OpenJuncInput( file, in, readThreads ) )
+		return 0 ;
+
+	if ( readGroupPrefix != NULL )
+	{
+		if ( !in.useSam )
+		{
+			fprintf( stderr, "--readGroups needs a BAM file.\n" ) ;
+			exit( 1 ) ;
+		}
+		stateCnt = readGroups.Parse( in.fpsam->header->text ) ;
+		if ( stateCnt == 0 )
+		{
+			fprintf( stderr, "No read group (@RG) in the header of %s.\n", file ) ;
+			exit( 1 ) ;
+		}
+	}
+	states = new struct _juncState[ stateCnt ] ;
+	IntronTableWriter *rgOuts = NULL ;
+	FILE **rgFps = NULL ;
+	if ( readGroupPrefix != NULL )
+	{
+		rgOuts = new IntronTableWriter[ stateCnt ] ;
+		rgFps = new FILE *[ stateCnt ] ;
+	}
+	for ( i = 0 ; i < stateCnt ; ++i )
+	{
+		if ( readGroupPrefix == NULL )
+			InitJuncState( &states[i], out ) ;
+		else
+		{
+			char outFile[1024] ;
+			sprintf( outFile, "%s_%d.raw_splice", readGroupPrefix, i ) ;
+			rgFps[i] = fopen( outFile, "w" ) ;
+			if ( rgFps[i] == NULL )
+			{
+				fprintf( stderr, "Could not write file %s\n", outFile ) ;
+				exit( 1 ) ;
+			}
+			rgOuts[i].Open( rgFps[i], binaryOutput ) ;
+			InitJuncState( &states[i], &rgOuts[i] ) ;
 		}
-		//printf( "hi2 %s\n", col[0] ) ;
 	}
+
+	ScanJunctions( in, states, readGroupPrefix == NULL ? NULL : &readGroups ) ;
 	
-	if ( flagPrintJunction )
+	for ( i = 0 ; i < stateCnt ; ++i )
 	{
-		// Print the remaining elements in the queue
-		i = qHead ;
-		while ( i != qTail )
+		FlushJuncState( &states[i] ) ;
+		if ( readGroupPrefix != NULL )
 		{
-			PrintJunction( prevChrome, junctionQueue[i] ) ;
-			++i ;
-			if ( i >= QUEUE_SIZE )
-				i = 0 ;
+			rgOuts[i].Close() ;
+			fclose( rgFps[i] ) ;
 		}
-	}	
+	}
+	delete[] states ;
+	delete[] rgOuts ;
+	delete[] rgFps ;
+	CloseJuncInput( in ) ;
+	return 1 ;
+}
+
+struct _juncShardArg
+{
+	const char *file ;
+	bam_index_t *index ;
+	std::vector<int> *pShards ; // the chromosome ids, the longest first
+	int *pNextShard ;
+	pthread_mutex_t *pShardLock ;
+	std::vector<IntronTableWriter *> *pOutputs ; // the junctions of each chromosome
+} ;
+
+void *FindJunctionsInShards_Thread( void *pArg )
+{
+	struct _juncShardArg &arg = *( (struct _juncShardArg *)pArg ) ;
+	std::vector<int> &shards = *arg.pShards ;
+	int size = shards.size() ;
+	struct _juncInput in ;
+	struct _juncState *state = new struct _juncState ;
+
+	junctionCnt = 0 ;
+	if ( !OpenJuncInput( arg.file, in, 0 ) )
+	{
+		fprintf( stderr, "Could not open file %s\n", arg.file ) ;
+		exit( 1 ) ;
+	}
+	while ( 1 )
+	{
+		int k ;
+		pthread_mutex_lock( arg.pShardLock ) ;
+		k = *arg.pNextShard ;
+		++*arg.pNextShard ;
+		pthread_mutex_unlock( arg.pShardLock ) ;
+		if ( k >= size )
+			break ;
+
+		int tid = shards[k] ;
+		IntronTableWriter *out = new IntronTableWriter ;
+		out->Open( NULL, binaryOutput ) ;
+		InitJuncState( state, out ) ;
+		in.iter = bam_iter_query( arg.index, tid, 0, in.fpsam->header->target_len[tid] ) ;
+		ScanJunctions( in, state, NULL ) ;
+		FlushJuncState( state ) ;
+		bam_iter_destroy( in.iter ) ;
+		in.iter = NULL ;
+
+		( *arg.pOutputs )[tid] = out ;
+	}
+	delete state ;
+	CloseJuncInput( in ) ;
+	pthread_exit( NULL ) ;
+}
+
+bool CompShardLength( const std::pair<int, int> &a, const std::pair<int, int> &b )
+{
+	if ( a.first != b.first )
+		return a.first > b.first ;
+	return a.second < b.second ;
+}
+
+// Find the junctions of an indexed BAM file with numThreads threads, each taking one chromosome at a time.
+// A chromosome is independent of the others, so the output is the same as FindJunctions.
+// Return 0 if the file has no index.
+int FindJunctionsInShards( const char *file, IntronTableWriter *out, int numThreads )
+{
+	int i ;
+	samfile_t *fpsam = samopen( file, "rb", 0 ) ;
+	if ( fpsam == NULL || fpsam->header == NULL )
+		return 0 ;
+	bam_index_t *index = bam_index_load( file ) ;
+	if ( index == NULL )
+	{
+		samclose( fpsam ) ;
+		return 0 ;
+	}
+
+	int chromCnt = fpsam->header->n_targets ;
+	std::vector< std::pair<int, int> > lengths ;
+	std::vector<int> shards ;
+	std::vector<IntronTableWriter *> outputs( chromCnt, (IntronTableWriter *)NULL ) ;
+	for ( i = 0 ; i < chromCnt ; ++i )
+		lengths.push_back( std::pair<int, int>( fpsam->header->target_len[i], i ) ) ;
+	std::sort( lengths.begin(), lengths.end(), CompShardLength ) ;
+	for ( i = 0 ; i < chromCnt ; ++i )
+		shards.push_back( lengths[i].second ) ;
+	samclose( fpsam ) ;
+
+	if ( numThreads > chromCnt )
+		numThreads = chromCnt ;
+	if ( numThreads < 1 )
+		numThreads = 1 ;
+	pthread_mutex_t shardLock ;
+	pthread_attr_t pthreadAttr ;
+	pthread_t *threads = new pthread_t[ numThreads ] ;
+	struct _juncShardArg *args = new struct _juncShardArg[ numThreads ] ;
+	int nextShard = 0 ;
+
+	pthread_mutex_init( &shardLock, NULL ) ;
+	pthread_attr_init( &pthreadAttr ) ;
+	pthread_attr_setdetachstate( &pthreadAttr, PTHREAD_CREATE_JOINABLE ) ;
+	for ( i = 0 ; i < numThreads ; ++i )
+	{
+		args[i].file = file ;
+		args[i].index = index ;
+		args[i].pShards = &shards ;
+		args[i].pNextShard = &nextShard ;
+		args[i].pShardLock = &shardLock ;
+		args[i].pOutputs = &outputs ;
+		pthread_create( &threads[i], &pthreadAttr, FindJunctionsInShards_Thread, &args[i] ) ;
+	}
+	for ( i = 0 ; i < numThreads ; ++i )
+		pthread_join( threads[i], NULL ) ;
+	pthread_attr_destroy( &pthreadAttr ) ;
+	pthread_mutex_destroy( &shardLock ) ;
+
+	// The sorted BAM file lists the chromosomes in the order of the header.
+	for ( i = 0 ; i < chromCnt ; ++i )
+	{
+		if ( outputs[i] == NULL )
+			continue ;
+		out->Append( *outputs[i] ) ;
+		delete outputs[i] ;
+	}
+	bam_index_destroy( index ) ;
+	delete[] threads ;
+	delete[] args ;
+	return 1 ;
+}
+
+struct _juncJob
+{
+	char *file ;
+	int idx ; // the order in the list, which names the output file
+	int64_t size ;
+} ;
+
+struct _juncThreadArg
+{
+	std::vector<struct _juncJob> *pJobs ;
+	int *pNextJob ;
+	pthread_mutex_t *pJobLock ;
+	char *outPrefix ;
+	int numThreads ;
+} ;
+
+bool CompJuncJobs( const struct _juncJob &a, const struct _juncJob &b )
+{
+	if ( a.size != b.size )
+		return a.size > b.size ;
+	return a.idx < b.idx ;
+}
+
+void *FindJunctions_Thread( void *pArg )
+{
+	struct _juncThreadArg &arg = *( (struct _juncThreadArg *)pArg ) ;
+	std::vector<struct _juncJob> &jobs = *arg.pJobs ;
+	int size = jobs.size() ;
+	while ( 1 )
+	{
+		int k ;
+		pthread_mutex_lock( arg.pJobLock ) ;
+		k = *arg.pNextJob ;
+		++*arg.pNextJob ;
+		pthread_mutex_unlock( arg.pJobLock ) ;
+		if ( k >= size )
+			break ;
+
+		char outFile[1024] ;
+		sprintf( outFile, "%s_%d.raw_splice", arg.outPrefix, jobs[k].idx ) ;
+		FILE *fpOut = fopen( outFile, "w" ) ;
+		IntronTableWriter out ;
+		if ( fpOut == NULL )
+		{
+			fprintf( stderr, "Could not write file %s\n", outFile ) ;
+			exit( 1 ) ;
+		}
+		out.Open( fpOut, binaryOutput ) ;
+		// A single file gets all the threads.
+		if ( !( size == 1 && arg.numThreads > 1 && IsBamFile( jobs[k].file )
+				&& FindJunctionsInShards( jobs[k].file, &out, arg.numThreads ) )
+			&& !FindJunctions( jobs[k].file, NULL, &out ) )
+		{
+			fprintf( stderr, "Could not open file %s\n", jobs[k].file ) ;
+			exit( 1 ) ;
+		}
+		out.Close() ;
+		fclose( fpOut ) ;
+	}
+	pthread_exit( NULL ) ;
+}
+
+int main( int argc, char *argv[] ) 
+{
+ 	int i ;
+	char *readGroupPrefix = NULL ;
+	char *bamListPrefix = NULL ;
+	int numThreads = 1 ;
+
+	anchorBoth = false ;	
+	
+	flagPrintJunction = false ;
+	flagPrintAll = false ;
+	flagStrict = false ;
+	hasMateReadIdSuffix = false ;
+	binaryOutput = false ;
+
+	flagRemove = true ;
+	flagPrintJunction = true ;
+	flank = 8 ;
+	filterYS = 4 ;
+	strandedLib = 0 ;
+	readThreads = 0 ;
 	
-	//fprintf( stderr, "The number of junctions: %d\n", junctionCnt ) ;
+	// processing the argument list
+	for ( i = 1 ; i < argc ; ++i )
+	{
+		if ( !strcmp( argv[i], "-h" ) )
+		{
+			PrintHelp() ;
+			return 0 ;
+		}
+		else if ( !strcmp( argv[i], "-r" ) )
+		{
+			flagRemove = true ;
+		}
+		else if ( !strcmp( argv[i], "-j" ) )
+		{
+			flagRemove = true ;
+			flagPrintJunction = true ;
+			flank = atoi( argv[i + 1] ) ;
+			if ( i + 2 < argc && !strcmp( argv[i+2], "-B" ) )
+			{
+				anchorBoth = true ;
+				++i ;		
+			}
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "-a" ) )
+		{
+			flagPrintAll = true ;
+		}
+		else if ( !strcmp( argv[i], "--strict" ) )
+		{
+			flagStrict = true ;
+		}
+		else if ( !strcmp( argv[i], "-y" ) )
+		{
+			filterYS = atoi( argv[i + 1] ) ;
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "--hasMateIdSuffix" ) )
+		{
+			hasMateReadIdSuffix = true ;
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "--stranded" ) )
+		{
+			if ( !strcmp(argv[i + 1], "un") ) 
+				strandedLib = 0 ;
+			else if ( !strcmp(argv[i + 1], "rf") )
+				strandedLib = 1 ;
+			else if ( !strcmp(argv[i + 1], "fr" ) )
+				strandedLib = 2 ;
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "--readThreads" ) )
+		{
+			readThreads = atoi( argv[i + 1] ) ;
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "--readGroups" ) )
+		{
+			readGroupPrefix = argv[i + 1] ;
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "--bamList" ) )
+		{
+			bamListPrefix = argv[i + 1] ;
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "-p" ) )
+		{
+			numThreads = atoi( argv[i + 1] ) ;
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "--binary" ) )
+		{
+			binaryOutput = true ;
+		}
+		else if ( i > 1 )
+		{
+			printf( "Unknown option %s\n", argv[i] ) ;
+			exit( 1 ) ;
+		}
+	}
+	if ( argc == 1 )
+	{
+		PrintHelp() ;
+		return 0 ;
+	}
+
+
+	if ( bamListPrefix == NULL )
+	{
+		IntronTableWriter out ; // with --readGroups, nothing goes to stdout
+		out.Open( readGroupPrefix == NULL ? stdout : NULL, binaryOutput ) ;
+		if ( !( numThreads > 1 && readGroupPrefix == NULL && IsBamFile( argv[1] )
+			&& FindJunctionsInShards( argv[1], &out, numThreads ) ) )
+			FindJunctions( argv[1], readGroupPrefix, &out ) ;
+		out.Close() ;
+		//fprintf( stderr, "The number of junctions: %d\n", junctionCnt ) ;
+		return 0 ;
+	}
+
+	if ( readGroupPrefix != NULL )
+	{
+		fprintf( stderr, "--bamList and --readGroups can not be used together.\n" ) ;
+		exit( 1 ) ;
+	}
+
+	// Each line of the list is a BAM file. The largest files start first, and an idle thread takes the next file.
+	FILE *fpList = fopen( argv[1], "r" ) ;
+	if ( fpList == NULL )
+	{
+		fprintf( stderr, "Could not open file %s\n", argv[1] ) ;
+		exit( 1 ) ;
+	}
+	std::vector<struct _juncJob> jobs ;
+	char buffer[LINE_SIZE] ;
+	while ( fgets( buffer, sizeof( buffer ), fpList ) != NULL )
+	{
+		int len = strlen( buffer ) ;
+		while ( len > 0 && ( buffer[len - 1] == '\n' || buffer[len - 1] == '\r' ) )
+			buffer[--len] = '\0' ;
+		if ( len == 0 )
+			continue ;
+
+		struct _juncJob job ;
+		struct stat st ;
+		job.file = strdup( buffer ) ;
+		job.idx = jobs.size() ;
+		job.size = stat( buffer, &st ) ? 0 : (int64_t)st.st_size ;
+		jobs.push_back( job ) ;
+	}
+	fclose( fpList ) ;
+	std::sort( jobs.begin(), jobs.end(), CompJuncJobs ) ;
+
+	if ( numThreads < 1 )
+		numThreads = 1 ;
+	int poolSize = numThreads ;
+	if ( poolSize > (int)jobs.size() )
+		poolSize = jobs.size() ;
+
+	pthread_mutex_t jobLock ;
+	pthread_attr_t pthreadAttr ;
+	pthread_t *threads = new pthread_t[ poolSize ] ;
+	struct _juncThreadArg *args = new struct _juncThreadArg[ poolSize ] ;
+	int nextJob = 0 ;
+
+	pthread_mutex_init( &jobLock, NULL ) ;
+	pthread_attr_init( &pthreadAttr ) ;
+	pthread_attr_setdetachstate( &pthreadAttr, PTHREAD_CREATE_JOINABLE ) ;
+	for ( i = 0 ; i < poolSize ; ++i )
+	{
+		args[i].pJobs = &jobs ;
+		args[i].pNextJob = &nextJob ;
+		args[i].pJobLock = &jobLock ;
+		args[i].outPrefix = bamListPrefix ;
+		args[i].numThreads = numThreads ;
+		pthread_create( &threads[i], &pthreadAttr, FindJunctions_Thread, &args[i] ) ;
+	}
+	for ( i = 0 ; i < poolSize ; ++i )
+		pthread_join( threads[i], NULL ) ;
+	pthread_attr_destroy( &pthreadAttr ) ;
+	pthread_mutex_destroy( &jobLock ) ;
+
+	for ( i = 0 ; i < (int)jobs.size() ; ++i )
+		free( jobs[i].file ) ;
+	delete[] threads ;
+	delete[] args ;
 	return 0 ;
 }
-
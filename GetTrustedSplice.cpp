@@ -1,16 +1,31 @@
 #include <stdio.h>
 #include <math.h>
 #include <vector>
+#include <string>
+#include <queue>
 #include <algorithm>
+#include <map>
+#include <pthread.h>
 
 #include "alignments.hpp"
+#include "IntronTable.hpp"
 
 #define MAX(x, y) (((x)<(y))?(y):(x))
 #define MIN(x, y) (((x)<(y))?(x):(y))
 
+// The splice files merged at the same time, to stay under the limit of open files.
+#define MAX_MERGE_FILES 256
+
 char usage[] = "Usage: ./trust-splice splice_file_list one_bam_file [OPTIONS]\n"
+		"       ./trust-splice --export splice_file: print a binary splice file as text\n"
 		"Options:\n"
-		"\t-a FLOAT: average number of supported reads from the samples (default: 0.5)\n" ;
+		"\t-a FLOAT: average number of supported reads from the samples (default: 0.5)\n"
+		"\t--filter: write the trusted introns of each NAME.raw_splice in the list to NAME.splice (default: not set)\n"
+		"\t--bamGroup STRING: the file of the group of each sample; the trusted introns of each group go to PREFIX_i.trusted_splice (default: not set)\n"
+		"\t-o STRING: the PREFIX of the trusted splice files of the groups (default: not set)\n"
+		"\t-p INT: number of threads to filter the splice files (default: 1)\n"
+		"\t--trusted STRING: filter with the introns of this splice file instead of selecting them (default: not set)\n"
+		"\t--binary: write the filtered splice files as binary intron tables (default: not set)\n" ;
 
 struct _intron
 {
@@ -55,6 +70,19 @@ bool CompSites( struct _site a, struct _site b )
 	return false ;
 }
 
+// Add the support of intron b to a, which has the same coordinates and comes from the earlier samples.
+void AddIntron( struct _intron &a, const struct _intron &b )
+{
+	a.support += b.support ;
+	a.uniqSupport += b.uniqSupport ;
+	a.secSupport += b.secSupport ;
+	a.sampleSupport += b.sampleSupport ;
+	a.editDist += b.editDist ;
+
+	if ( a.strand == '?' )
+		a.strand = b.strand ;	
+}
+
 void CoalesceIntrons( std::vector<struct _intron> &introns )
 {
 	std::sort( introns.begin(), introns.end(), CompIntrons ) ;
@@ -66,13 +94,7 @@ void CoalesceIntrons( std::vector<struct _intron> &introns )
 		if ( introns[i].chrId == introns[k].chrId && introns[i].start == introns[k].start 
 			&& introns[i].end == introns[k].end )
 		{
-			introns[k].support += introns[i].support ;
-			introns[k].uniqSupport += introns[i].uniqSupport ;
-			introns[k].secSupport += introns[i].secSupport ;
-			introns[k].sampleSupport += introns[i].sampleSupport ;
-
-			if ( introns[k].strand == '?' )
-				introns[k].strand = introns[i].strand ;	
+			AddIntron( introns[k], introns[i] ) ;
 		}
 		else
 		{
@@ -105,85 +127,172 @@ void CoalesceSites( std::vector<struct _site> &sites )
 	sites.resize( k + 1 ) ;
 }
 
-int main( int argc, char *argv[] )
+// Read the next intron of a splice file. chrIds maps the chromosomes of the file to the BAM file.
+// Return false at the end of the file.
+bool ReadIntron( IntronTableReader &reader, std::vector<int> &chrIds, Alignments &alignments, int sampleCnt, 
+	struct _intron &ni )
 {
-	int i, j, k ;
-	FILE *fpList ;	
-	FILE *fp ;
-	char spliceFile[2048] ;
-	char chrName[1024], strand[3] ;
-	int start, end, uniqSupport, secSupport, uniqEditDistance, secEditDistance ;
-	double support ;
-	Alignments alignments ;
-	std::vector<struct _intron> introns ;
-	std::vector<struct _site> sites ;
-	double averageSupportThreshold = 0.5 ;
+	struct _intronRecord r ;
+	if ( !reader.Next( r ) )
+		return false ;
+
+	double support = r.support ;
+	if ( support <= 0 )
+		support = 0.1 ;
+	else if ( support == 1 && sampleCnt > 5 )
+		support = 0.75 ;
+
+	if ( r.chrId >= (int)chrIds.size() )
+		chrIds.resize( r.chrId + 1, -1 ) ;
+	if ( chrIds[ r.chrId ] == -1 )
+		chrIds[ r.chrId ] = alignments.GetChromIdFromName( reader.GetChromName( r.chrId ) ) ;
+	ni.chrId = chrIds[ r.chrId ] ;
+	ni.start = r.start ;
+	ni.end = r.end ;
+	ni.support = support ;
+	ni.strand = r.strand ;
+	ni.uniqSupport = r.uniqSupport ;
+	ni.secSupport = r.secSupport ;
+	ni.sampleSupport = 1 ;
+	ni.editDist = r.uniqEditDist + r.secEditDist ;
+	return true ;
+}
 
-	if ( argc <= 1 )
+void OpenSpliceFile( const char *file, IntronTableReader &reader )
+{
+	if ( !reader.Open( file ) )
 	{
-		printf( "%s", usage ) ;
+		fprintf( stderr, "Could not open file %s\n", file ) ;
 		exit( 1 ) ;
 	}
+}
 
-	for ( i = 3 ; i < argc ; ++i )
+// One input of the merge: the introns of a group merged so far, or a splice file.
+struct _intronSource
+{
+	IntronTableReader *reader ; // NULL for the merged introns
+	std::vector<int> chrIds ;
+	int group ;
+	int next ; // the next one of the merged introns
+	struct _intron cur ;
+} ;
+
+// The heap keeps the smallest intron on top, and the earlier source among the same introns.
+struct _intronHeapComp
+{
+	std::vector<struct _intronSource> *pSources ;
+	bool operator()( int a, int b ) const
 	{
-		if ( !strcmp( argv[ i ], "-a" ) )
+		const struct _intron &ia = ( *pSources )[a].cur ;
+		const struct _intron &ib = ( *pSources )[b].cur ;
+		if ( CompIntrons( ia, ib ) )
+			return false ;
+		if ( CompIntrons( ib, ia ) )
+			return true ;
+		return a > b ;
+	}
+} ;
+
+// Merge the splice files, each sorted as CompIntrons, in one pass. files[i] belongs to group groups[i], 
+// and its introns are added to the sorted introns[ groups[i] ].
+// The files go MAX_MERGE_FILES at a time, each batch merged with the introns from the earlier ones.
+// Return false if a file is not sorted, e.g. its chromosomes are in another order than in the BAM file.
+bool MergeSpliceFiles( std::vector<std::string> &files, std::vector<int> &groups, Alignments &alignments, 
+	std::vector< std::vector<struct _intron> > &introns )
+{
+	int i, j ;
+	int fileCnt = files.size() ;
+	int groupCnt = introns.size() ;
+	std::vector<int> groupSampleCnt( groupCnt, 0 ) ;
+	for ( i = 0 ; i < fileCnt ; ++i )
+		++groupSampleCnt[ groups[i] ] ;
+
+	for ( i = 0 ; i < fileCnt ; i += MAX_MERGE_FILES )
+	{
+		int batchEnd = MIN( i + MAX_MERGE_FILES, fileCnt ) ;
+		std::vector<struct _intronSource> sources( groupCnt + batchEnd - i ) ;
+		std::vector< std::vector<struct _intron> > merged( groupCnt ) ;
+		struct _intronHeapComp comp ;
+		comp.pSources = &sources ;
+		std::priority_queue<int, std::vector<int>, struct _intronHeapComp> heap( comp ) ;
+		bool sorted = true ;
+
+		for ( j = 0 ; j < groupCnt ; ++j )
 		{
-			averageSupportThreshold = atof( argv[i + 1] ) ;
-			++i ;
+			struct _intronSource &source = sources[j] ;
+			source.reader = NULL ;
+			source.group = j ;
+			source.next = 0 ;
+			if ( introns[j].size() > 0 )
+			{
+				source.cur = introns[j][0] ;
+				source.next = 1 ;
+				heap.push( j ) ;
+			}
 		}
-		else
+		for ( j = i ; j < batchEnd ; ++j )
 		{
-			printf( "Unknown option: %s", argv[i] ) ;
-			exit( 1 ) ;
+			struct _intronSource &source = sources[groupCnt + j - i] ;
+			source.reader = new IntronTableReader ;
+			source.group = groups[j] ;
+			OpenSpliceFile( files[j].c_str(), *source.reader ) ;
+			if ( ReadIntron( *source.reader, source.chrIds, alignments, groupSampleCnt[ source.group ], source.cur ) )
+				heap.push( groupCnt + j - i ) ;
 		}
-	}
 
-	alignments.Open( argv[2] ) ;
-
-	// Get the number of samples.
-	fpList = fopen( argv[1], "r" ) ;
-	int sampleCnt = 0 ;
-	while ( fscanf( fpList, "%s", spliceFile ) != EOF )
-	{
-		++sampleCnt ;
-	}
-	fclose( fpList ) ;
-
-	// Get all the introns.
-	fpList = fopen( argv[1], "r" ) ;
-	while ( fscanf( fpList, "%s", spliceFile ) != EOF )
-	{
-		fp = fopen( spliceFile, "r" ) ;	
-		while (  fscanf( fp, "%s %d %d %lf %s %d %d %d %d", chrName, &start, &end, &support,
-				strand, &uniqSupport, &secSupport, &uniqEditDistance, &secEditDistance ) != EOF )
+		while ( !heap.empty() )
 		{
-			
-			if ( support <= 0 )
-				support = 0.1 ;
-			else if ( support == 1 && sampleCnt > 5 )
-				support = 0.75 ;
-
-			struct _intron ni ;
-			ni.chrId = alignments.GetChromIdFromName( chrName ) ;
-			ni.start = start ;
-			ni.end = end ;
-			ni.support = support ;
-			ni.strand = strand[0] ;
-			ni.uniqSupport = uniqSupport ;
-			ni.secSupport = secSupport ;
-			ni.sampleSupport = 1 ;
-			ni.editDist = uniqEditDistance + secEditDistance ;
-			introns.push_back( ni ) ;
+			int top = heap.top() ;
+			heap.pop() ;
+			struct _intronSource &source = sources[top] ;
+			std::vector<struct _intron> &m = merged[ source.group ] ;
+			int size = m.size() ;
+			if ( size > 0 && m[size - 1].chrId == source.cur.chrId 
+				&& m[size - 1].start == source.cur.start && m[size - 1].end == source.cur.end )
+				AddIntron( m[size - 1], source.cur ) ;
+			else
+				m.push_back( source.cur ) ;
+
+			struct _intron prev = source.cur ;
+			bool more ;
+			if ( source.reader == NULL )
+			{
+				more = ( source.next < (int)introns[ source.group ].size() ) ;
+				if ( more )
+					source.cur = introns[ source.group ][ source.next++ ] ;
+			}
+			else
+				more = ReadIntron( *source.reader, source.chrIds, alignments, groupSampleCnt[ source.group ], source.cur ) ;
+			if ( more )
+			{
+				if ( !CompIntrons( prev, source.cur ) )
+				{
+					sorted = false ;
+					break ;
+				}
+				heap.push( top ) ;
+			}
 		}
-		fclose( fp ) ;
 
-		CoalesceIntrons( introns ) ;
+		for ( j = groupCnt ; j < (int)sources.size() ; ++j )
+			delete sources[j].reader ;
+		if ( !sorted )
+			return false ;
+		introns.swap( merged ) ;
 	}
-	fclose( fpList ) ;
+	return true ;
+}
 
+// Select the trusted introns from the introns merged from sampleCnt samples.
+void GetTrustedIntrons( std::vector<struct _intron> &introns, int sampleCnt, Alignments &alignments, 
+	double averageSupportThreshold, std::vector<struct _intron> &trusted )
+{
 	// Obtain the split sites.
+	int i, j, k ;
+	std::vector<struct _site> sites ;
 	int intronCnt = introns.size() ;
+	if ( intronCnt == 0 )
+		return ;
 	for ( i = 0 ; i < intronCnt ; ++i )
 	{
 		struct _site ns ;
@@ -422,8 +531,415 @@ int main( int argc, char *argv[] )
 		}
 		
 				
-		printf( "%s %d %d 10 %c 10 0 0 0\n", alignments.GetChromName( introns[i].chrId ), introns[i].start, introns[i].end, introns[i].strand ) ;
+		trusted.push_back( introns[i] ) ;
+	}
+}
+
+// Merge the introns of the splice files into introns[g] for each group g.
+void CollectIntrons( std::vector<std::string> &files, std::vector<int> &groups, Alignments &alignments, 
+	std::vector< std::vector<struct _intron> > &introns )
+{
+	int i, g ;
+	int fileCnt = files.size() ;
+	int groupCnt = introns.size() ;
+	if ( !MergeSpliceFiles( files, groups, alignments, introns ) )
+	{
+		// Some file is not sorted, so collect the introns file by file.
+		for ( g = 0 ; g < groupCnt ; ++g )
+		{
+			int sampleCnt = 0 ;
+			for ( i = 0 ; i < fileCnt ; ++i )
+				if ( groups[i] == g )
+					++sampleCnt ;
+
+			introns[g].clear() ;
+			for ( i = 0 ; i < fileCnt ; ++i )
+			{
+				if ( groups[i] != g )
+					continue ;
+				struct _intron ni ;
+				IntronTableReader reader ;
+				std::vector<int> chrIds ;
+				OpenSpliceFile( files[i].c_str(), reader ) ;
+				while ( ReadIntron( reader, chrIds, alignments, sampleCnt, ni ) )
+					introns[g].push_back( ni ) ;
+				reader.Close() ;
+
+				CoalesceIntrons( introns[g] ) ;
+			}
+		}
+	}
+}
+
+void OutputTrustedIntrons( FILE *fp, std::vector<struct _intron> &trusted, Alignments &alignments )
+{
+	int i ;
+	int size = trusted.size() ;
+	for ( i = 0 ; i < size ; ++i )
+		fprintf( fp, "%s %d %d 10 %c 10 0 0 0\n", alignments.GetChromName( trusted[i].chrId ), trusted[i].start, trusted[i].end, trusted[i].strand ) ;
+}
+
+// Keep the introns of a raw splice file that are trusted, with the trusted strand, as FilterSplice.pl does.
+void FilterSpliceFile( const char *inFile, const char *outFile, bool binary, std::vector<struct _intron> &trusted,
+	std::map<std::string, int> &chrNameToId )
+{
+	IntronTableReader reader ;
+	IntronTableWriter writer ;
+	std::vector<int> chrIds ; // from the ids of the file to the BAM file, -2 if not looked up yet
+	struct _intronRecord r ;
+	OpenSpliceFile( inFile, reader ) ;
+	FILE *fpOut = fopen( outFile, "w" ) ;
+	if ( fpOut == NULL )
+	{
+		fprintf( stderr, "Could not write file %s\n", outFile ) ;
+		exit( 1 ) ;
+	}
+	writer.Open( fpOut, binary ) ;
+
+	while ( reader.Next( r ) )
+	{
+		const char *chrName = reader.GetChromName( r.chrId ) ;
+		if ( r.chrId >= (int)chrIds.size() )
+			chrIds.resize( r.chrId + 1, -2 ) ;
+		if ( chrIds[ r.chrId ] == -2 )
+		{
+			std::map<std::string, int>::iterator it = chrNameToId.find( std::string( chrName ) ) ;
+			chrIds[ r.chrId ] = ( it == chrNameToId.end() ) ? -1 : it->second ;
+		}
+		if ( chrIds[ r.chrId ] == -1 )
+			continue ;
+
+		struct _intron key ;
+		key.chrId = chrIds[ r.chrId ] ;
+		key.start = r.start ;
+		key.end = r.end ;
+		std::vector<struct _intron>::iterator t = std::lower_bound( trusted.begin(), trusted.end(), key, CompIntrons ) ;
+		if ( t == trusted.end() || t->chrId != key.chrId || t->start != r.start || t->end != r.end )
+			continue ;
+
+		if ( r.support <= 0 )
+		{
+			r.support = 1 ;
+			r.uniqSupport = 1 ;
+			r.secSupport = r.uniqEditDist = r.secEditDist = 0 ;
+		}
+		if ( t->strand != '\0' ) // the trusted introns from the user may have no strand
+			r.strand = t->strand ;
+		writer.Add( chrName, r ) ;
+	}
+	writer.Close() ;
+	fclose( fpOut ) ;
+}
+
+struct _filterJob
+{
+	const char *inFile ;
+	std::string outFile ;
+	bool binary ;
+	std::vector<struct _intron> *pTrusted ;
+} ;
+
+struct _filterThreadArg
+{
+	std::vector<struct _filterJob> *pJobs ;
+	int *pNextJob ;
+	pthread_mutex_t *pJobLock ;
+	std::map<std::string, int> *pChrNameToId ;
+} ;
+
+void *FilterSplice_Thread( void *pArg )
+{
+	struct _filterThreadArg &arg = *( (struct _filterThreadArg *)pArg ) ;
+	std::vector<struct _filterJob> &jobs = *arg.pJobs ;
+	int size = jobs.size() ;
+	while ( 1 )
+	{
+		int k ;
+		pthread_mutex_lock( arg.pJobLock ) ;
+		k = *arg.pNextJob ;
+		++*arg.pNextJob ;
+		pthread_mutex_unlock( arg.pJobLock ) ;
+		if ( k >= size )
+			break ;
+		FilterSpliceFile( jobs[k].inFile, jobs[k].outFile.c_str(), jobs[k].binary, *jobs[k].pTrusted, *arg.pChrNameToId ) ;
+	}
+	pthread_exit( NULL ) ;
+}
+
+// Filter each raw splice file with the trusted introns of its group, numThreads files at a time.
+void FilterSpliceFiles( std::vector<struct _filterJob> &jobs, Alignments &alignments, int numThreads )
+{
+	int i ;
+	std::map<std::string, int> chrNameToId ;
+	int chrCnt = alignments.GetChromCount() ;
+	for ( i = 0 ; i < chrCnt ; ++i )
+		chrNameToId[ std::string( alignments.GetChromName( i ) ) ] = i ;
+
+	if ( numThreads > (int)jobs.size() )
+		numThreads = jobs.size() ;
+	if ( numThreads <= 1 )
+	{
+		for ( i = 0 ; i < (int)jobs.size() ; ++i )
+			FilterSpliceFile( jobs[i].inFile, jobs[i].outFile.c_str(), jobs[i].binary, *jobs[i].pTrusted, chrNameToId ) ;
+		return ;
+	}
+
+	pthread_mutex_t jobLock ;
+	pthread_attr_t pthreadAttr ;
+	pthread_t *threads = new pthread_t[ numThreads ] ;
+	struct _filterThreadArg *args = new struct _filterThreadArg[ numThreads ] ;
+	int nextJob = 0 ;
+
+	pthread_mutex_init( &jobLock, NULL ) ;
+	pthread_attr_init( &pthreadAttr ) ;
+	pthread_attr_setdetachstate( &pthreadAttr, PTHREAD_CREATE_JOINABLE ) ;
+	for ( i = 0 ; i < numThreads ; ++i )
+	{
+		args[i].pJobs = &jobs ;
+		args[i].pNextJob = &nextJob ;
+		args[i].pJobLock = &jobLock ;
+		args[i].pChrNameToId = &chrNameToId ;
+		pthread_create( &threads[i], &pthreadAttr, FilterSplice_Thread, &args[i] ) ;
+	}
+	for ( i = 0 ; i < numThreads ; ++i )
+		pthread_join( threads[i], NULL ) ;
+	pthread_attr_destroy( &pthreadAttr ) ;
+	pthread_mutex_destroy( &jobLock ) ;
+	delete[] threads ;
+	delete[] args ;
+}
+
+// Read the trusted introns given by the user. The introns on chromosomes not in the BAM file are dropped.
+void ReadTrustedIntrons( const char *file, Alignments &alignments, std::vector<struct _intron> &trusted )
+{
+	int i, k ;
+	IntronTableReader reader ;
+	struct _intronRecord r ;
+	std::map<std::string, int> chrNameToId ;
+	int chrCnt = alignments.GetChromCount() ;
+	for ( i = 0 ; i < chrCnt ; ++i )
+		chrNameToId[ std::string( alignments.GetChromName( i ) ) ] = i ;
+
+	OpenSpliceFile( file, reader ) ;
+	while ( reader.Next( r ) )
+	{
+		std::map<std::string, int>::iterator it = chrNameToId.find( std::string( reader.GetChromName( r.chrId ) ) ) ;
+		if ( it == chrNameToId.end() )
+			continue ;
+		struct _intron ni ;
+		ni.chrId = it->second ;
+		ni.start = r.start ;
+		ni.end = r.end ;
+		ni.support = r.support ;
+		ni.strand = r.strand ;
+		ni.uniqSupport = r.uniqSupport ;
+		ni.secSupport = r.secSupport ;
+		ni.sampleSupport = 1 ;
+		ni.editDist = r.uniqEditDist + r.secEditDist ;
+		trusted.push_back( ni ) ;
+	}
+
+	// A repeated intron takes its last strand.
+	std::stable_sort( trusted.begin(), trusted.end(), CompIntrons ) ;
+	int size = trusted.size() ;
+	k = -1 ;
+	for ( i = 0 ; i < size ; ++i )
+	{
+		if ( k >= 0 && trusted[k].chrId == trusted[i].chrId && trusted[k].start == trusted[i].start 
+			&& trusted[k].end == trusted[i].end )
+			trusted[k] = trusted[i] ;
+		else
+			trusted[++k] = trusted[i] ;
+	}
+	trusted.resize( k + 1 ) ;
+}
+
+// Print a text or binary splice file as text.
+void ExportSpliceFile( const char *file )
+{
+	IntronTableReader reader ;
+	IntronTableWriter writer ;
+	struct _intronRecord r ;
+	OpenSpliceFile( file, reader ) ;
+	writer.Open( stdout, false ) ;
+	while ( reader.Next( r ) )
+		writer.Add( reader.GetChromName( r.chrId ), r ) ;
+	writer.Close() ;
+}
+
+int main( int argc, char *argv[] )
+{
+	int i ;
+	FILE *fpList ;	
+	char spliceFile[2048] ;
+	char buffer[2048] ;
+	Alignments alignments ;
+	double averageSupportThreshold = 0.5 ;
+	bool filter = false ;
+	char *bamGroupFile = NULL ;
+	char *outPrefix = NULL ;
+	char *trustedFile = NULL ;
+	bool binaryOutput = false ;
+	int numThreads = 1 ;
+
+	if ( argc <= 1 )
+	{
+		printf( "%s", usage ) ;
+		exit( 1 ) ;
+	}
+
+	if ( !strcmp( argv[1], "--export" ) && argc == 3 )
+	{
+		ExportSpliceFile( argv[2] ) ;
+		return 0 ;
+	}
+
+	for ( i = 3 ; i < argc ; ++i )
+	{
+		if ( !strcmp( argv[ i ], "-a" ) )
+		{
+			averageSupportThreshold = atof( argv[i + 1] ) ;
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "--filter" ) )
+		{
+			filter = true ;
+		}
+		else if ( !strcmp( argv[i], "--bamGroup" ) )
+		{
+			bamGroupFile = argv[i + 1] ;
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "-o" ) )
+		{
+			outPrefix = argv[i + 1] ;
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "-p" ) )
+		{
+			numThreads = atoi( argv[i + 1] ) ;
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "--trusted" ) )
+		{
+			trustedFile = argv[i + 1] ;
+			++i ;
+		}
+		else if ( !strcmp( argv[i], "--binary" ) )
+		{
+			binaryOutput = true ;
+		}
+		else
+		{
+			printf( "Unknown option: %s", argv[i] ) ;
+			exit( 1 ) ;
+		}
+	}
+	if ( bamGroupFile != NULL && outPrefix == NULL )
+	{
+		fprintf( stderr, "--bamGroup needs -o.\n" ) ;
+		exit( 1 ) ;
+	}
+	if ( bamGroupFile != NULL && trustedFile != NULL )
+	{
+		fprintf( stderr, "--bamGroup and --trusted can not be used together.\n" ) ;
+		exit( 1 ) ;
+	}
+
+	alignments.Open( argv[2] ) ;
+
+	// Get the samples.
+	std::vector<std::string> spliceFiles ;
+	fpList = fopen( argv[1], "r" ) ;
+	while ( fscanf( fpList, "%s", spliceFile ) != EOF )
+	{
+		spliceFiles.push_back( std::string( spliceFile ) ) ;
+	}
+	fclose( fpList ) ;
+	int sampleCnt = spliceFiles.size() ;
+
+	// Get the group of each sample, numbered by their first appearance.
+	std::vector<int> sampleGroup( sampleCnt, 0 ) ;
+	int groupCnt = 1 ;
+	if ( bamGroupFile != NULL )
+	{
+		std::map<std::string, int> groupNameToId ;
+		FILE *fpGroup = fopen( bamGroupFile, "r" ) ;
+		if ( fpGroup == NULL )
+		{
+			fprintf( stderr, "Could not open file %s\n", bamGroupFile ) ;
+			exit( 1 ) ;
+		}
+		for ( i = 0 ; i < sampleCnt ; ++i )
+		{
+			if ( fgets( buffer, sizeof( buffer ), fpGroup ) == NULL )
+			{
+				fprintf( stderr, "%s has fewer lines than %s.\n", bamGroupFile, argv[1] ) ;
+				exit( 1 ) ;
+			}
+			int len = strlen( buffer ) ;
+			if ( len > 0 && buffer[len - 1] == '\n' )
+				buffer[len - 1] = '\0' ;
+			std::string name( buffer ) ;
+			if ( groupNameToId.find( name ) == groupNameToId.end() )
+			{
+				int id = groupNameToId.size() ;
+				groupNameToId[name] = id ;
+			}
+			sampleGroup[i] = groupNameToId[name] ;
+		}
+		fclose( fpGroup ) ;
+		groupCnt = groupNameToId.size() ;
 	}
 
+	// Get the trusted introns of each group, with all the groups merged together.
+	std::vector< std::vector<struct _intron> > trusted( groupCnt ) ;
+	std::vector< std::vector<struct _intron> > introns( groupCnt ) ;
+	std::vector<int> groupSampleCnt( groupCnt, 0 ) ;
+	if ( trustedFile != NULL )
+		ReadTrustedIntrons( trustedFile, alignments, trusted[0] ) ;
+	else
+		CollectIntrons( spliceFiles, sampleGroup, alignments, introns ) ;
+	for ( i = 0 ; i < sampleCnt ; ++i )
+		++groupSampleCnt[ sampleGroup[i] ] ;
+	for ( i = 0 ; i < groupCnt && trustedFile == NULL ; ++i )
+	{
+		GetTrustedIntrons( introns[i], groupSampleCnt[i], alignments, averageSupportThreshold, trusted[i] ) ;
+		std::vector<struct _intron>().swap( introns[i] ) ;
+
+		if ( bamGroupFile == NULL )
+			OutputTrustedIntrons( stdout, trusted[i], alignments ) ;
+		else
+		{
+			sprintf( buffer, "%s_%d.trusted_splice", outPrefix, i ) ;
+			FILE *fpOut = fopen( buffer, "w" ) ;
+			if ( fpOut == NULL )
+			{
+				fprintf( stderr, "Could not write file %s\n", buffer ) ;
+				exit( 1 ) ;
+			}
+			OutputTrustedIntrons( fpOut, trusted[i], alignments ) ;
+			fclose( fpOut ) ;
+		}
+	}
+
+	// Write NAME.splice next to each NAME.raw_splice.
+	if ( filter )
+	{
+		std::vector<struct _filterJob> jobs( sampleCnt ) ;
+		for ( i = 0 ; i < sampleCnt ; ++i )
+		{
+			const std::string &name = spliceFiles[i] ;
+			const std::string suffix( ".raw_splice" ) ;
+			jobs[i].inFile = name.c_str() ;
+			if ( name.size() > suffix.size() && !name.compare( name.size() - suffix.size(), suffix.size(), suffix ) )
+				jobs[i].outFile = name.substr( 0, name.size() - suffix.size() ) + ".splice" ;
+			else
+				jobs[i].outFile = name + ".splice" ;
+			jobs[i].binary = binaryOutput ;
+			jobs[i].pTrusted = &trusted[ sampleGroup[i] ] ;
+		}
+		FilterSpliceFiles( jobs, alignments, numThreads ) ;
+	}
 	return 0 ;
 }
@@ -0,0 +1,351 @@
+// The introns passed between junc, trust-splice and subexon-info (the raw_splice and splice files).
+// An intron is a text line "chrom start end support strand uniqSupport secSupport uniqEditDist secEditDist",
+// or a fixed-width record of the binary table:
+//	magic | records | chromosome names, runs of records on each chromosome | offset of the names | magic
+
+#ifndef _LSONG_CLASSES_INTRON_TABLE_HEADER
+#define _LSONG_CLASSES_INTRON_TABLE_HEADER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#define INTRON_TABLE_MAGIC "PSISPLC1"
+#define INTRON_TABLE_MAGIC_LEN 8
+
+struct _intronRecord
+{
+	int32_t chrId ; // the index in the chromosome names of the table
+	int32_t start, end ;
+	int32_t support ;
+	int32_t uniqSupport, secSupport ;
+	int32_t uniqEditDist, secEditDist ;
+	char strand ;
+	char padding[3] ;
+} ;
+
+// Consecutive records on one chromosome.
+struct _intronRun
+{
+	int32_t chrId ;
+	int32_t padding ;
+	int64_t first ;
+	int64_t count ;
+} ;
+
+class IntronTableWriter
+{
+private:
+	FILE *fp ;
+	bool binary ;
+	int64_t recordCnt ;
+	std::vector<std::string> chrNames ;
+	std::map<std::string, int> chrNameToId ;
+	int lastChrId ;
+	std::vector<struct _intronRun> runs ;
+	std::vector<struct _intronRecord> records ; // without a file, the records wait here for Append.
+
+	int GetChromId( const char *name )
+	{
+		if ( lastChrId != -1 && !strcmp( chrNames[ lastChrId ].c_str(), name ) )
+			return lastChrId ;
+		std::string s( name ) ;
+		std::map<std::string, int>::iterator it = chrNameToId.find( s ) ;
+		if ( it == chrNameToId.end() )
+		{
+			lastChrId = chrNames.size() ;
+			chrNameToId[s] = lastChrId ;
+			chrNames.push_back( s ) ;
+		}
+		else
+			lastChrId = it->second ;
+		return lastChrId ;
+	}
+
+	void WriteBinary( const void *p, size_t size )
+	{
+		if ( fwrite( p, 1, size, fp ) != size )
+		{
+			fprintf( stderr, "Could not write the intron table.\n" ) ;
+			exit( 1 ) ;
+		}
+	}
+public:
+	IntronTableWriter()
+	{
+		fp = NULL ;
+		binary = false ;
+		recordCnt = 0 ;
+		lastChrId = -1 ;
+	}
+
+	~IntronTableWriter()
+	{
+	}
+
+	// Write the introns to fp, as the binary table or as text. If fp is NULL, keep them in memory.
+	void Open( FILE *f, bool b )
+	{
+		fp = f ;
+		binary = b ;
+		recordCnt = 0 ;
+		lastChrId = -1 ;
+		chrNames.clear() ;
+		chrNameToId.clear() ;
+		runs.clear() ;
+		records.clear() ;
+		if ( fp != NULL && binary )
+			WriteBinary( INTRON_TABLE_MAGIC, INTRON_TABLE_MAGIC_LEN ) ;
+	}
+
+	void Add( const char *chrName, struct _intronRecord &r )
+	{
+		r.chrId = GetChromId( chrName ) ;
+		if ( fp == NULL )
+		{
+			records.push_back( r ) ;
+			return ;
+		}
+
+		if ( !binary )
+		{
+			fprintf( fp, "%s %d %d %d %c %d %d %d %d\n", chrName, r.start, r.end, r.support, r.strand,
+				r.uniqSupport, r.secSupport, r.uniqEditDist, r.secEditDist ) ;
+			return ;
+		}
+
+		memset( r.padding, 0, sizeof( r.padding ) ) ;
+		WriteBinary( &r, sizeof( r ) ) ;
+		int size = runs.size() ;
+		if ( size > 0 && runs[size - 1].chrId == r.chrId )
+			++runs[size - 1].count ;
+		else
+		{
+			struct _intronRun nr ;
+			nr.chrId = r.chrId ;
+			nr.padding = 0 ;
+			nr.first = recordCnt ;
+			nr.count = 1 ;
+			runs.push_back( nr ) ;
+		}
+		++recordCnt ;
+	}
+
+	// Add the introns kept in the memory of another writer.
+	void Append( IntronTableWriter &w )
+	{
+		int i ;
+		int size = w.records.size() ;
+		for ( i = 0 ; i < size ; ++i )
+			Add( w.chrNames[ w.records[i].chrId ].c_str(), w.records[i] ) ;
+	}
+
+	// Finish the binary table. The file itself is closed by the caller.
+	void Close()
+	{
+		if ( fp != NULL && binary )
+		{
+			int i ;
+			int64_t indexOffset = INTRON_TABLE_MAGIC_LEN + recordCnt * (int64_t)sizeof( struct _intronRecord ) ;
+			int32_t cnt = chrNames.size() ;
+			WriteBinary( &cnt, sizeof( cnt ) ) ;
+			for ( i = 0 ; i < cnt ; ++i )
+			{
+				int32_t len = chrNames[i].size() ;
+				WriteBinary( &len, sizeof( len ) ) ;
+				WriteBinary( chrNames[i].c_str(), len ) ;
+			}
+			cnt = runs.size() ;
+			WriteBinary( &cnt, sizeof( cnt ) ) ;
+			if ( cnt > 0 )
+				WriteBinary( &runs[0], sizeof( struct _intronRun ) * cnt ) ;
+			WriteBinary( &indexOffset, sizeof( indexOffset ) ) ;
+			WriteBinary( INTRON_TABLE_MAGIC, INTRON_TABLE_MAGIC_LEN ) ;
+		}
+		fp = NULL ;
+		records.clear() ;
+	}
+} ;
+
+class IntronTableReader
+{
+private:
+	FILE *fp ;
+	bool binary ;
+	int64_t recordCnt ;
+	int64_t nextRecord ;
+	std::vector<std::string> chrNames ;
+	std::map<std::string, int> chrNameToId ;
+	int lastChrId ;
+	std::vector<struct _intronRun> runs ;
+
+	int GetChromId( const char *name )
+	{
+		if ( lastChrId != -1 && !strcmp( chrNames[ lastChrId ].c_str(), name ) )
+			return lastChrId ;
+		std::string s( name ) ;
+		std::map<std::string, int>::iterator it = chrNameToId.find( s ) ;
+		if ( it == chrNameToId.end() )
+		{
+			lastChrId = chrNames.size() ;
+			chrNameToId[s] = lastChrId ;
+			chrNames.push_back( s ) ;
+		}
+		else
+			lastChrId = it->second ;
+		return lastChrId ;
+	}
+
+	bool ReadBinary( void *p, size_t size )
+	{
+		return fread( p, 1, size, fp ) == size ;
+	}
+
+	// Load the chromosome names and the runs at the end of the binary table.
+	bool ReadIndex()
+	{
+		int i ;
+		int64_t indexOffset ;
+		char magic[INTRON_TABLE_MAGIC_LEN] ;
+		int32_t cnt ;
+		if ( fseek( fp, -( (long)sizeof( indexOffset ) + INTRON_TABLE_MAGIC_LEN ), SEEK_END )
+			|| !ReadBinary( &indexOffset, sizeof( indexOffset ) ) || !ReadBinary( magic, INTRON_TABLE_MAGIC_LEN )
+			|| memcmp( magic, INTRON_TABLE_MAGIC, INTRON_TABLE_MAGIC_LEN ) )
+			return false ;
+		recordCnt = ( indexOffset - INTRON_TABLE_MAGIC_LEN ) / (int64_t)sizeof( struct _intronRecord ) ;
+		if ( fseek( fp, indexOffset, SEEK_SET ) || !ReadBinary( &cnt, sizeof( cnt ) ) )
+			return false ;
+		for ( i = 0 ; i < cnt ; ++i )
+		{
+			int32_t len ;
+			if ( !ReadBinary( &len, sizeof( len ) ) || len < 0 )
+				return false ;
+			std::string name( len, '\0' ) ;
+			if ( len > 0 && !ReadBinary( &name[0], len ) )
+				return false ;
+			chrNameToId[name] = chrNames.size() ;
+			chrNames.push_back( name ) ;
+		}
+		if ( !ReadBinary( &cnt, sizeof( cnt ) ) || cnt < 0 )
+			return false ;
+		runs.resize( cnt ) ;
+		if ( cnt > 0 && !ReadBinary( &runs[0], sizeof( struct _intronRun ) * cnt ) )
+			return false ;
+		return fseek( fp, INTRON_TABLE_MAGIC_LEN, SEEK_SET ) == 0 ;
+	}
+public:
+	IntronTableReader()
+	{
+		fp = NULL ;
+		binary = false ;
+		recordCnt = nextRecord = 0 ;
+		lastChrId = -1 ;
+	}
+
+	~IntronTableReader()
+	{
+		Close() ;
+	}
+
+	// Open a text or binary splice file. Return false if it can not be opened.
+	bool Open( const char *file )
+	{
+		char magic[INTRON_TABLE_MAGIC_LEN] ;
+		Close() ;
+		fp = fopen( file, "rb" ) ;
+		if ( fp == NULL )
+			return false ;
+		binary = ( ReadBinary( magic, INTRON_TABLE_MAGIC_LEN ) && !memcmp( magic, INTRON_TABLE_MAGIC, INTRON_TABLE_MAGIC_LEN ) ) ;
+		if ( binary )
+		{
+			if ( !ReadIndex() )
+			{
+				fprintf( stderr, "%s is not a complete intron table.\n", file ) ;
+				exit( 1 ) ;
+			}
+		}
+		else
+			rewind( fp ) ;
+		return true ;
+	}
+
+	void Close()
+	{
+		if ( fp != NULL )
+			fclose( fp ) ;
+		fp = NULL ;
+		binary = false ;
+		recordCnt = nextRecord = 0 ;
+		lastChrId = -1 ;
+		chrNames.clear() ;
+		chrNameToId.clear() ;
+		runs.clear() ;
+	}
+
+	bool IsBinary()
+	{
+		return binary ;
+	}
+
+	// The number of introns in a binary table, -1 for a text file.
+	int64_t GetRecordCount()
+	{
+		return binary ? recordCnt : -1 ;
+	}
+
+	// Read the next intron. Return false at the end of the file.
+	bool Next( struct _intronRecord &r )
+	{
+		if ( binary )
+		{
+			if ( nextRecord >= recordCnt || !ReadBinary( &r, sizeof( r ) ) )
+				return false ;
+			++nextRecord ;
+			return true ;
+		}
+
+		// A line may have only the first three columns, e.g. the trusted introns given by the user.
+		char line[4096], chrName[1024], strand[3] ;
+		while ( fgets( line, sizeof( line ), fp ) != NULL )
+		{
+			r.support = r.uniqSupport = r.secSupport = r.uniqEditDist = r.secEditDist = 0 ;
+			strand[0] = '\0' ;
+			if ( sscanf( line, "%1023s %d %d %d %2s %d %d %d %d", chrName, &r.start, &r.end, &r.support, strand,
+				&r.uniqSupport, &r.secSupport, &r.uniqEditDist, &r.secEditDist ) < 3 )
+				continue ;
+			r.strand = strand[0] ; // '\0' if the strand is not given
+			r.chrId = GetChromId( chrName ) ;
+			return true ;
+		}
+		return false ;
+	}
+
+	const char *GetChromName( int chrId )
+	{
+		return chrNames[ chrId ].c_str() ;
+	}
+
+	// Go to the first intron on the chromosome in a binary table. Return false if it has none.
+	bool SeekChrom( const char *name )
+	{
+		int i ;
+		std::map<std::string, int>::iterator it = chrNameToId.find( std::string( name ) ) ;
+		if ( !binary || it == chrNameToId.end() )
+			return false ;
+		for ( i = 0 ; i < (int)runs.size() ; ++i )
+		{
+			if ( runs[i].chrId == it->second )
+			{
+				nextRecord = runs[i].first ;
+				return fseek( fp, INTRON_TABLE_MAGIC_LEN + nextRecord * (int64_t)sizeof( struct _intronRecord ), SEEK_SET ) == 0 ;
+			}
+		}
+		return false ;
+	}
+} ;
+
+#endif
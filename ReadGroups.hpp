@@ -0,0 +1,101 @@
+// The read groups (@RG lines) of a BAM header, so the records of a merged BAM file can be
+// routed to their samples by the RG tag.
+
+#ifndef _LSONG_CLASSES_READ_GROUPS_HEADER
+#define _LSONG_CLASSES_READ_GROUPS_HEADER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+class ReadGroups
+{
+private:
+	std::vector<std::string> ids ;
+	std::map<std::string, int> idToIdx ;
+
+	// Consecutive records mostly come from the same read group.
+	std::string lastId ;
+	int lastIdx ;
+public:
+	ReadGroups()
+	{
+		lastIdx = -1 ;
+	}
+
+	~ReadGroups()
+	{
+	}
+
+	// Collect the ID of each @RG line in the header text, in order. Return the number of read groups.
+	int Parse( const char *text )
+	{
+		const char *p ;
+		ids.clear() ;
+		idToIdx.clear() ;
+		lastId = "" ;
+		lastIdx = -1 ;
+		if ( text == NULL )
+			return 0 ;
+		for ( p = text ; *p ; )
+		{
+			const char *lineEnd = strchr( p, '\n' ) ;
+			if ( lineEnd == NULL )
+				lineEnd = p + strlen( p ) ;
+			if ( !strncmp( p, "@RG\t", 4 ) )
+			{
+				const char *s ;
+				for ( s = p + 3 ; s < lineEnd ; ++s )
+				{
+					if ( *s == '\t' && s + 3 < lineEnd && !strncmp( s + 1, "ID:", 3 ) )
+						break ;
+				}
+				if ( s < lineEnd )
+				{
+					const char *e ;
+					s += 4 ;
+					for ( e = s ; e < lineEnd && *e != '\t' && *e != '\r' ; ++e )
+						;
+					std::string id( s, e - s ) ;
+					if ( idToIdx.find( id ) == idToIdx.end() )
+					{
+						idToIdx[id] = ids.size() ;
+						ids.push_back( id ) ;
+					}
+				}
+			}
+			p = *lineEnd ? lineEnd + 1 : lineEnd ;
+		}
+		return ids.size() ;
+	}
+
+	int GetCount()
+	{
+		return ids.size() ;
+	}
+
+	const char *GetId( int idx )
+	{
+		return ids[idx].c_str() ;
+	}
+
+	// Return the index of the read group, or -1 if it is not in the header.
+	int GetIdx( const char *id )
+	{
+		if ( id == NULL )
+			return -1 ;
+		if ( lastIdx != -1 && !strcmp( lastId.c_str(), id ) )
+			return lastIdx ;
+		std::map<std::string, int>::iterator it = idToIdx.find( std::string( id ) ) ;
+		if ( it == idToIdx.end() )
+			return -1 ;
+		lastId = it->first ;
+		lastIdx = it->second ;
+		return lastIdx ;
+	}
+} ;
+
+#endif
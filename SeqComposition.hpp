@@ -0,0 +1,126 @@
+// The base composition of the 4-bit packed sequence of a BAM record (A=1, C=2, G=4, T=8, N=15).
+// Whole bytes are counted two bases at a time with AVX2 or SSE2, chosen at run time on x86.
+
+#ifndef _LSONG_CLASSES_SEQ_COMPOSITION_HEADER
+#define _LSONG_CLASSES_SEQ_COMPOSITION_HEADER
+
+#include <stdint.h>
+
+#if defined( __x86_64__ )
+#include <immintrin.h>
+#define SEQ_COMPOSITION_X86
+#endif
+
+// The index of each 4-bit code in the counts: A, C, G, T, N. The other codes count as A.
+static const char packedNucToIdx[16] = { 0, 0, 1, 0, 2, 0, 0, 0,
+	3, 0, 0, 0, 0, 0, 0, 4 } ;
+
+// Add the composition of the bytes seq[from..to) to counts. A byte holds two bases, the first one in the high bits.
+static inline void CountPackedBytes_Scalar( const uint8_t *seq, int from, int to, int counts[5] )
+{
+	int i ;
+	for ( i = from ; i < to ; ++i )
+	{
+		++counts[ (int)packedNucToIdx[ seq[i] >> 4 ] ] ;
+		++counts[ (int)packedNucToIdx[ seq[i] & 0xf ] ] ;
+	}
+}
+
+#ifdef SEQ_COMPOSITION_X86
+static inline void CountPackedBytes_SSE2( const uint8_t *seq, int from, int to, int counts[5] )
+{
+	const __m128i lowMask = _mm_set1_epi8( 0xf ) ;
+	const __m128i codeC = _mm_set1_epi8( 2 ) ;
+	const __m128i codeG = _mm_set1_epi8( 4 ) ;
+	const __m128i codeT = _mm_set1_epi8( 8 ) ;
+	const __m128i codeN = _mm_set1_epi8( 15 ) ;
+	int i ;
+	int c = 0, g = 0, t = 0, n = 0 ;
+	for ( i = from ; i + 16 <= to ; i += 16 )
+	{
+		__m128i v = _mm_loadu_si128( (const __m128i *)( seq + i ) ) ;
+		__m128i hi = _mm_and_si128( _mm_srli_epi16( v, 4 ), lowMask ) ;
+		__m128i lo = _mm_and_si128( v, lowMask ) ;
+		c += __builtin_popcount( _mm_movemask_epi8( _mm_cmpeq_epi8( hi, codeC ) ) )
+			+ __builtin_popcount( _mm_movemask_epi8( _mm_cmpeq_epi8( lo, codeC ) ) ) ;
+		g += __builtin_popcount( _mm_movemask_epi8( _mm_cmpeq_epi8( hi, codeG ) ) )
+			+ __builtin_popcount( _mm_movemask_epi8( _mm_cmpeq_epi8( lo, codeG ) ) ) ;
+		t += __builtin_popcount( _mm_movemask_epi8( _mm_cmpeq_epi8( hi, codeT ) ) )
+			+ __builtin_popcount( _mm_movemask_epi8( _mm_cmpeq_epi8( lo, codeT ) ) ) ;
+		n += __builtin_popcount( _mm_movemask_epi8( _mm_cmpeq_epi8( hi, codeN ) ) )
+			+ __builtin_popcount( _mm_movemask_epi8( _mm_cmpeq_epi8( lo, codeN ) ) ) ;
+	}
+	counts[0] += 2 * ( i - from ) - c - g - t - n ;
+	counts[1] += c ;
+	counts[2] += g ;
+	counts[3] += t ;
+	counts[4] += n ;
+	CountPackedBytes_Scalar( seq, i, to, counts ) ;
+}
+
+__attribute__(( target( "avx2" ) ))
+static inline void CountPackedBytes_AVX2( const uint8_t *seq, int from, int to, int counts[5] )
+{
+	const __m256i lowMask = _mm256_set1_epi8( 0xf ) ;
+	const __m256i codeC = _mm256_set1_epi8( 2 ) ;
+	const __m256i codeG = _mm256_set1_epi8( 4 ) ;
+	const __m256i codeT = _mm256_set1_epi8( 8 ) ;
+	const __m256i codeN = _mm256_set1_epi8( 15 ) ;
+	int i ;
+	int c = 0, g = 0, t = 0, n = 0 ;
+	for ( i = from ; i + 32 <= to ; i += 32 )
+	{
+		__m256i v = _mm256_loadu_si256( (const __m256i *)( seq + i ) ) ;
+		__m256i hi = _mm256_and_si256( _mm256_srli_epi16( v, 4 ), lowMask ) ;
+		__m256i lo = _mm256_and_si256( v, lowMask ) ;
+		c += __builtin_popcount( _mm256_movemask_epi8( _mm256_cmpeq_epi8( hi, codeC ) ) )
+			+ __builtin_popcount( _mm256_movemask_epi8( _mm256_cmpeq_epi8( lo, codeC ) ) ) ;
+		g += __builtin_popcount( _mm256_movemask_epi8( _mm256_cmpeq_epi8( hi, codeG ) ) )
+			+ __builtin_popcount( _mm256_movemask_epi8( _mm256_cmpeq_epi8( lo, codeG ) ) ) ;
+		t += __builtin_popcount( _mm256_movemask_epi8( _mm256_cmpeq_epi8( hi, codeT ) ) )
+			+ __builtin_popcount( _mm256_movemask_epi8( _mm256_cmpeq_epi8( lo, codeT ) ) ) ;
+		n += __builtin_popcount( _mm256_movemask_epi8( _mm256_cmpeq_epi8( hi, codeN ) ) )
+			+ __builtin_popcount( _mm256_movemask_epi8( _mm256_cmpeq_epi8( lo, codeN ) ) ) ;
+	}
+	counts[0] += 2 * ( i - from ) - c - g - t - n ;
+	counts[1] += c ;
+	counts[2] += g ;
+	counts[3] += t ;
+	counts[4] += n ;
+	CountPackedBytes_SSE2( seq, i, to, counts ) ;
+}
+#endif
+
+// Add the composition of the bases [start, end) of the packed sequence to counts (A, C, G, T, N).
+static inline void CountPackedBases( const uint8_t *seq, int start, int end, int counts[5] )
+{
+	if ( start >= end )
+		return ;
+	// The odd bases at the two ends share their byte with a base out of the range.
+	if ( start & 1 )
+	{
+		++counts[ (int)packedNucToIdx[ seq[ start >> 1 ] & 0xf ] ] ;
+		++start ;
+	}
+	if ( end & 1 )
+	{
+		--end ;
+		if ( end >= start )
+			++counts[ (int)packedNucToIdx[ seq[ end >> 1 ] >> 4 ] ] ;
+	}
+	if ( start >= end )
+		return ;
+#ifdef SEQ_COMPOSITION_X86
+	static int useAVX2 = -1 ;
+	if ( useAVX2 == -1 )
+		useAVX2 = __builtin_cpu_supports( "avx2" ) ? 1 : 0 ;
+	if ( useAVX2 )
+		CountPackedBytes_AVX2( seq, start >> 1, end >> 1, counts ) ;
+	else
+		CountPackedBytes_SSE2( seq, start >> 1, end >> 1, counts ) ;
+#else
+	CountPackedBytes_Scalar( seq, start >> 1, end >> 1, counts ) ;
+#endif
+}
+
+#endif
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
@@ -12,15 +13,24 @@
 #include <math.h>
 
 #include "alignments.hpp"
+#include "AlignmentSource.hpp"
 #include "blocks.hpp"
 #include "stats.hpp"
+#include "IntronTable.hpp"
 
 #define ABS(x) ((x)<0?-(x):(x))
 
 char usage[] = "./subexon-info alignment.bam intron.splice [options]\n"
+		"\talignment.bam can also be a SAM file, or - to read SAM from the standard input\n"
 		"options:\n"
 		"\t--minDepth INT: the minimum coverage depth considered as part of a subexon (default: 2)\n"
-		"\t--noStats: do not compute the statistical scores (default: not used)\n" ;
+		"\t--noStats: do not compute the statistical scores (default: not used)\n"
+		"\t--readThreads INT: number of threads decompressing the BAM file ahead of the reader (default: 0, not used)\n"
+		"\t--alignmentCache: keep the decoded alignments in alignment.bam.dac and reuse it in later passes (default: not used)\n"
+		"\t--libraryStats: keep the read and fragment length in alignment.bam.stats for the later stages (default: not used)\n"
+		"\t--indexSampling: estimate the read and fragment length from records spread over the genome through the BAM index (default: not used)\n"
+		"\t--readGroups STRING: alignment.bam holds one sample per read group. intron.splice lists the splice file of each read group,\n"
+		"\t\tand the subexons of the k-th read group go to STRING_k.out (default: not used)\n" ;
 char buffer[4096] ;
 
 int gMinDepth ;
@@ -764,54 +774,25 @@ double TransformCov( double c )
 	//return log( c ) / log( 2.0 ) ;
 }
 
-int main( int argc, char *argv[] )
+// Read the introns from junc's output.
+void ReadSplitSites( const char *file, Alignments &alignments, std::vector<struct _splitSite> &splitSites )
 {
-	int i, j ;
-	bool noStats = false ;
-	if ( argc < 3 )
+	IntronTableReader reader ;
+	if ( !reader.Open( file ) )
 	{
-		fprintf( stderr, usage ) ;
+		fprintf( stderr, "Can not open %s.\n", file ) ;
 		exit( 1 ) ;
 	}
-
-	gMinDepth = 2 ;
-
-	for ( i = 3 ; i < argc ; ++i )
-	{
-		if ( !strcmp( argv[i], "--noStats" ) )
-		{
-			noStats = true ;
-			continue ;
-		}
-		else if ( !strcmp( argv[i], "--minDepth" ) )
-		{
-			gMinDepth = atoi( argv[i + 1] ) ;
-			++i ;
-			continue ;
-		}
-		else
-		{
-			fprintf( stderr, "Unknown argument: %s\n", argv[i] ) ;
-			return 0 ;
-		}
-	}
-
-	Alignments alignments ;
-	alignments.Open( argv[1] ) ;
-	std::vector<struct _splitSite> splitSites ; // only compromised the 
-	std::vector<struct _splitSite> allSplitSites ;
-
-	// read in the splice site
-	FILE *fp ;
-	fp = fopen( argv[2], "r" ) ;
-	char chrom[50] ;
-	int64_t start, end ;
-	int support ;
-	char strand[3] ;
-	int uniqSupport, secondarySupport, uniqEditDistance, secondaryEditDistance ;
-	while ( fscanf( fp, "%s %" PRId64 " %" PRId64 " %d %s %d %d %d %d", chrom, &start, &end, &support, strand, 
-				&uniqSupport, &secondarySupport, &uniqEditDistance, &secondaryEditDistance ) != EOF )
+	if ( reader.GetRecordCount() > 0 )
+		splitSites.reserve( splitSites.size() + 2 * reader.GetRecordCount() ) ;
+	struct _intronRecord r ;
+	std::vector<int> chrIds ; // from the ids of the file to the BAM file
+	while ( reader.Next( r ) )
 	{
+		int64_t start = r.start, end = r.end ;
+		int support = r.support ;
+		int uniqSupport = r.uniqSupport ;
+		int uniqEditDistance = r.uniqEditDist, secondaryEditDistance = r.secEditDist ;
 		if ( support <= 0 )
 			continue ;
 		//if ( !( uniqSupport >= 1 
@@ -819,7 +800,11 @@ int main( int argc, char *argv[] )
 		//if ( uniqSupport <= 0.01 * ( uniqSupport + secondarySupport ) || ( uniqSupport == 0 && secondarySupport < 20 ) )
 		//if ( uniqSupport == 0 && secondarySupport <= 10 )
 		//	continue ;
-		int chrId = alignments.GetChromIdFromName( chrom ) ; 
+		if ( r.chrId >= (int)chrIds.size() )
+			chrIds.resize( r.chrId + 1, -1 ) ;
+		if ( chrIds[ r.chrId ] == -1 )
+			chrIds[ r.chrId ] = alignments.GetChromIdFromName( reader.GetChromName( r.chrId ) ) ;
+		int chrId = chrIds[ r.chrId ] ; 
 		struct _splitSite ss ;
 		--start ;
 		--end ;
@@ -827,7 +812,7 @@ int main( int argc, char *argv[] )
 		ss.chrId = chrId ;
 		ss.type = 2 ;
 		ss.oppositePos = end ;
-		ss.strand = strand[0] ;
+		ss.strand = r.strand ;
 		ss.support = support ;
 		ss.uniqSupport = uniqSupport ;
 		ss.mismatchSum = uniqEditDistance + secondaryEditDistance ;
@@ -836,52 +821,19 @@ int main( int argc, char *argv[] )
 		ss.pos = end ; 
 		ss.type = 1 ;
 		ss.oppositePos = start ;
-		ss.strand = strand[0] ;
+		ss.strand = r.strand ;
 		ss.support = support ;
 		ss.uniqSupport = uniqSupport ;
 		ss.mismatchSum = uniqEditDistance + secondaryEditDistance ;
 		splitSites.push_back( ss ) ;
 	}
-	fclose( fp ) ;
-	//printf( "ss:%d\n", splitSites.size() ) ;
-	
-	//printf( "ss:%d\n", splitSites.size() ) ;
-	
-	alignments.GetGeneralInfo( true ) ;
-	// Build the blocks
-	Blocks regions ;
-	alignments.Rewind() ;
-	regions.BuildExonBlocks( alignments ) ;
-	//printf( "%d\n", regions.exonBlocks.size() ) ;
-	
-	FilterAndSortSplitSites( splitSites ) ; 
-	FilterNearSplitSites( splitSites ) ;
-	FilterRepeatSplitSites( splitSites ) ;
-	regions.FilterSplitSitesInRegions( splitSites ) ;
-	regions.FilterGeneMergeSplitSites( splitSites ) ;
-
-
-	allSplitSites = splitSites ;
-	KeepUniqSplitSites( splitSites ) ;
-	
-	//for ( i = 0 ; i < splitSites.size() ; ++i )
-	//	printf( "%d %d\n", splitSites[i].pos + 1, splitSites[i].oppositePos + 1 ) ;
-	// Split the blocks using split site
-	regions.SplitBlocks( alignments, splitSites ) ;
-	//printf( "%d\n", regions.exonBlocks.size() ) ;
-	/*for ( i = 0 ; i < regions.exonBlocks.size() ; ++i )
-	{
-		struct _block &e = regions.exonBlocks[i] ;
-		printf( "%s %" PRId64 " %" PRId64 " %d %d\n", alignments.GetChromName( e.chrId ), e.start + 1, e.end + 1,  e.leftType, e.rightType ) ;
-	}
-	return 0 ;*/
-	// Recompute the coverage for each block. 
-	alignments.Rewind() ;
-	//printf( "Before computeDepth: %d\n", regions.exonBlocks.size() ) ;
-
-	regions.ComputeDepth( alignments ) ;
-	//printf( "After computeDepth: %d\n", regions.exonBlocks.size() ) ;
+	reader.Close() ;
+}
 
+// After the coverage is computed, connect the blocks by the introns.
+template <class T>
+void FinishRegions( T &alignments, Blocks &regions, std::vector<struct _splitSite> &allSplitSites )
+{
 	// Merge blocks that may have a hollow coverage by accident.
 	regions.MergeNearBlocks() ;
 	//printf( "After merge: %d\n", regions.exonBlocks.size() ) ;
@@ -892,56 +844,305 @@ int main( int argc, char *argv[] )
 
 	// Compute the average ratio against the left and right connected subexons.
 	regions.ComputeRatios() ;
-	//printf( "After compute ratios.\n" ) ;	
-	
-	//printf( "Finish building regions.\n" ) ;	
+	//printf( "After compute ratios.\n" ) ;
+}
+
+// The alignments that may still cover the blocks not flushed yet, replayed to AddDepth when the blocks are flushed.
+class PendingAlignments
+{
+private:
+	struct _pendingAlignment
+	{
+		int chrId ;
+		int segStart, segCnt ; // in segPool
+		int last ; // the rightmost coordinate of the segments
+	} ;
+	std::vector<struct _pendingAlignment> records ;
+	std::vector<struct _pair32> segPool ;
+	int idx ;
+	int chrId ;
+public:
+	struct _pair segments[MAX_SEG_COUNT] ;
+	int segCnt ;
+
+	PendingAlignments()
+	{
+		idx = -1 ;
+		chrId = -1 ;
+		segCnt = 0 ;
+	}
+
+	template <class T>
+	void Add( T &alignments )
+	{
+		int i ;
+		struct _pendingAlignment r ;
+		r.chrId = alignments.GetChromId() ;
+		r.segStart = segPool.size() ;
+		r.segCnt = alignments.segCnt ;
+		r.last = -1 ;
+		for ( i = 0 ; i < r.segCnt ; ++i )
+		{
+			struct _pair32 p ;
+			p.a = alignments.segments[i].a ;
+			p.b = alignments.segments[i].b ;
+			segPool.push_back( p ) ;
+			if ( p.a > r.last )
+				r.last = p.a ;
+			if ( p.b > r.last )
+				r.last = p.b ;
+		}
+		records.push_back( r ) ;
+	}
+
+	// Drop the alignments that end at or before pos on chrId, or on an earlier chromosome.
+	void Release( int chrId, int64_t pos )
+	{
+		int i, j ;
+		int size = records.size() ;
+		int k = 0, segK = 0 ;
+		for ( i = 0 ; i < size ; ++i )
+		{
+			struct _pendingAlignment r = records[i] ;
+			if ( r.chrId < chrId || ( r.chrId == chrId && r.last <= pos ) )
+				continue ;
+			for ( j = 0 ; j < r.segCnt ; ++j )
+				segPool[segK + j] = segPool[r.segStart + j] ;
+			r.segStart = segK ;
+			segK += r.segCnt ;
+			records[k] = r ;
+			++k ;
+		}
+		records.resize( k ) ;
+		segPool.resize( segK ) ;
+	}
+
+	void Rewind()
+	{
+		idx = -1 ;
+	}
+
+	int Next()
+	{
+		int i ;
+		if ( idx + 1 >= (int)records.size() )
+			return 0 ;
+		++idx ;
+		struct _pendingAlignment &r = records[idx] ;
+		chrId = r.chrId ;
+		segCnt = r.segCnt ;
+		for ( i = 0 ; i < segCnt ; ++i )
+		{
+			segments[i].a = segPool[ r.segStart + i ].a ;
+			segments[i].b = segPool[ r.segStart + i ].b ;
+		}
+		return 1 ;
+	}
+
+	int GetChromId()
+	{
+		return chrId ;
+	}
+} ;
+
+// Build the subexon blocks and their coverage in one pass over the alignments.
+// An exon block is final once the alignments have moved past it. The final blocks that no intron 
+// leads out of are split by the split sites, and their coverage comes from the pending alignments.
+class RegionBuilder
+{
+private:
+	Blocks building ; // the exon blocks still open to the alignments
+	Blocks cluster ; // the blocks being flushed. It keeps its depth arena for the next ones.
+	std::vector<struct _splitSite> sites ;
+	int siteTag ; // the sites before siteTag are flushed
+	int reachTag ; // the sites before reachTag are in reach
+	int reachChrId ;
+	int64_t reach ; // the farthest end of the introns in reach on reachChrId
+	int finalCnt ; // the number of the final blocks at the head of building
+	PendingAlignments pending ;
+	Blocks *regions ;
+	std::vector<struct _splitSite> *allSplitSites ;
+
+	// Split the first cnt blocks with the sites up to end on chrId, and add them with their coverage to the regions.
+	void Flush( int cnt, int chrId, int64_t end )
+	{
+		int from = siteTag ;
+		int ssize = sites.size() ;
+		while ( siteTag < ssize && ( sites[siteTag].chrId < chrId || 
+			( sites[siteTag].chrId == chrId && sites[siteTag].pos <= end ) ) )
+			++siteTag ;
+		if ( reachTag < siteTag )
+			reachTag = siteTag ;
+		std::vector<struct _splitSite> clusterSites( sites.begin() + from, sites.begin() + siteTag ) ;
+
+		building.TakeExonBlocks( cnt, cluster.exonBlocks ) ;
+		cluster.FinishExonBlocks() ;
+		cluster.FilterSplitSitesInRegions( clusterSites ) ;
+		cluster.FilterGeneMergeSplitSites( clusterSites ) ;
+		allSplitSites->insert( allSplitSites->end(), clusterSites.begin(), clusterSites.end() ) ;
+		if ( cnt == 0 )
+			return ;
+
+		KeepUniqSplitSites( clusterSites ) ;
+		cluster.SplitBlocks( pending, clusterSites ) ;
+		pending.Rewind() ;
+		cluster.ComputeDepth( pending ) ;
+		pending.Release( chrId, end ) ;
+
+		regions->exonBlocks.insert( regions->exonBlocks.end(), cluster.exonBlocks.begin(), cluster.exonBlocks.end() ) ;
+		cluster.exonBlocks.clear() ;
+	}
+public:
+	RegionBuilder()
+	{
+		regions = NULL ;
+		allSplitSites = NULL ;
+	}
+
+	// splitSites is taken over by the builder. allSplitSites gets the filtered sites before they are made unique.
+	void Init( std::vector<struct _splitSite> &splitSites, Blocks &r, std::vector<struct _splitSite> &all )
+	{
+		sites.swap( splitSites ) ;
+		FilterAndSortSplitSites( sites ) ; 
+		FilterNearSplitSites( sites ) ;
+		FilterRepeatSplitSites( sites ) ;
+		siteTag = reachTag = 0 ;
+		reachChrId = -1 ;
+		reach = -1 ;
+		finalCnt = 0 ;
+		regions = &r ;
+		allSplitSites = &all ;
+		allSplitSites->clear() ;
+	}
+
+	template <class T>
+	void Add( T &alignments )
+	{
+		std::vector<struct _block> &open = building.exonBlocks ;
+		int chrId = alignments.GetChromId() ;
+		int64_t start = alignments.segments[0].a ;
+		int size = open.size() ;
+		int ssize = sites.size() ;
+		int cutCnt = 0 ;
+		int64_t cutEnd = -1 ;
+
+		for ( ; finalCnt < size && ( open[finalCnt].chrId != chrId || open[finalCnt].end < start - 1 ) ; ++finalCnt )
+		{
+			struct _block &b = open[finalCnt] ;
+			if ( finalCnt > 0 && open[finalCnt - 1].chrId != b.chrId )
+			{
+				// The previous chromosome is complete.
+				cutCnt = finalCnt ;
+				cutEnd = INT64_MAX ;
+			}
+			if ( b.chrId != reachChrId )
+			{
+				reachChrId = b.chrId ;
+				reach = -1 ;
+			}
+			for ( ; reachTag < ssize && ( sites[reachTag].chrId < b.chrId || 
+				( sites[reachTag].chrId == b.chrId && sites[reachTag].pos <= b.end ) ) ; ++reachTag )
+			{
+				if ( sites[reachTag].chrId != b.chrId )
+					continue ;
+				if ( sites[reachTag].pos > reach )
+					reach = sites[reachTag].pos ;
+				if ( sites[reachTag].oppositePos > reach )
+					reach = sites[reachTag].oppositePos ;
+			}
+			if ( reach <= b.end )
+			{
+				cutCnt = finalCnt + 1 ;
+				cutEnd = b.end ;
+			}
+		}
+		if ( finalCnt > 0 && open[finalCnt - 1].chrId != chrId )
+		{
+			cutCnt = finalCnt ;
+			cutEnd = INT64_MAX ;
+		}
+
+		if ( cutCnt > 0 )
+		{
+			Flush( cutCnt, open[cutCnt - 1].chrId, cutEnd ) ;
+			finalCnt -= cutCnt ;
+		}
+		building.AddExonBlocks( alignments ) ;
+		pending.Add( alignments ) ;
+	}
+
+	// Flush the remaining blocks and sites.
+	void Finish()
+	{
+		Flush( building.exonBlocks.size(), INT_MAX, INT64_MAX ) ;
+		finalCnt = 0 ;
+	}
+} ;
+
+// Build the subexon blocks and their coverage from the alignments.
+template <class T>
+void BuildRegions( T &alignments, Blocks &regions, std::vector<struct _splitSite> &splitSites, 
+	std::vector<struct _splitSite> &allSplitSites )
+{
+	RegionBuilder builder ;
+	builder.Init( splitSites, regions, allSplitSites ) ;
+	while ( alignments.Next() )
+		builder.Add( alignments ) ;
+	builder.Finish() ;
+	FinishRegions( alignments, regions, allSplitSites ) ;
+}
+
+// Classify the subexons and write them to fp. path is the alignment file, and the chromosome names come from alignments.
+void OutputRegions( Blocks &regions, Alignments &alignments, const char *path, bool noStats, FILE *fp )
+{
+	int i, j ;
 	if ( noStats ) 
 	{ 
 		// just output the subexons.
-		if ( realpath( argv[1], buffer ) == NULL )
+		if ( realpath( path, buffer ) == NULL )
 		{
-			strcpy( buffer, argv[1] ) ;
+			strcpy( buffer, path ) ;
 		}
-		printf( "#%s\n", buffer ) ;
-		printf( "#fitted_ir_parameter_ratio: pi: -1 k0: -1 theta0: -1 k1: -1 theta1: -1\n" ) ;
-		printf( "#fitted_ir_parameter_cov: pi: -1 k0: -1 theta0: -1 k1: -1 theta1: -1\n" ) ;
+		fprintf( fp, "#%s\n", buffer ) ;
+		fprintf( fp, "#fitted_ir_parameter_ratio: pi: -1 k0: -1 theta0: -1 k1: -1 theta1: -1\n" ) ;
+		fprintf( fp, "#fitted_ir_parameter_cov: pi: -1 k0: -1 theta0: -1 k1: -1 theta1: -1\n" ) ;
 		
 		int blockCnt = regions.exonBlocks.size() ;
 		for ( int i = 0 ; i < blockCnt ; ++i )
 		{
 			struct _block &e = regions.exonBlocks[i] ;
 			double avgDepth = (double)e.depthSum / ( e.end - e.start + 1 ) ;
-			printf( "%s %" PRId64 " %" PRId64 " %d %d %lf -1 -1 -1 -1 ", alignments.GetChromName( e.chrId ), e.start + 1, e.end + 1, e.leftType, e.rightType, avgDepth ) ;
+			fprintf( fp, "%s %" PRId64 " %" PRId64 " %d %d %lf -1 -1 -1 -1 ", alignments.GetChromName( e.chrId ), e.start + 1, e.end + 1, e.leftType, e.rightType, avgDepth ) ;
 			int prevCnt = e.prevCnt ;
 			if ( i > 0 && e.start == regions.exonBlocks[i - 1].end + 1 &&
 					e.leftType == regions.exonBlocks[i - 1].rightType )
 			{
-				printf( "%d ", prevCnt + 1 ) ;
+				fprintf( fp, "%d ", prevCnt + 1 ) ;
 				for ( j = 0 ; j < prevCnt ; ++j )
-					printf( "%" PRId64 " ", regions.exonBlocks[ e.prev[j] ].end + 1 ) ;
-				printf( "%" PRId64 " ", regions.exonBlocks[i - 1].end + 1 ) ;
+					fprintf( fp, "%" PRId64 " ", regions.exonBlocks[ e.prev[j] ].end + 1 ) ;
+				fprintf( fp, "%" PRId64 " ", regions.exonBlocks[i - 1].end + 1 ) ;
 			}
 			else
 			{
-				printf( "%d ", prevCnt ) ;
+				fprintf( fp, "%d ", prevCnt ) ;
 				for ( j = 0 ; j < prevCnt ; ++j )
-					printf( "%" PRId64 " ", regions.exonBlocks[ e.prev[j] ].end + 1 ) ;
+					fprintf( fp, "%" PRId64 " ", regions.exonBlocks[ e.prev[j] ].end + 1 ) ;
 			}
 
 			int nextCnt = e.nextCnt ;
 			if ( i < blockCnt - 1 && e.end == regions.exonBlocks[i + 1].start - 1 &&
 					e.rightType == regions.exonBlocks[i + 1].leftType )
 			{
-				printf( "%d %" PRId64 " ", nextCnt + 1, regions.exonBlocks[i + 1].start + 1 ) ;
+				fprintf( fp, "%d %" PRId64 " ", nextCnt + 1, regions.exonBlocks[i + 1].start + 1 ) ;
 			}
 			else
-				printf( "%d ", nextCnt ) ;
+				fprintf( fp, "%d ", nextCnt ) ;
 			for ( j = 0 ; j < nextCnt ; ++j )
-				printf( "%" PRId64 " ", regions.exonBlocks[ e.next[j] ].start + 1 ) ;
-			printf( "\n" ) ;
+				fprintf( fp, "%" PRId64 " ", regions.exonBlocks[ e.next[j] ].start + 1 ) ;
+			fprintf( fp, "\n" ) ;
 
 		}
-		return 0 ;
+		return ;
 	}
 
 	// Extract the blocks for different events.
@@ -1158,53 +1359,53 @@ int main( int argc, char *argv[] )
 
 	
 	// Output the result.
-	if ( realpath( argv[1], buffer ) == NULL )
+	if ( realpath( path, buffer ) == NULL )
 	{
-		strcpy( buffer, argv[1] ) ;
+		strcpy( buffer, path ) ;
 	}
-	printf( "#%s\n", buffer ) ;
+	fprintf( fp, "#%s\n", buffer ) ;
 	// TODO: higher precision.
-	printf( "#fitted_ir_parameter_ratio: pi: %lf k0: %lf theta0: %lf k1: %lf theta1: %lf\n", piRatio, kRatio[0], thetaRatio[0], kRatio[1], thetaRatio[1] ) ;
-	printf( "#fitted_ir_parameter_cov: pi: %lf k0: %lf theta0: %lf k1: %lf theta1: %lf\n", piCov, kCov[0], thetaCov[0], kCov[1], thetaCov[1] ) ;
+	fprintf( fp, "#fitted_ir_parameter_ratio: pi: %lf k0: %lf theta0: %lf k1: %lf theta1: %lf\n", piRatio, kRatio[0], thetaRatio[0], kRatio[1], thetaRatio[1] ) ;
+	fprintf( fp, "#fitted_ir_parameter_cov: pi: %lf k0: %lf theta0: %lf k1: %lf theta1: %lf\n", piCov, kCov[0], thetaCov[0], kCov[1], thetaCov[1] ) ;
 	
-	printf( "#fitted_overhang_parameter_ratio: pi: %lf k0: %lf theta0: %lf k1: %lf theta1: %lf\n", overhangPiRatio, overhangKRatio[0], overhangThetaRatio[0], overhangKRatio[1], overhangThetaRatio[1] ) ;
-	printf( "#fitted_overhang_parameter_cov: pi: %lf k0: %lf theta0: %lf k1: %lf theta1: %lf\n", overhangPiCov, overhangKCov[0], overhangThetaCov[0], overhangKCov[1], overhangThetaCov[1] ) ;
+	fprintf( fp, "#fitted_overhang_parameter_ratio: pi: %lf k0: %lf theta0: %lf k1: %lf theta1: %lf\n", overhangPiRatio, overhangKRatio[0], overhangThetaRatio[0], overhangKRatio[1], overhangThetaRatio[1] ) ;
+	fprintf( fp, "#fitted_overhang_parameter_cov: pi: %lf k0: %lf theta0: %lf k1: %lf theta1: %lf\n", overhangPiCov, overhangKCov[0], overhangThetaCov[0], overhangKCov[1], overhangThetaCov[1] ) ;
 
 
 	for ( int i = 0 ; i < blockCnt ; ++i )
 	{
 		struct _block &e = regions.exonBlocks[i] ;
 		double avgDepth = regions.GetAvgDepth( e ) ;
-		printf( "%s %" PRId64 " %" PRId64 " %d %d %c %c %lf %lf %lf %lf %lf ", alignments.GetChromName( e.chrId ), e.start + 1, e.end + 1, e.leftType, e.rightType, 
+		fprintf( fp, "%s %" PRId64 " %" PRId64 " %d %d %c %c %lf %lf %lf %lf %lf ", alignments.GetChromName( e.chrId ), e.start + 1, e.end + 1, e.leftType, e.rightType, 
 			e.leftStrand, e.rightStrand, avgDepth, 
 			e.leftRatio, e.rightRatio, leftClassifier[i], rightClassifier[i] ) ;
 		int prevCnt = e.prevCnt ;
 		if ( i > 0 && e.start == regions.exonBlocks[i - 1].end + 1 )
 			//&& e.leftType == regions.exonBlocks[i - 1].rightType )
 		{
-			printf( "%d ", prevCnt + 1 ) ;
+			fprintf( fp, "%d ", prevCnt + 1 ) ;
 			for ( j = 0 ; j < prevCnt ; ++j )
-				printf( "%" PRId64 " ", regions.exonBlocks[ e.prev[j] ].end + 1 ) ;
-			printf( "%" PRId64 " ", regions.exonBlocks[i - 1].end + 1 ) ;
+				fprintf( fp, "%" PRId64 " ", regions.exonBlocks[ e.prev[j] ].end + 1 ) ;
+			fprintf( fp, "%" PRId64 " ", regions.exonBlocks[i - 1].end + 1 ) ;
 		}
 		else
 		{
-			printf( "%d ", prevCnt ) ;
+			fprintf( fp, "%d ", prevCnt ) ;
 			for ( j = 0 ; j < prevCnt ; ++j )
-				printf( "%" PRId64 " ", regions.exonBlocks[ e.prev[j] ].end + 1 ) ;
+				fprintf( fp, "%" PRId64 " ", regions.exonBlocks[ e.prev[j] ].end + 1 ) ;
 		}
 
 		int nextCnt = e.nextCnt ;
 		if ( i < blockCnt - 1 && e.end == regions.exonBlocks[i + 1].start - 1 ) 
 			//&& e.rightType == regions.exonBlocks[i + 1].leftType )
 		{
-			printf( "%d %" PRId64 " ", nextCnt + 1, regions.exonBlocks[i + 1].start + 1 ) ;
+			fprintf( fp, "%d %" PRId64 " ", nextCnt + 1, regions.exonBlocks[i + 1].start + 1 ) ;
 		}
 		else
-			printf( "%d ", nextCnt ) ;
+			fprintf( fp, "%d ", nextCnt ) ;
 		for ( j = 0 ; j < nextCnt ; ++j )
-			printf( "%" PRId64 " ", regions.exonBlocks[ e.next[j] ].start + 1 ) ;
-		printf( "\n" ) ;
+			fprintf( fp, "%" PRId64 " ", regions.exonBlocks[ e.next[j] ].start + 1 ) ;
+		fprintf( fp, "\n" ) ;
 	}
 
 	delete[] cov ;
@@ -1212,3 +1413,186 @@ int main( int argc, char *argv[] )
 	delete[] leftClassifier ;
 	delete[] rightClassifier ;
 }
+
+int main( int argc, char *argv[] )
+{
+	int i, k ;
+	bool noStats = false ;
+	int readThreads = 0 ;
+	bool useAlignmentCache = false ;
+	bool useLibraryStats = false ;
+	bool statsLoaded = false ;
+	bool indexSampling = false ;
+	char *readGroupPrefix = NULL ;
+	if ( argc < 3 )
+	{
+		fprintf( stderr, usage ) ;
+		exit( 1 ) ;
+	}
+
+	gMinDepth = 2 ;
+
+	for ( i = 3 ; i < argc ; ++i )
+	{
+		if ( !strcmp( argv[i], "--noStats" ) )
+		{
+			noStats = true ;
+			continue ;
+		}
+		else if ( !strcmp( argv[i], "--minDepth" ) )
+		{
+			gMinDepth = atoi( argv[i + 1] ) ;
+			++i ;
+			continue ;
+		}
+		else if ( !strcmp( argv[i], "--readThreads" ) )
+		{
+			readThreads = atoi( argv[i + 1] ) ;
+			++i ;
+			continue ;
+		}
+		else if ( !strcmp( argv[i], "--alignmentCache" ) )
+		{
+			useAlignmentCache = true ;
+			continue ;
+		}
+		else if ( !strcmp( argv[i], "--libraryStats" ) )
+		{
+			useLibraryStats = true ;
+			continue ;
+		}
+		else if ( !strcmp( argv[i], "--indexSampling" ) )
+		{
+			indexSampling = true ;
+			continue ;
+		}
+		else if ( !strcmp( argv[i], "--readGroups" ) )
+		{
+			readGroupPrefix = argv[i + 1] ;
+			++i ;
+			continue ;
+		}
+		else
+		{
+			fprintf( stderr, "Unknown argument: %s\n", argv[i] ) ;
+			return 0 ;
+		}
+	}
+
+	if ( readGroupPrefix != NULL )
+	{
+		// One sample per read group of a merged file. The pass over the file routes the records 
+		// to the blocks of their samples, so the file is read once for all the samples.
+		Alignments merged ;
+		char outFile[1100] ;
+		merged.SetReadThreads( readThreads ) ;
+		merged.UseReadGroups() ;
+		merged.Open( argv[1] ) ;
+		if ( merged.IsStream() )
+		{
+			fprintf( stderr, "--readGroups needs a file that can be read more than once.\n" ) ;
+			exit( 1 ) ;
+		}
+		merged.GetGeneralInfo( true ) ;
+		merged.Rewind() ;
+
+		int rgCnt = merged.GetReadGroupCount() ;
+		Alignments *samples = new Alignments[ rgCnt ] ;
+		Blocks *sampleRegions = new Blocks[ rgCnt ] ;
+		std::vector< std::vector<struct _splitSite> > sampleSplitSites( rgCnt ) ;
+		std::vector< std::vector<struct _splitSite> > sampleAllSplitSites( rgCnt ) ;
+
+		// argv[2] lists the splice file of each read group, in the order of the header.
+		FILE *fpList = fopen( argv[2], "r" ) ;
+		if ( fpList == NULL )
+		{
+			fprintf( stderr, "Can not open %s.\n", argv[2] ) ;
+			exit( 1 ) ;
+		}
+		for ( k = 0 ; k < rgCnt ; ++k )
+		{
+			if ( fscanf( fpList, "%s", buffer ) != 1 )
+			{
+				fprintf( stderr, "%s lists fewer splice files than the %d read groups.\n", argv[2], rgCnt ) ;
+				exit( 1 ) ;
+			}
+			ReadSplitSites( buffer, merged, sampleSplitSites[k] ) ;
+			samples[k].OpenReadGroup( merged, k ) ;
+		}
+		fclose( fpList ) ;
+
+		RegionBuilder *builders = new RegionBuilder[ rgCnt ] ;
+		for ( k = 0 ; k < rgCnt ; ++k )
+			builders[k].Init( sampleSplitSites[k], sampleRegions[k], sampleAllSplitSites[k] ) ;
+		while ( merged.Next() )
+		{
+			k = merged.GetReadGroupIdx() ;
+			if ( k >= 0 )
+				builders[k].Add( merged ) ;
+		}
+		for ( k = 0 ; k < rgCnt ; ++k )
+		{
+			builders[k].Finish() ;
+			FinishRegions( samples[k], sampleRegions[k], sampleAllSplitSites[k] ) ;
+
+			sprintf( outFile, "%s_%d.out", readGroupPrefix, k ) ;
+			FILE *fpOut = fopen( outFile, "w" ) ;
+			if ( fpOut == NULL )
+			{
+				fprintf( stderr, "Can not write %s.\n", outFile ) ;
+				exit( 1 ) ;
+			}
+			OutputRegions( sampleRegions[k], merged, argv[1], noStats, fpOut ) ;
+			fclose( fpOut ) ;
+		}
+		delete[] builders ;
+		delete[] samples ;
+		delete[] sampleRegions ;
+		return 0 ;
+	}
+
+	Alignments alignments ;
+	alignments.SetReadThreads( readThreads ) ;
+	if ( useAlignmentCache )
+		alignments.UseCache( true ) ;
+	alignments.Open( argv[1] ) ;
+	std::vector<struct _splitSite> splitSites ; // only compromised the 
+	std::vector<struct _splitSite> allSplitSites ;
+
+	// read in the splice site
+	ReadSplitSites( argv[2], alignments, splitSites ) ;
+	//printf( "ss:%d\n", splitSites.size() ) ;
+	
+	//printf( "ss:%d\n", splitSites.size() ) ;
+	
+	// Build the blocks
+	Blocks regions ;
+	MemoryAlignments spooled ;
+	if ( alignments.IsStream() )
+	{
+		// The standard input can be read only once, so the later passes go over a copy in memory.
+		spooled.Load( alignments ) ;
+		spooled.GetGeneralInfo( true ) ;
+		BuildRegions( spooled, regions, splitSites, allSplitSites ) ;
+	}
+	else
+	{
+		if ( useLibraryStats )
+			statsLoaded = alignments.LoadGeneralInfo() ;
+		if ( !statsLoaded )
+		{
+			if ( indexSampling )
+				alignments.SampleGeneralInfo() ;
+			else
+				alignments.GetGeneralInfo( true ) ;
+			alignments.Rewind() ;
+		}
+		BuildRegions( alignments, regions, splitSites, allSplitSites ) ;
+		if ( useLibraryStats && !statsLoaded )
+			alignments.SaveGeneralInfo() ;
+	}
+	
+	//printf( "Finish building regions.\n" ) ;	
+	OutputRegions( regions, alignments, argv[1], noStats, stdout ) ;
+	return 0 ;
+}
@@ -9,15 +9,86 @@
 #include <assert.h>
 #include <iostream>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 #include <math.h>
+#include <inttypes.h>
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <time.h>
 
 #include "defs.h"
+#include "AlignmentCache.hpp"
+#include "ReadGroups.hpp"
+#include "SeqComposition.hpp"
+
+// The library statistics of one read group in a merged file.
+struct _readGroupInfo
+{
+	int readLen ;
+	int fragLen, fragStdev ;
+	bool matePaired ;
+	int totalReadCnt ; // primary reads seen by the last full pass of Next()
+} ;
+
+// Counters of the work saved by the record decode path.
+struct _alignmentsDecodeStats
+{
+	int64_t recordCnt ; // records pulled from the file
+	int64_t allocSaved ; // bam_init1/bam_destroy1 pairs avoided by reusing the record buffer
+	int64_t auxScanCnt ; // linear walks over the aux block
+	int64_t auxScanSaved ; // tag lookups answered from the cached aux view
+} ;
+
+// The aux fields the accessors need, parsed once per record.
+struct _auxView
+{
+	bool hasNH, hasXS, hasNM, hasCP ;
+	int NH ;
+	char XS ;
+	int NM ;
+	int64_t CP ;
+	char *CC ;
+	char *XZ ;
+	char *SA ;
+} ;
+
+class AlignmentsCursorPool ;
+class AlignmentsPrefetch ;
 
 class Alignments
 {
+	friend class AlignmentsPrefetch ;
 private:
 	samfile_t *fpSam ;	
 	bam1_t *b ;
+	bam_index_t *index ; // loaded on the first Seek
+	bam_iter_t iter ; // not NULL when reading is restricted to a region
+	struct _auxView aux ;
+	struct _alignmentsDecodeStats decodeStats ;
+	struct _cachedAlignment cur ; // the current record, from the BAM file or the cache
+	int32_t segOffsets[ 2 * MAX_SEG_COUNT ] ;
+	bool decoded ;
+
+	AlignmentCache cache ;
+	bool useCache ; // read from <file>.dac if it is up to date
+	bool writeCache ; // otherwise create it during the first full pass of Next()
+	bool freshOpen ; // no record has been read since Open()
+	int64_t pendingSkippedPrimary ; // primary records not written to the cache yet
+	int64_t skippedPrimary ; // primary records the cache skipped before the current one
+	bool cacheRegion ; // a region restriction served by the cache
+	bool cacheRegionDone ;
+	int regionTid ;
+	int64_t regionStart, regionEnd ;
+	char readIdBuffer[32] ;
+	std::vector<std::string> chrNames ;
+	std::vector<int> chrLengths ;
+
+	AlignmentsCursorPool *cursorPool ;
+	AlignmentsPrefetch *prefetch ; // Next() takes the records decoded ahead by a background thread
+	bool suspended ; // the file is closed, and reopened at suspendedOffset by Resume()
+	int64_t suspendedOffset ;
 
 	char fileName[1024] ;
 	bool opened ;	
@@ -30,31 +101,407 @@ private:
 
 	bool atBegin ;
 	bool atEnd ;
+	int readThreads ; // threads inflating the BAM blocks ahead of the reader. 0-off
+
+	bool useReadGroups ; // a merged file whose records are routed to the samples by the RG tag
+	ReadGroups readGroups ;
+	int curReadGroup ; // the read group of the current record, -1 if it has none
+	std::vector<struct _readGroupInfo> readGroupInfo ;
+	bool isReadGroupView ; // holds the statistics of one read group of another Alignments, and reads nothing
 
 	static int CompInt( const void *p1, const void *p2 )
 	{
 		return (*(int *)p1 ) - (*(int *)p2 ) ;
 	}
 
+	void GetCacheFileName( char *buffer )
+	{
+		sprintf( buffer, "%s.dac", fileName ) ;
+	}
+
 	void Open()
 	{
-		fpSam = samopen( fileName, "rb", 0 ) ;
-		if ( !fpSam->header )
+		int i ;
+		char cacheFile[1100] ;
+		opened = true ;
+		atBegin = true ;
+		atEnd = false ;
+		freshOpen = true ;
+		cacheRegion = false ;
+		skippedPrimary = 0 ;
+
+		if ( IsStream() || useReadGroups )
+			writeCache = false ; // the sidecar is keyed on the file, and does not keep the RG tag
+		GetCacheFileName( cacheFile ) ;
+		if ( useCache && !IsStream() && !useReadGroups && cache.OpenRead( cacheFile, fileName ) )
+		{
+			fpSam = NULL ;
+			chrNames = cache.chrNames ;
+			chrLengths = cache.chrLengths ;
+			for ( i = 0 ; i < (int)chrNames.size() ; ++i )
+				chrNameToId[ chrNames[i] ] = i ;
+			return ;
+		}
+
+		// SAM text is read from "-" (the standard input) or from a file that is not BGZF compressed.
+		if ( !IsStream() && bgzf_is_bgzf( fileName ) )
+			fpSam = samopen( fileName, "rb", 0 ) ;
+		else
+			fpSam = samopen( fileName, "r", 0 ) ;
+		if ( fpSam == NULL || !fpSam->header )
 		{
 			fprintf( stderr, "Can not open %s.\n", fileName ) ;
 			exit( 1 ) ;
 		}
 
 		// Collect the chromosome information
-		for ( int i = 0 ; i < fpSam->header->n_targets ; ++i )		
+		chrNames.resize( fpSam->header->n_targets ) ;
+		chrLengths.resize( fpSam->header->n_targets ) ;
+		for ( i = 0 ; i < fpSam->header->n_targets ; ++i )		
 		{
 			std::string s( fpSam->header->target_name[i] ) ;
 			chrNameToId[s] = i ;
+			chrNames[i] = s ;
+			chrLengths[i] = fpSam->header->target_len[i] ;
 		}
-		opened = true ;
-		atBegin = true ;
-		atEnd = false ;
+		if ( useReadGroups )
+		{
+			if ( readGroups.Parse( fpSam->header->text ) == 0 )
+			{
+				fprintf( stderr, "No read group (@RG) in the header of %s.\n", fileName ) ;
+				exit( 1 ) ;
+			}
+			readGroupInfo.resize( readGroups.GetCount() ) ;
+		}
+		if ( readThreads > 0 && ( fpSam->type & 1 ) )
+			bgzf_mt_read( fpSam->x.bam, readThreads, 8 ) ;
+	}
+
+	bool IsFromCache() ;
+
+	// Stands for a cached string field whose content is not kept.
+	static char *EmptyField()
+	{
+		static char empty[1] = "" ;
+		return empty ;
+	}
+
+	// FNV-1a
+	static uint64_t HashReadId( const char *s, int len )
+	{
+		uint64_t h = 14695981039346656037ULL ;
+		for ( int i = 0 ; i < len ; ++i )
+		{
+			h ^= (uint8_t)s[i] ;
+			h *= 1099511628211ULL ;
+		}
+		return h ;
+	}
+
+	int CountGC()
+	{
+		int counts[5] = { 0, 0, 0, 0, 0 } ;
+		CountPackedBases( bam1_seq( b ), 0, b->core.l_qseq, counts ) ;
+		return counts[1] + counts[2] ;
+	}
+
+	// Keep the decoded record in the cache. The mate suffix of the read id is kept apart from the hash,
+	// so flipping the suffix still finds the mate.
+	void WriteCachedRecord()
+	{
+		char *qname = bam1_qname( b ) ;
+		int len = b->core.l_qname - 1 ;
+
+		DecodeRecord() ;
+		cur.skippedPrimary = pendingSkippedPrimary ;
+		pendingSkippedPrimary = 0 ;
+		cur.gcCnt = CountGC() ;
+		cur.nameSuffix[0] = cur.nameSuffix[1] = 0 ;
+		if ( len >= 2 && ( qname[len - 2] == '.' || qname[len - 2] == '/' ) 
+			&& ( qname[len - 1] == '1' || qname[len - 1] == '2' ) )
+		{
+			cur.nameSuffix[0] = qname[len - 2] ;
+			cur.nameSuffix[1] = qname[len - 1] ;
+			len -= 2 ;
+		}
+		cur.nameHash = HashReadId( qname, len ) ;
+		cache.Write( cur, segOffsets ) ;
+	}
+
+	int ReadCachedRecord()
+	{
+		while ( 1 )
+		{
+			if ( cacheRegionDone || !cache.Read( cur, segOffsets ) )
+			{
+				skippedPrimary = cacheRegion ? 0 : cache.GetTailSkippedPrimary() ;
+				return 0 ;
+			}
+			++decodeStats.recordCnt ;
+			if ( cacheRegion )
+			{
+				int64_t end = cur.pos ;
+				if ( cur.segCnt > 0 )
+					end += segOffsets[ 2 * cur.segCnt - 1 ] ;
+				if ( cur.tid != regionTid || cur.pos > regionEnd )
+				{
+					cacheRegionDone = true ;
+					continue ;
+				}
+				if ( end < regionStart )
+					continue ;
+				skippedPrimary = 0 ;
+			}
+			else
+				skippedPrimary = cur.skippedPrimary ;
+			decoded = false ;
+			return 1 ;
+		}
+	}
+
+	// Read the next record into the reused buffer. bam_read1 grows b->data only when needed.
+	int ReadRecord()
+	{
+		if ( suspended )
+			Resume( NULL, 0, 0 ) ;
+		if ( IsFromCache() )
+			return ReadCachedRecord() ;
+
+		bool reused = ( b != NULL ) ;
+		if ( b == NULL )
+			b = bam_init1() ;
+		freshOpen = false ;
+		
+		int ret ;
+		if ( iter != NULL )
+			ret = bam_iter_read( fpSam->x.bam, iter, b ) ;
+		else 
+			ret = samread( fpSam, b ) ;
+		if ( ret <= 0 )
+		{
+			if ( cache.IsWriting() )
+				cache.EndWrite( pendingSkippedPrimary ) ;
+			return 0 ;
+		}
+		++decodeStats.recordCnt ;
+		if ( reused )
+			++decodeStats.allocSaved ;
+
+		cur.tid = b->core.tid ;
+		cur.pos = b->core.pos ;
+		cur.mtid = b->core.mtid ;
+		cur.mpos = b->core.mpos ;
+		cur.flag = b->core.flag ;
+		cur.readLen = b->core.l_qseq ;
+		decoded = false ;
+		if ( useReadGroups )
+		{
+			uint8_t *rg = bam_aux_get( b, "RG" ) ;
+			++decodeStats.auxScanCnt ;
+			curReadGroup = ( rg == NULL ) ? -1 : readGroups.GetIdx( bam_aux2Z( rg ) ) ;
+		}
+		if ( cache.IsWriting() )
+		{
+			if ( cur.flag & 0xC )
+			{
+				if ( ( cur.flag & 0x900 ) == 0 )
+					++pendingSkippedPrimary ;
+			}
+			else
+				WriteCachedRecord() ;
+		}
+		return 1 ;
+	}
+
+	static uint8_t *SkipAuxField( uint8_t *s )
+	{
+		int type = toupper( *s ) ;
+		++s ;
+		if ( type == 'Z' || type == 'H' )
+		{
+			while ( *s )
+				++s ;
+			++s ;
+		}
+		else if ( type == 'B' )
+			s += 5 + bam_aux_type2size( *s ) * ( *(int32_t *)( s + 1 ) ) ;
+		else if ( type == 'D' )
+			s += 8 ;
+		else
+			s += bam_aux_type2size( type ) ;
+		return s ;
+	}
+
+	// Walk the aux block once and keep the fields the accessors look at.
+	void ParseAuxFields()
+	{
+		uint8_t *s = bam1_aux( b ) ;
+		uint8_t *end = b->data + b->data_len ;
+		
+		aux.hasNH = aux.hasXS = aux.hasNM = aux.hasCP = false ;
+		aux.NH = 1 ;
+		aux.XS = 0 ;
+		aux.NM = -1 ;
+		aux.CP = -1 ;
+		aux.CC = aux.XZ = aux.SA = NULL ;
+
+		++decodeStats.auxScanCnt ;
+		while ( s < end )
+		{
+			uint8_t *val = s + 2 ;
+			switch ( s[0] << 8 | s[1] )
+			{
+				case 'N' << 8 | 'H': aux.hasNH = true ; aux.NH = bam_aux2i( val ) ; break ;
+				case 'X' << 8 | 'S': aux.hasXS = true ; aux.XS = bam_aux2A( val ) ; break ;
+				case 'N' << 8 | 'M': aux.hasNM = true ; aux.NM = bam_aux2i( val ) ; break ;
+				case 'C' << 8 | 'P': aux.hasCP = true ; aux.CP = bam_aux2i( val ) ; break ;
+				case 'C' << 8 | 'C': aux.CC = bam_aux2Z( val ) ; break ;
+				case 'X' << 8 | 'Z': aux.XZ = bam_aux2Z( val ) ; break ;
+				case 'S' << 8 | 'A': aux.SA = bam_aux2Z( val ) ; break ;
+				default: break ;
+			}
+			s = SkipAuxField( val ) ;
+		}
+	}
+	// Compute the segments, the clip information and the aux view of the current record.
+	void DecodeRecord()
+	{
+		int i ;
+		if ( decoded )
+			return ;
+		decoded = true ;
+
+		if ( IsFromCache() )
+		{
+			segCnt = cur.segCnt ;
+			segmentsSum = 0 ;
+			for ( i = 0 ; i < segCnt ; ++i )
+			{
+				segments[i].a = cur.pos + segOffsets[2 * i] ;
+				segments[i].b = cur.pos + segOffsets[2 * i + 1] ;
+				segmentsSum += segments[i].b - segments[i].a + 1 ;
+			}
+			hasClipHead = ( cur.info & CACHE_CLIP_HEAD ) != 0 ;
+			hasClipTail = ( cur.info & CACHE_CLIP_TAIL ) != 0 ;
+
+			aux.hasNH = ( cur.info & CACHE_HAS_NH ) != 0 ;
+			aux.NH = aux.hasNH ? cur.NH : 1 ;
+			aux.hasXS = ( cur.info & CACHE_HAS_XS ) != 0 ;
+			aux.XS = cur.XS ;
+			aux.hasNM = ( cur.NM != -1 ) ;
+			aux.NM = cur.NM ;
+			// Only the presence of SA and XZ is kept. The repeat fields CC/CP are not cached.
+			aux.SA = ( cur.info & CACHE_HAS_SA ) ? EmptyField() : NULL ;
+			aux.XZ = ( cur.info & CACHE_HAS_XZ ) ? EmptyField() : NULL ;
+			aux.hasCP = false ;
+			aux.CP = -1 ;
+			aux.CC = NULL ;
+			return ;
+		}
+
+		ParseAuxFields() ;
+		cur.info = 0 ;
+		if ( aux.hasNH )
+		{
+			cur.info |= CACHE_HAS_NH ;
+			cur.NH = aux.NH > 65535 ? 65535 : aux.NH ;
+		}
+		else
+			cur.NH = 1 ;
+		if ( aux.hasXS )
+			cur.info |= CACHE_HAS_XS ;
+		cur.XS = aux.XS ;
+		cur.NM = aux.hasNM ? aux.NM : -1 ;
+		if ( aux.SA != NULL )
+			cur.info |= CACHE_HAS_SA ;
+		if ( aux.XZ != NULL )
+			cur.info |= CACHE_HAS_XZ ;
+
+		// Compute the exons segments from the reads
+		int64_t start = b->core.pos ; //+ 1 ;
+		int len = 0 ;
+		uint32_t *rawCigar = bam1_cigar( b ) ; 
+		// Check whether the query length is compatible with the read
+		if ( bam_cigar2qlen( &b->core, rawCigar ) != b->core.l_qseq ) 
+			cur.info |= CACHE_QLEN_MISMATCH ;
+
+		int clipSum = 0 ;
+		segCnt = 0 ;
+		hasClipHead = hasClipTail = false ;
+		segmentsSum = 0 ;
+		for ( i = 0 ; i < b->core.n_cigar ; ++i )
+		{
+			int op = rawCigar[i] & BAM_CIGAR_MASK ;
+			int num = rawCigar[i] >> BAM_CIGAR_SHIFT ;
+
+			switch ( op )
+			{
+				case BAM_CMATCH:
+				case BAM_CDEL:
+					len += num ; break ;
+				case BAM_CSOFT_CLIP:
+				case BAM_CHARD_CLIP:
+				case BAM_CPAD:
+				{
+					if ( i == 0 )
+						hasClipHead = true ;
+					else if ( i == b->core.n_cigar - 1 )
+						hasClipTail = true ;
+					else 
+						cur.info |= CACHE_CLIP_MIDDLE ;
+				
+					clipSum += num ;
+				}
+				case BAM_CINS:
+					num = 0 ; break ;
+				case BAM_CREF_SKIP:
+					{
+						if ( segCnt < MAX_SEG_COUNT )
+						{
+							segments[ segCnt ].a = start ;
+							segments[ segCnt ].b = start + len - 1 ;
+							++segCnt ;
+						}
+						segmentsSum += len ;
+						start = start + len + num ;
+						len = 0 ;
+					} break ;
+				default:
+					len += num ; break ;
+			}
+		}
+		if ( len > 0 && segCnt < MAX_SEG_COUNT )
+		{
+			segments[ segCnt ].a = start ;
+			segments[ segCnt ].b = start + len - 1 ;
+			++segCnt ;
+			segmentsSum += len ;
+		}
+		if ( hasClipHead )
+			cur.info |= CACHE_CLIP_HEAD ;
+		if ( hasClipTail )
+			cur.info |= CACHE_CLIP_TAIL ;
+		cur.clipSum = clipSum ;
+		cur.segCnt = segCnt ;
+		for ( i = 0 ; i < segCnt ; ++i )
+		{
+			segOffsets[2 * i] = segments[i].a - cur.pos ;
+			segOffsets[2 * i + 1] = segments[i].b - cur.pos ;
+		}
+	}
+
+	void StartCacheWrite()
+	{
+		char cacheFile[1100] ;
+		GetCacheFileName( cacheFile ) ;
+		pendingSkippedPrimary = 0 ;
+		cache.BeginWrite( cacheFile, fileName, chrNames, chrLengths ) ;
+	}
+	void ComputeGeneralInfo( int *lens, int lensCnt, int *mateDiff, int mateDiffCnt )
+	{
+		EstimateLengths( lens, lensCnt, mateDiff, mateDiffCnt, readLen, fragLen, fragStdev, matePaired ) ;
 	}
+
 public:
 	struct _pair segments[MAX_SEG_COUNT] ;		
 	int segCnt ;
@@ -64,9 +511,48 @@ public:
 	int readLen ;
 	bool matePaired ;
 	
+		// Get the read length info and fragment length info from the sampled read lengths and mate distances.
+	// Shared by the other alignment sources.
+	static void EstimateLengths( int *lens, int lensCnt, int *mateDiff, int mateDiffCnt, 
+		int &readLen, int &fragLen, int &fragStdev, bool &matePaired )
+	{
+		int i, k ;
+		qsort( lens, lensCnt, sizeof( int ), CompInt ) ;
+		if (lensCnt > 0)
+			readLen = lens[ lensCnt - 1 ] ;
+		else
+			readLen = 150 ;
+		
+		if ( mateDiffCnt > 0 )
+		{
+			matePaired = true ;
+
+			qsort( mateDiff, mateDiffCnt, sizeof( int ), CompInt ) ;
+			long long int sum = 0 ;
+			long long int sumsq = 0 ;
+			
+			for ( i = 0 ; i < mateDiffCnt * 0.7 ; ++i )
+			{
+				sum += ( mateDiff[i] + readLen );
+				sumsq += ( mateDiff[i] + readLen ) * ( mateDiff[i] + readLen ) ;
+			}
+			k = i ;
+			fragLen = (int)( sum / k ) ;
+			fragStdev = (int)sqrt( sumsq / k - fragLen * fragLen ) ;
+		}
+		else
+		{
+			fragLen = readLen ;
+			fragStdev = 0 ;
+		}
+		//printf( "readLen = %d\nfragLen = %d, fragStdev = %d\n", readLen, fragLen, fragStdev ) ;		
+	}
+
 	Alignments() 
 	{ 
 		b = NULL ; 
+		index = NULL ;
+		iter = NULL ;
 		opened = false ; 
 		atBegin = true ;
 		atEnd = false ;
@@ -80,6 +566,24 @@ public:
 		matePaired = false ;
 
 		strandedLib = 0 ;
+		readThreads = 0 ;
+		useReadGroups = false ;
+		curReadGroup = -1 ;
+		isReadGroupView = false ;
+		memset( &decodeStats, 0, sizeof( decodeStats ) ) ;
+		memset( &cur, 0, sizeof( cur ) ) ;
+		decoded = false ;
+		fpSam = NULL ;
+
+		useCache = writeCache = false ;
+		freshOpen = false ;
+		pendingSkippedPrimary = skippedPrimary = 0 ;
+		cacheRegion = cacheRegionDone = false ;
+
+		cursorPool = NULL ;
+		prefetch = NULL ;
+		suspended = false ;
+		suspendedOffset = 0 ;
 	}
 	
 	~Alignments() 
@@ -96,6 +600,19 @@ public:
 
 	void Rewind()
 	{
+		if ( prefetch )
+		{
+			RewindPrefetch() ;
+			return ;
+		}
+		if ( IsStream() )
+		{
+			// Nothing is read yet, so there is nothing to rewind.
+			if ( atBegin && freshOpen )
+				return ;
+			fprintf( stderr, "Can not rewind the alignments from the standard input.\n" ) ;
+			exit( 1 ) ;
+		}
 		Close() ;
 		Open() ;
 
@@ -105,8 +622,201 @@ public:
 
 	void Close()
 	{
+		if ( prefetch )
+			DisablePrefetch() ;
+		if ( iter )
+			bam_iter_destroy( iter ) ;
+		if ( index )
+			bam_index_destroy( index ) ;
+		iter = NULL ;
+		index = NULL ;
+		cache.Close() ;
+		if ( fpSam )
+			samclose( fpSam ) ;
+		fpSam = NULL ;
+		suspended = false ;
+	}
+
+	// Close the file but keep the read position and the current record, so Resume() continues where 
+	// the reading stopped. If blockData is not NULL, the BGZF block at the position is copied there 
+	// (blockLength is 0 if there is none). Return false if the file can not be suspended.
+	bool Suspend( void *blockData, int &blockLength, int64_t &blockNext )
+	{
+		int64_t blockAddress ;
+		blockLength = 0 ;
+		if ( !opened || suspended )
+			return false ;
+		if ( IsFromCache() )
+		{
+			cache.Suspend() ;
+			suspended = true ;
+			return true ;
+		}
+		if ( fpSam == NULL || !( fpSam->type & 1 ) || cache.IsWriting() )
+			return false ;
+		suspendedOffset = bgzf_tell( fpSam->x.bam ) ;
+		if ( blockData != NULL )
+			blockLength = bgzf_save_block( fpSam->x.bam, blockData, &blockAddress, &blockNext ) ;
 		samclose( fpSam ) ;
 		fpSam = NULL ;
+		suspended = true ;
+		return true ;
+	}
+
+	// Reopen a suspended file. blockData is the block saved by Suspend(), or NULL to read it from the file again.
+	void Resume( const void *blockData, int blockLength, int64_t blockNext )
+	{
+		int ret ;
+		if ( !suspended )
+			return ;
+		suspended = false ;
+		if ( IsFromCache() )
+		{
+			cache.Resume() ;
+			return ;
+		}
+		fpSam = samopen( fileName, "rb", 0 ) ;
+		if ( fpSam == NULL || !fpSam->header )
+		{
+			fprintf( stderr, "Can not open %s.\n", fileName ) ;
+			exit( 1 ) ;
+		}
+		if ( readThreads > 0 )
+			bgzf_mt_read( fpSam->x.bam, readThreads, 8 ) ;
+		if ( blockData != NULL && blockLength > 0 )
+			ret = bgzf_seek_block( fpSam->x.bam, suspendedOffset, blockData, blockLength, blockNext ) ;
+		else
+			ret = bgzf_seek( fpSam->x.bam, suspendedOffset, SEEK_SET ) ;
+		if ( ret < 0 )
+		{
+			fprintf( stderr, "Failed to seek in %s.\n", fileName ) ;
+			exit( 1 ) ;
+		}
+	}
+
+	bool IsSuspended()
+	{
+		return suspended ;
+	}
+
+	int64_t GetSuspendedOffset()
+	{
+		return suspendedOffset ;
+	}
+
+	// Share a bound on the open files with the other alignment files in the pool. 
+	// Call Acquire() before reading and Release() after; both do nothing without a pool.
+	void SetCursorPool( AlignmentsCursorPool *pool )
+	{
+		cursorPool = pool ;
+	}
+	void Acquire() ;
+	void Release() ;
+
+	// Decode the records on a background thread into a ring of capacity records; Next() takes them from 
+	// the ring. The producer stops when the ring is full and restarts when it drains to a quarter.
+	// The reading should be at the beginning of the file or a region. Not for files in a cursor pool.
+	void EnablePrefetch( int capacity ) ;
+	void DisablePrefetch() ;
+	// Seconds Next() waited for the producer (I/O or inflation bound), and the producer waited 
+	// for Next() (bound by the work on the records).
+	void GetPrefetchStats( double &consumerWait, double &producerWait ) ;
+	int NextPrefetch() ;
+	void RewindPrefetch() ;
+	void SeekPrefetch( int tid, int64_t start, int64_t end ) ;
+
+	// Read the decoded records from the sidecar <file>.dac when it is up to date. With canWrite, 
+	// the first pass of Next() over the whole BAM file creates the sidecar, and the passes after the 
+	// next Rewind() read it. Takes effect at once if nothing has been read since Open().
+	void UseCache( bool canWrite )
+	{
+		useCache = true ;
+		writeCache = canWrite ;
+		if ( opened && freshOpen && fpSam != NULL && iter == NULL && !suspended )
+		{
+			Close() ;
+			Open() ;
+		}
+	}
+
+	// Restrict the reading to the alignments overlapping [start, end] (0-based, inclusive) on chromosome tid, 
+	// using the .bai index. Next() returns 0 once the region is exhausted. Seek again to move to another region,
+	// or Rewind() to go back to reading the whole file.
+	void Seek( int tid, int64_t start, int64_t end )
+	{
+		atBegin = true ;
+		atEnd = false ;
+		if ( prefetch )
+		{
+			SeekPrefetch( tid, start, end ) ;
+			return ;
+		}
+		if ( IsFromCache() )
+		{
+			cache.Seek( tid, start ) ;
+			cacheRegion = true ;
+			cacheRegionDone = false ;
+			regionTid = tid ;
+			regionStart = start ;
+			regionEnd = end ;
+			return ;
+		}
+		cache.Close() ; // the sidecar is only written by a pass over the whole file
+		
+		if ( !( fpSam->type & 1 ) )
+		{
+			fprintf( stderr, "Region query needs a BAM file: %s.\n", fileName ) ;
+			exit( 1 ) ;
+		}
+		if ( index == NULL )
+		{
+			index = bam_index_load( fileName ) ;
+			if ( index == NULL )
+			{
+				fprintf( stderr, "Can not load the index of %s.\n", fileName ) ;
+				exit( 1 ) ;
+			}
+		}
+		if ( iter )
+			bam_iter_destroy( iter ) ;
+		iter = bam_iter_query( index, tid, start, end + 1 ) ;
+	}
+
+	// Region in the samtools format, e.g. chr1:1000-2000 (1-based).
+	void Seek( const char *region )
+	{
+		int tid, start, end ;
+		if ( IsFromCache() )
+		{
+			// chr, chr:beg or chr:beg-end
+			char name[1024] ;
+			const char *p = strrchr( region, ':' ) ;
+			int len = p ? p - region : strlen( region ) ;
+			strncpy( name, region, len ) ;
+			name[len] = '\0' ;
+			start = 0 ;
+			end = 1 << 29 ;
+			if ( p && sscanf( p + 1, "%d-%d", &start, &end ) >= 1 )
+				--start ;
+			if ( chrNameToId.find( name ) == chrNameToId.end() || start < 0 || end <= start )
+			{
+				fprintf( stderr, "Unknown region: %s\n", region ) ;
+				exit( 1 ) ;
+			}
+			Seek( chrNameToId[name], start, end - 1 ) ;
+			return ;
+		}
+		if ( bam_parse_region( fpSam->header, region, &tid, &start, &end ) < 0 || tid < 0 )
+		{
+			fprintf( stderr, "Unknown region: %s\n", region ) ;
+			exit( 1 ) ;
+		}
+		Seek( tid, start, end - 1 ) ;
+	}
+
+	bool IsRegionRestricted()
+	{
+		return iter != NULL || cacheRegion ;
 	}
 
 	bool IsOpened()
@@ -114,6 +824,59 @@ public:
 		return opened ;
 	}
 
+	// Reading SAM text from the standard input, which can not be rewound or sought.
+	bool IsStream()
+	{
+		return !strcmp( fileName, "-" ) ;
+	}
+
+	// Route the records of a merged file by their RG tag. Call before Open(). 
+	// The alignment cache is not used in this mode.
+	void UseReadGroups()
+	{
+		useReadGroups = true ;
+	}
+
+	int GetReadGroupCount()
+	{
+		return readGroups.GetCount() ;
+	}
+
+	const char *GetReadGroupName( int k )
+	{
+		return readGroups.GetId( k ) ;
+	}
+
+	// The index of the current record's read group in the header, -1 if it has none or an unknown one.
+	int GetReadGroupIdx()
+	{
+		return curReadGroup ;
+	}
+
+	// The primary reads of read group k in the last full pass of Next().
+	int GetReadGroupReadCount( int k )
+	{
+		return readGroupInfo[k].totalReadCnt ;
+	}
+
+	// Make this object stand for read group k of the merged file: the chromosomes and the library 
+	// statistics of the sample, for the consumers that only look at those. The records themselves 
+	// are read from the merged file.
+	void OpenReadGroup( Alignments &merged, int k )
+	{
+		chrNames = merged.chrNames ;
+		chrLengths = merged.chrLengths ;
+		chrNameToId = merged.chrNameToId ;
+		snprintf( fileName, sizeof( fileName ), "%s:%s", merged.fileName, merged.GetReadGroupName( k ) ) ;
+		opened = true ;
+		isReadGroupView = true ;
+		readLen = merged.readGroupInfo[k].readLen ;
+		fragLen = merged.readGroupInfo[k].fragLen ;
+		fragStdev = merged.readGroupInfo[k].fragStdev ;
+		matePaired = merged.readGroupInfo[k].matePaired ;
+		totalReadCnt = merged.readGroupInfo[k].totalReadCnt ;
+	}
+
 	bool IsAtBegin()
 	{
 		return atBegin ;
@@ -138,6 +901,15 @@ public:
 		return hasClipTail ;
 	}
 
+	// Inflate the BAM blocks ahead of the reader on numThreads worker threads. 
+	// Kept across Rewind(); takes effect immediately if the file is already open.
+	void SetReadThreads( int numThreads )
+	{
+		readThreads = numThreads ;
+		if ( opened && fpSam != NULL && readThreads > 0 && ( fpSam->type & 1 ) )
+			bgzf_mt_read( fpSam->x.bam, readThreads, 8 ) ;
+	}
+
 	void SetStrandedLib(int libtype)
 	{
 		strandedLib = libtype ;
@@ -146,120 +918,69 @@ public:
 	int Next()
 	{
 		int i ;
-		int start = 0, len = 0 ;
-		uint32_t *rawCigar ;
+		if ( prefetch )
+			return NextPrefetch() ;
 
 		if ( atBegin == true )
+		{
+			if ( isReadGroupView )
+			{
+				fprintf( stderr, "The alignments of read group %s are read through the merged file.\n", fileName ) ;
+				exit( 1 ) ;
+			}
 			totalReadCnt = 0 ;
+			for ( i = 0 ; i < (int)readGroupInfo.size() ; ++i )
+				readGroupInfo[i].totalReadCnt = 0 ;
+			if ( freshOpen && writeCache && iter == NULL && !cache.IsOpened() )
+				StartCacheWrite() ;
+		}
 
 		atBegin = false ;
 		while ( 1 )
 		{
 			while ( 1 )
 			{
-				if ( b )
-					bam_destroy1( b ) ;
-				b = bam_init1() ;
-
-				if ( samread( fpSam, b ) <= 0 )
+				int ret = ReadRecord() ;
+				totalReadCnt += skippedPrimary ;
+				skippedPrimary = 0 ;
+				if ( !ret )
 				{
 					atEnd = true ;
 					return 0 ;
 				}
 
-				if ( ( b->core.flag & 0x900 ) == 0 )
+				if ( ( cur.flag & 0x900 ) == 0 )
+				{
 					++totalReadCnt ;
+					if ( curReadGroup >= 0 )
+						++readGroupInfo[ curReadGroup ].totalReadCnt ;
+				}
 				
-				if ( b->core.flag & 0xC )
+				if ( cur.flag & 0xC )
 					continue ;
 
-				//if ( ( b->core.flag & 0x900 ) == 0 )
+				//if ( ( cur.flag & 0x900 ) == 0 )
 					break ;
 			}
 			
+			DecodeRecord() ;
 			// to many repeat.
-			if ( bam_aux_get( b, "NH" ) )
-			{
-				if ( bam_aux2i( bam_aux_get( b, "NH" ) ) >= 5 )
-					continue ;
-			}
-
-			// Compute the exons segments from the reads
-			segCnt = 0 ;
-			start = b->core.pos ; //+ 1 ;
-			rawCigar = bam1_cigar( b ) ; 
-			// Check whether the query length is compatible with the read
-			if ( bam_cigar2qlen( &b->core, rawCigar ) != b->core.l_qseq ) 
+			if ( aux.hasNH && aux.NH >= 5 )
 				continue ;
 
-			bool clipMiddle = false ;
-			int clipSum = 0 ;
-			hasClipHead = hasClipTail = false ;
-			len = 0 ;
-			segmentsSum = 0 ;
-			for ( i = 0 ; i < b->core.n_cigar ; ++i )
-			{
-				int op = rawCigar[i] & BAM_CIGAR_MASK ;
-				int num = rawCigar[i] >> BAM_CIGAR_SHIFT ;
-
-				switch ( op )
-				{
-					case BAM_CMATCH:
-					case BAM_CDEL:
-						len += num ; break ;
-					case BAM_CSOFT_CLIP:
-					case BAM_CHARD_CLIP:
-					case BAM_CPAD:
-					{
-						if ( i == 0 )
-							hasClipHead = true ;
-						else if ( i == b->core.n_cigar - 1 )
-							hasClipTail = true ;
-						else 
-							clipMiddle = true ;
-					
-						clipSum += num ;
-					}
-					case BAM_CINS:
-						num = 0 ; break ;
-					case BAM_CREF_SKIP:
-						{
-							segments[ segCnt ].a = start ;
-							segments[ segCnt ].b = start + len - 1 ;
-							++segCnt ;
-							segmentsSum += len ;
-							start = start + len + num ;
-							len = 0 ;
-						} break ;
-					default:
-						len += num ; break ;
-				}
-			}
-			if ( clipMiddle ) // should never happend
+			if ( cur.info & CACHE_QLEN_MISMATCH )
+				continue ;
+			if ( cur.info & CACHE_CLIP_MIDDLE ) // should never happend
 				continue ;
 
-			if ( clipSum >= 2 && !allowClip )
+			if ( cur.clipSum >= 2 && !allowClip )
 				continue ;
 
-			if ( len > 0 )
-			{
-				segments[ segCnt ].a = start ;
-				segments[ segCnt ].b = start + len - 1 ;
-				++segCnt ;
-				segmentsSum += len ;
-			}
-			/*if ( !strcmp( bam1_qname( b ), "chr1:109656301-109749401W:ENST00000490758.2:381:1480:1090:1290:X" ) )
-			{
-				for ( i = 0 ; i < segCnt ; ++i )
-					printf( "(%d %d) ", segments[i].a, segments[i].b ) ;
-				printf( "\n" ) ;
-			}*/
-			
 			// Check whether the mates are compatible
-			//int mChrId = b->core.mtid ;
-			int64_t mPos = b->core.mpos ;
+			//int mChrId = cur.mtid ;
+			int64_t mPos = cur.mpos ;
 
-			if ( b->core.mtid == b->core.tid )
+			if ( cur.mtid == cur.tid )
 			{
 				for ( i = 0 ; i < segCnt - 1 ; ++i )
 				{
@@ -279,12 +1000,12 @@ public:
 
 	int GetChromId()
 	{
-		return b->core.tid ; 
+		return cur.tid ; 
 	}
 
 	char* GetChromName( int tid )
 	{
-		return fpSam->header->target_name[ tid ] ; 
+		return (char *)chrNames[ tid ].c_str() ; 
 	}
 
 	int GetChromIdFromName( const char *s )
@@ -300,41 +1021,42 @@ public:
 
 	int GetChromLength( int tid )
 	{
-		return fpSam->header->target_len[ tid ] ;
+		return chrLengths[ tid ] ;
 	}
 
 	int GetChromCount()
 	{
-		return fpSam->header->n_targets ;
+		return chrNames.size() ;
 	}
 
 	void GetMatePosition( int &chrId, int64_t &pos )
 	{
-		if ( b->core.flag & 0x8 )
+		if ( cur.flag & 0x8 )
 		{
 			chrId = -1 ;
 			pos = -1 ;
 		}
 		else
 		{
-			chrId = b->core.mtid ;
-			pos = b->core.mpos ; //+ 1 ;
+			chrId = cur.mtid ;
+			pos = cur.mpos ; //+ 1 ;
 		}
 	}
 
 	int GetRepeatPosition( int &chrId, int64_t &pos )
 	{
 		// Look at the CC field.
-		if ( !bam_aux_get( b, "CC" ) || !bam_aux_get( b, "CP" ) )
+		decodeStats.auxScanSaved += 2 ;
+		if ( aux.CC == NULL || !aux.hasCP )
 		{
 			chrId = -1 ;
 			pos = -1 ;
 			return 0 ;
 		}
 		
-		std::string s( bam_aux2Z( bam_aux_get(b, "CC" ) ) ) ;
+		std::string s( aux.CC ) ;
 		chrId = chrNameToId[ s ] ;
-		pos = bam_aux2i( bam_aux_get( b, "CP" ) ) ;// Possible error for 64bit	
+		pos = aux.CP ;// Possible error for 64bit	
 		return 1 ;
 	}
 
@@ -345,7 +1067,7 @@ public:
 
 	int GetReadLength()
 	{
-		return b->core.l_qseq ;
+		return cur.readLen ;
 	}
 
 	int GetRefCoverLength()
@@ -355,45 +1077,49 @@ public:
 
 	bool IsFirstMate()
 	{
-		if ( b->core.flag & 0x40 )
+		if ( cur.flag & 0x40 )
 			return true ;
 		return false ;
 	}
 
 	bool IsReverse()
 	{
-		if ( b->core.flag & 0x10 )	
+		if ( cur.flag & 0x10 )	
 			return true ;
 		return false ;
 	}
 
 	bool IsMateReverse()
 	{
-		if ( b->core.flag & 0x20 )
+		if ( cur.flag & 0x20 )
 			return true ;
 		return false ;
 	}
 
+	// From the cache, the id is the hash of the read name followed by its mate suffix.
 	char *GetReadId()
 	{
+		if ( IsFromCache() )
+		{
+			sprintf( readIdBuffer, "%016llx%.2s", (unsigned long long)cur.nameHash, cur.nameSuffix ) ;
+			return readIdBuffer ;
+		}
 		return bam1_qname( b ) ;
 	}
 
 	bool IsUnique()
 	{
-		if ( bam_aux_get( b, "NH" ) )
-		{
-			if ( bam_aux2i( bam_aux_get( b, "NH" ) ) > 1 )
-				return false ;
-		}	
-		if ( IsSupplementary() && GetFieldZ( (char *)"XZ" ) != NULL )
+		++decodeStats.auxScanSaved ;
+		if ( aux.hasNH && aux.NH > 1 )
+			return false ;
+		if ( IsSupplementary() && GetFieldZ( "XZ" ) != NULL )
 			return false ;
 		return true ;
 	}
 
 	bool IsPrimary()
 	{
-		if ( ( b->core.flag & 0x900 ) == 0 )
+		if ( ( cur.flag & 0x900 ) == 0 )
 			return true ;
 		else
 			return false ;
@@ -404,16 +1130,17 @@ public:
 	{
 		if ( segCnt == 1 && strandedLib == 0)
 			return 0 ;
-		if ( bam_aux_get( b, "XS" ) )
+		++decodeStats.auxScanSaved ;
+		if ( aux.hasXS )
 		{
-			if ( bam_aux2A( bam_aux_get( b, "XS" ) ) == '-' )
+			if ( aux.XS == '-' )
 				return -1 ;	
 			else
 				return 1 ;
 		}
 		else if (strandedLib != 0)
 		{
-			int flag = b->core.flag ;
+			int flag = cur.flag ;
 			if ((flag & 0x80) == 0) // first read or single-end case
 			{
 				return  (((flag >> 4) & 1) ^ (strandedLib & 1)) ? -1 : 1 ;
@@ -427,36 +1154,69 @@ public:
 			return 0 ;
 	}
 
-	int GetFieldI( char *f )
+	// The fields in the aux view are served without rescanning the record.
+	int GetFieldI( const char *f )
 	{
-		if ( bam_aux_get( b, f ) )
+		if ( !strcmp( f, "NM" ) )
+		{
+			++decodeStats.auxScanSaved ;
+			return aux.NM ;
+		}
+		else if ( !strcmp( f, "NH" ) )
 		{
-			return bam_aux2i( bam_aux_get( b, f ) ) ;
+			++decodeStats.auxScanSaved ;
+			return aux.hasNH ? aux.NH : -1 ;
 		}
+
+		if ( IsFromCache() )
+			return -1 ;
+		++decodeStats.auxScanCnt ;
+		uint8_t *s = bam_aux_get( b, f ) ;
+		if ( s )
+			return bam_aux2i( s ) ;
 		return -1 ;
 	}
 
-	char *GetFieldZ( char *f )
+	char *GetFieldZ( const char *f )
 	{
-		if ( bam_aux_get( b, f ) )
+		if ( !strcmp( f, "XZ" ) )
+		{
+			++decodeStats.auxScanSaved ;
+			return aux.XZ ;
+		}
+		else if ( !strcmp( f, "SA" ) )
 		{
-			return bam_aux2Z( bam_aux_get( b, f ) ) ;
+			++decodeStats.auxScanSaved ;
+			return aux.SA ;
 		}
+		else if ( !strcmp( f, "CC" ) )
+		{
+			++decodeStats.auxScanSaved ;
+			return aux.CC ;
+		}
+		
+		if ( IsFromCache() )
+			return NULL ;
+		++decodeStats.auxScanCnt ;
+		uint8_t *s = bam_aux_get( b, f ) ;
+		if ( s )
+			return bam_aux2Z( s ) ;
 		return NULL ;
 	}
 	
 	int GetNumberOfHits()
 	{
-		if ( bam_aux_get( b, "NH" ) )
-		{
-			return bam_aux2i( bam_aux_get( b, "NH" ) ) ;
-		}	
+		++decodeStats.auxScanSaved ;
+		if ( aux.hasNH )
+			return aux.NH ;
 		return 1 ;
 	}
+
+	void GetDecodeStats( struct _alignmentsDecodeStats &stats ) ;
 	
 	bool IsSupplementary()
 	{
-		if ( ( b->core.flag & 0x800 ) == 0 )
+		if ( ( cur.flag & 0x800 ) == 0 )
 			return false ;
 		else
 			return true ;
@@ -474,47 +1234,105 @@ public:
 
 	bool IsGCRich( bool threshold = 0.9 )
 	{
-		int i = 0 ;
-		int gcCnt = 0 ;
-		for ( i = 0 ; i < b->core.l_qseq ; ++i )
-		{
-			int bit = bam1_seqi( bam1_seq( b ), i ) ;
-			if ( bit == 2 || bit == 4 )
-				++gcCnt ;		
-		}
-		if ( gcCnt >= threshold * b->core.l_qseq )
+		int gcCnt = IsFromCache() ? cur.gcCnt : CountGC() ;
+		if ( gcCnt >= threshold * cur.readLen )
 			return true ;
         return false;
 	}
 
-	void GetGeneralInfo( bool stopEarly = false )
+	// The library statistics from GetGeneralInfo, and the primary read count of a full pass, are kept in 
+	// <file>.stats so the later stages do not scan the file again. Return false if it is missing or stale.
+	bool LoadGeneralInfo()
 	{
-		int i, k ;
+		char statsFile[1100] ;
+		char key[64] ;
+		int64_t value ;
+		int64_t size, mtime ;
+		int64_t bamSize = -1, bamMtime = -1 ;
+		int found = 0 ;
+
+		sprintf( statsFile, "%s.stats", fileName ) ;
+		FILE *fp = fopen( statsFile, "r" ) ;
+		if ( fp == NULL )
+			return false ;
+		while ( fscanf( fp, "%63s %" SCNd64, key, &value ) == 2 )
+		{
+			if ( !strcmp( key, "bamSize" ) )
+				bamSize = value ;
+			else if ( !strcmp( key, "bamMtime" ) )
+				bamMtime = value ;
+			else if ( !strcmp( key, "readLen" ) )
+				readLen = value ;
+			else if ( !strcmp( key, "fragLen" ) )
+				fragLen = value ;
+			else if ( !strcmp( key, "fragStdev" ) )
+				fragStdev = value ;
+			else if ( !strcmp( key, "matePaired" ) )
+				matePaired = ( value != 0 ) ;
+			else if ( !strcmp( key, "totalReadCnt" ) )
+				totalReadCnt = value ;
+			else
+				continue ;
+			++found ;
+		}
+		fclose( fp ) ;
+		if ( found < 7 || !AlignmentCache::GetFileStat( fileName, size, mtime ) 
+			|| size != bamSize || mtime != bamMtime )
+			return false ;
+		return true ;
+	}
+
+	// Call after a full pass of Next(), so totalReadCnt counts every primary read.
+	void SaveGeneralInfo()
+	{
+		char statsFile[1100] ;
+		char tmpFile[1200] ;
+		int64_t size, mtime ;
+
+		if ( !AlignmentCache::GetFileStat( fileName, size, mtime ) )
+			return ;
+		sprintf( statsFile, "%s.stats", fileName ) ;
+		snprintf( tmpFile, sizeof( tmpFile ), "%s.tmp.%d", statsFile, (int)getpid() ) ;
+		FILE *fp = fopen( tmpFile, "w" ) ;
+		if ( fp == NULL )
+		{
+			fprintf( stderr, "Can not write the library statistics %s, continue without it.\n", tmpFile ) ;
+			return ;
+		}
+		fprintf( fp, "bamSize %" PRId64 "\nbamMtime %" PRId64 "\n", size, mtime ) ;
+		fprintf( fp, "readLen %d\nfragLen %d\nfragStdev %d\nmatePaired %d\ntotalReadCnt %d\n", 
+			readLen, fragLen, fragStdev, matePaired ? 1 : 0, totalReadCnt ) ;
+		if ( fclose( fp ) != 0 || rename( tmpFile, statsFile ) != 0 )
+			unlink( tmpFile ) ;
+	}
 
+	void GetGeneralInfo( bool stopEarly = false )
+	{
 		const int sampleMax = 1000000 ;
 		int *lens = new int[sampleMax] ;
 		int *mateDiff = new int[sampleMax] ;
 		int lensCnt = 0 ;
 		int mateDiffCnt = 0 ;
 		bool end = false ;
+		int rgCnt = readGroupInfo.size() ;
+		std::vector< std::vector<int> > rgLens( rgCnt ) ;
+		std::vector< std::vector<int> > rgMateDiff( rgCnt ) ;
+		int rgFullCnt = 0 ; // the read groups with sampleMax reads already
+		int i ;
 		
 		while ( 1 )
 		{
 			while ( 1 )
 			{
-				if ( b )
-					bam_destroy1( b ) ;
-				b = bam_init1() ;
-
-				if ( samread( fpSam, b ) <= 0 )
+				if ( !ReadRecord() )
 				{
 					end = true ;
 					break ;
 				}
-				if ( b->core.flag & 0xC )
+				if ( cur.flag & 0xC )
 					continue ;
 
-				if ( ( b->core.flag & 0x900 ) == 0 )
+				if ( ( cur.flag & 0x900 ) == 0 )
 					break ;
 			}
 			if ( end )
@@ -522,53 +1340,599 @@ public:
 			
 			if ( lensCnt < sampleMax )
 			{
-				lens[ lensCnt ] = b->core.l_qseq ; 
+				lens[ lensCnt ] = cur.readLen ; 
 				++lensCnt ;
 			}
 
-			if ( mateDiffCnt < sampleMax && b->core.tid == b->core.mtid 
-				&& b->core.pos < b->core.mpos )
+			if ( mateDiffCnt < sampleMax && cur.tid == cur.mtid 
+				&& cur.pos < cur.mpos )
 			{
-				mateDiff[ mateDiffCnt ] = b->core.mpos - b->core.pos ;
+				mateDiff[ mateDiffCnt ] = cur.mpos - cur.pos ;
 				++mateDiffCnt ;
 			}
 			++totalReadCnt ; 
-			if ( totalReadCnt >= sampleMax && stopEarly )
+			if ( curReadGroup >= 0 )
+			{
+				// The same sampling as for a file of its own.
+				std::vector<int> &l = rgLens[ curReadGroup ] ;
+				std::vector<int> &d = rgMateDiff[ curReadGroup ] ;
+				if ( (int)l.size() < sampleMax )
+				{
+					l.push_back( cur.readLen ) ;
+					if ( cur.tid == cur.mtid && cur.pos < cur.mpos )
+						d.push_back( cur.mpos - cur.pos ) ;
+					if ( (int)l.size() == sampleMax )
+						++rgFullCnt ;
+				}
+			}
+			if ( stopEarly && ( rgCnt > 0 ? rgFullCnt == rgCnt : totalReadCnt >= sampleMax ) )
 				break ;
 		}
 
-		// Get the read length info and fragment length info
-		qsort( lens, lensCnt, sizeof( int ), CompInt ) ;
-		if (lensCnt > 0)
-			readLen = lens[ lensCnt - 1 ] ;
-		else
-			readLen = 150 ;
-		
-		if ( mateDiffCnt > 0 )
+		ComputeGeneralInfo( lens, lensCnt, mateDiff, mateDiffCnt ) ;
+		for ( i = 0 ; i < rgCnt ; ++i )
 		{
-			matePaired = true ;
+			struct _readGroupInfo &info = readGroupInfo[i] ;
+			rgLens[i].push_back( 0 ) ; // keep the pointers valid for an empty read group
+			rgMateDiff[i].push_back( 0 ) ;
+			EstimateLengths( &rgLens[i][0], rgLens[i].size() - 1, &rgMateDiff[i][0], rgMateDiff[i].size() - 1, 
+				info.readLen, info.fragLen, info.fragStdev, info.matePaired ) ;
+			info.totalReadCnt = rgLens[i].size() - 1 ;
+		}
+		delete[] lens ;
+		delete[] mateDiff ;
+	}
 
-			qsort( mateDiff, mateDiffCnt, sizeof( int ), CompInt ) ;
-			long long int sum = 0 ;
-			long long int sumsq = 0 ;
+	// Estimate the read length and fragment length from a few records at each of binCnt positions 
+	// spread evenly over the genome, found through the .bai index (or the alignment cache), 
+	// instead of the first records of the file. Fall back to GetGeneralInfo( true ) without an index
+	// or when the bins find too few reads.
+	// Call Rewind() afterwards to read the whole file again.
+	void SampleGeneralInfo( int binCnt = 256, int recordsPerBin = 16 )
+	{
+		int i, k ;
+		int chrCnt = GetChromCount() ;
+		int64_t genomeLen = 0 ;
+
+		if ( !IsFromCache() )
+		{
+			if ( fpSam == NULL || !( fpSam->type & 1 ) )
+			{
+				GetGeneralInfo( true ) ;
+				return ;
+			}
+			if ( index == NULL )
+				index = bam_index_load( fileName ) ;
+			if ( index == NULL )
+			{
+				GetGeneralInfo( true ) ;
+				return ;
+			}
+		}
+		for ( i = 0 ; i < chrCnt ; ++i )
+			genomeLen += GetChromLength( i ) ;
+		
+		int sampleMax = binCnt * recordsPerBin ;
+		int *lens = new int[sampleMax] ;
+		int *mateDiff = new int[sampleMax] ;
+		int lensCnt = 0 ;
+		int mateDiffCnt = 0 ;
+		int tid = 0 ;
+		int64_t chrOffset = 0 ; // genome coordinate of the start of chromosome tid
+		int64_t lastPos = -1 ; // the last sampled position on tid, so the bins do not sample a read twice
+
+		totalReadCnt = 0 ;
+		for ( k = 0 ; k < binCnt && genomeLen > 0 ; ++k )
+		{
+			int64_t p = (int64_t)( ( k + 0.5 ) * genomeLen / binCnt ) ;
+			while ( tid < chrCnt && p >= chrOffset + GetChromLength( tid ) )
+			{
+				chrOffset += GetChromLength( tid ) ;
+				++tid ;
+				lastPos = -1 ;
+			}
+			if ( tid >= chrCnt )
+				break ;
+			int64_t start = p - chrOffset ;
+			if ( start <= lastPos )
+				start = lastPos + 1 ;
+			if ( start >= GetChromLength( tid ) )
+				continue ;
 			
-			for ( i = 0 ; i < mateDiffCnt * 0.7 ; ++i )
+			Seek( tid, start, GetChromLength( tid ) - 1 ) ;
+			int cnt = 0 ;
+			while ( cnt < recordsPerBin && ReadRecord() )
 			{
-				sum += ( mateDiff[i] + readLen );
-				sumsq += ( mateDiff[i] + readLen ) * ( mateDiff[i] + readLen ) ;
+				if ( ( cur.flag & 0xC ) || ( cur.flag & 0x900 ) || cur.pos < start )
+					continue ;
+				lens[ lensCnt ] = cur.readLen ; 
+				++lensCnt ;
+				if ( cur.tid == cur.mtid && cur.pos < cur.mpos )
+				{
+					mateDiff[ mateDiffCnt ] = cur.mpos - cur.pos ;
+					++mateDiffCnt ;
+				}
+				lastPos = cur.pos ;
+				++totalReadCnt ;
+				++cnt ;
 			}
-			k = i ;
-			fragLen = (int)( sum / k ) ;
-			fragStdev = (int)sqrt( sumsq / k - fragLen * fragLen ) ;
 		}
-		else
+
+		if ( lensCnt < sampleMax / 4 )
 		{
-			fragLen = readLen ;
-			fragStdev = 0 ;
+			// The reads are concentrated in a few places, e.g. a targeted library. Scan from the beginning.
+			delete[] lens ;
+			delete[] mateDiff ;
+			Rewind() ;
+			GetGeneralInfo( true ) ;
+			return ;
 		}
-		//printf( "readLen = %d\nfragLen = %d, fragStdev = %d\n", readLen, fragLen, fragStdev ) ;		
+		ComputeGeneralInfo( lens, lensCnt, mateDiff, mateDiffCnt ) ;
 		delete[] lens ;
 		delete[] mateDiff ;
 	}
 } ;
+
+// Keep at most maxOpen of the alignment files open. When there are more, the files idle for the longest 
+// are suspended, and reopened at their saved position by their next Acquire(). The block each suspended
+// file was reading goes to an LRU block cache shared by all the files and capped at blockCacheSize bytes, 
+// so the reopened file does not read and inflate it again.
+class AlignmentsCursorPool
+{
+private:
+	struct _poolBlock
+	{
+		std::string file ;
+		int64_t address ;
+		int64_t next ;
+		int length ;
+		char *data ;
+	} ;
+	typedef std::pair<std::string, int64_t> _blockKey ;
+
+	int maxOpen ;
+	int openCnt ;
+	int64_t blockCacheCapacity ;
+	int64_t blockCacheSize ;
+	std::list<Alignments *> idle ; // open and not in use, the least recently used first
+	std::map<Alignments *, std::list<Alignments *>::iterator> idlePos ;
+	std::list<struct _poolBlock> blocks ; // the least recently used first
+	std::map<_blockKey, std::list<struct _poolBlock>::iterator> blockPos ;
+	char *blockBuffer ;
+	pthread_mutex_t lock ;
+
+	void RemoveBlock( std::list<struct _poolBlock>::iterator it )
+	{
+		blockPos.erase( _blockKey( it->file, it->address ) ) ;
+		blockCacheSize -= it->length ;
+		delete[] it->data ;
+		blocks.erase( it ) ;
+	}
+
+	void AddBlock( const char *file, int64_t address, int64_t next, int length )
+	{
+		struct _poolBlock nb ;
+		_blockKey key( file, address ) ;
+		if ( length <= 0 || length > blockCacheCapacity )
+			return ;
+		if ( blockPos.find( key ) != blockPos.end() )
+			RemoveBlock( blockPos[key] ) ;
+		while ( blockCacheSize + length > blockCacheCapacity )
+			RemoveBlock( blocks.begin() ) ;
+		
+		nb.file = file ;
+		nb.address = address ;
+		nb.next = next ;
+		nb.length = length ;
+		nb.data = new char[length] ;
+		memcpy( nb.data, blockBuffer, length ) ;
+		blocks.push_back( nb ) ;
+		blockPos[key] = --blocks.end() ;
+		blockCacheSize += length ;
+	}
+
+	// Called with the lock held.
+	void Evict()
+	{
+		while ( openCnt > maxOpen && !idle.empty() )
+		{
+			Alignments *a = idle.front() ;
+			int length ;
+			int64_t next ;
+			char file[1024] ;
+			
+			idle.pop_front() ;
+			idlePos.erase( a ) ;
+			if ( !a->Suspend( blockCacheCapacity > 0 ? blockBuffer : NULL, length, next ) )
+				continue ; // e.g. a SAM file, it stays open.
+			--openCnt ;
+			++suspendCnt ;
+			a->GetFileName( file ) ;
+			AddBlock( file, a->GetSuspendedOffset() >> 16, next, length ) ;
+		}
+	}
+public:
+	int64_t suspendCnt ;
+	int64_t resumeCnt ;
+	int64_t blockHitCnt ; // resumes that found their block in the cache
+
+	AlignmentsCursorPool( int maxOpenFiles, int64_t blockCacheBytes )
+	{
+		maxOpen = maxOpenFiles < 1 ? 1 : maxOpenFiles ;
+		openCnt = 0 ;
+		blockCacheCapacity = blockCacheBytes ;
+		blockCacheSize = 0 ;
+		blockBuffer = new char[ BGZF_MAX_BLOCK_SIZE ] ;
+		suspendCnt = resumeCnt = blockHitCnt = 0 ;
+		pthread_mutex_init( &lock, NULL ) ;
+	}
+
+	~AlignmentsCursorPool()
+	{
+		while ( !blocks.empty() )
+			RemoveBlock( blocks.begin() ) ;
+		delete[] blockBuffer ;
+		pthread_mutex_destroy( &lock ) ;
+	}
+
+	// a should be open and not in use. It is suspended at once if the pool is full.
+	void Add( Alignments *a )
+	{
+		pthread_mutex_lock( &lock ) ;
+		a->SetCursorPool( this ) ;
+		++openCnt ;
+		idle.push_back( a ) ;
+		idlePos[a] = --idle.end() ;
+		Evict() ;
+		pthread_mutex_unlock( &lock ) ;
+	}
+
+	void Acquire( Alignments *a )
+	{
+		char *data = NULL ;
+		int length = 0 ;
+		int64_t next = 0 ;
+		
+		pthread_mutex_lock( &lock ) ;
+		if ( idlePos.find( a ) != idlePos.end() )
+		{
+			idle.erase( idlePos[a] ) ;
+			idlePos.erase( a ) ;
+			pthread_mutex_unlock( &lock ) ;
+			return ;
+		}
+		if ( !a->IsSuspended() )
+		{
+			pthread_mutex_unlock( &lock ) ;
+			return ;
+		}
+		++openCnt ;
+		++resumeCnt ;
+		Evict() ;
+
+		char file[1024] ;
+		a->GetFileName( file ) ;
+		_blockKey key( file, a->GetSuspendedOffset() >> 16 ) ;
+		if ( blockPos.find( key ) != blockPos.end() )
+		{
+			// Copy the block, another thread may evict it while a is reopened.
+			std::list<struct _poolBlock>::iterator it = blockPos[key] ;
+			blocks.splice( blocks.end(), blocks, it ) ;
+			length = it->length ;
+			next = it->next ;
+			data = new char[length] ;
+			memcpy( data, it->data, length ) ;
+			++blockHitCnt ;
+		}
+		pthread_mutex_unlock( &lock ) ;
+
+		a->Resume( data, length, next ) ;
+		delete[] data ;
+	}
+
+	void Release( Alignments *a )
+	{
+		pthread_mutex_lock( &lock ) ;
+		if ( idlePos.find( a ) == idlePos.end() && !a->IsSuspended() )
+		{
+			idle.push_back( a ) ;
+			idlePos[a] = --idle.end() ;
+		}
+		Evict() ;
+		pthread_mutex_unlock( &lock ) ;
+	}
+} ;
+
+inline void Alignments::Acquire()
+{
+	if ( cursorPool != NULL )
+		cursorPool->Acquire( this ) ;
+}
+
+inline void Alignments::Release()
+{
+	if ( cursorPool != NULL )
+		cursorPool->Release( this ) ;
+}
+
+struct _prefetchSlot
+{
+	bam1_t *b ;
+	struct _cachedAlignment cur ;
+	struct _pair segments[MAX_SEG_COUNT] ;
+	int segCnt ;
+	int segmentsSum ;
+	bool hasClipHead, hasClipTail ;
+	struct _auxView aux ;
+	int totalReadCnt ;
+} ;
+
+class AlignmentsPrefetch
+{
+private:
+	Alignments *source ; // owns the file; only the producer reads it while running
+	struct _prefetchSlot *slots ;
+	int capacity ;
+	int lowWater ;
+	int head, count ;
+	bool eof ;
+	bool stop ;
+	bool running ;
+	int finalTotalReadCnt ;
+	pthread_t tid ;
+	pthread_mutex_t lock ;
+	pthread_cond_t notEmpty, notFull ;
+
+	static double Now()
+	{
+		struct timespec ts ;
+		clock_gettime( CLOCK_MONOTONIC, &ts ) ;
+		return ts.tv_sec + ts.tv_nsec * 1e-9 ;
+	}
+
+	static void *Producer_Thread( void *arg )
+	{
+		( (AlignmentsPrefetch *)arg )->Produce() ;
+		pthread_exit( NULL ) ;
+	}
+
+	void Produce()
+	{
+		Alignments &a = *source ;
+		while ( 1 )
+		{
+			pthread_mutex_lock( &lock ) ;
+			if ( count >= capacity && !stop )
+			{
+				double t = Now() ;
+				while ( count > lowWater && !stop ) 
+					pthread_cond_wait( &notFull, &lock ) ;
+				producerWait += Now() - t ;
+			}
+			if ( stop )
+			{
+				pthread_mutex_unlock( &lock ) ;
+				break ;
+			}
+			struct _prefetchSlot &slot = slots[ ( head + count ) % capacity ] ;
+			pthread_mutex_unlock( &lock ) ;
+			
+			// Only this thread touches the slots past head + count.
+			int ret = a.Next() ;
+			if ( ret )
+			{
+				bam1_t *tmp = slot.b ;
+				slot.b = a.b ;
+				a.b = tmp ;
+				slot.cur = a.cur ;
+				slot.segCnt = a.segCnt ;
+				memcpy( slot.segments, a.segments, sizeof( a.segments[0] ) * a.segCnt ) ;
+				slot.segmentsSum = a.segmentsSum ;
+				slot.hasClipHead = a.hasClipHead ;
+				slot.hasClipTail = a.hasClipTail ;
+				slot.aux = a.aux ;
+				slot.totalReadCnt = a.totalReadCnt ;
+			}
+
+			pthread_mutex_lock( &lock ) ;
+			if ( ret )
+				++count ;
+			else
+			{
+				eof = true ;
+				finalTotalReadCnt = a.totalReadCnt ;
+			}
+			pthread_cond_signal( &notEmpty ) ;
+			pthread_mutex_unlock( &lock ) ;
+			if ( !ret )
+				break ;
+		}
+	}
+public:
+	bool fromCache ;
+	double consumerWait, producerWait ;
+
+	AlignmentsPrefetch( Alignments *s, int cap )
+	{
+		source = s ;
+		capacity = cap < 2 ? 2 : cap ;
+		lowWater = capacity / 4 ;
+		slots = new struct _prefetchSlot[capacity] ;
+		for ( int i = 0 ; i < capacity ; ++i )
+			slots[i].b = NULL ;
+		head = count = 0 ;
+		eof = stop = running = false ;
+		fromCache = source->IsFromCache() ;
+		consumerWait = producerWait = 0 ;
+		pthread_mutex_init( &lock, NULL ) ;
+		pthread_cond_init( &notEmpty, NULL ) ;
+		pthread_cond_init( &notFull, NULL ) ;
+	}
+
+	~AlignmentsPrefetch()
+	{
+		Stop() ;
+		for ( int i = 0 ; i < capacity ; ++i )
+			if ( slots[i].b )
+				bam_destroy1( slots[i].b ) ;
+		delete[] slots ;
+		pthread_mutex_destroy( &lock ) ;
+		pthread_cond_destroy( &notEmpty ) ;
+		pthread_cond_destroy( &notFull ) ;
+	}
+
+	Alignments *GetSource()
+	{
+		return source ;
+	}
+
+	void Start()
+	{
+		head = count = 0 ;
+		eof = stop = false ;
+		pthread_create( &tid, NULL, Producer_Thread, this ) ;
+		running = true ;
+	}
+
+	void Stop()
+	{
+		if ( !running )
+			return ;
+		pthread_mutex_lock( &lock ) ;
+		stop = true ;
+		pthread_cond_signal( &notFull ) ;
+		pthread_mutex_unlock( &lock ) ;
+		pthread_join( tid, NULL ) ;
+		running = false ;
+	}
+
+	// Move the next record into a. Return 0 at the end.
+	int Take( Alignments &a )
+	{
+		pthread_mutex_lock( &lock ) ;
+		if ( count == 0 && !eof )
+		{
+			double t = Now() ;
+			while ( count == 0 && !eof )
+				pthread_cond_wait( &notEmpty, &lock ) ;
+			consumerWait += Now() - t ;
+		}
+		if ( count == 0 )
+		{
+			a.totalReadCnt = finalTotalReadCnt ;
+			pthread_mutex_unlock( &lock ) ;
+			return 0 ;
+		}
+		struct _prefetchSlot &slot = slots[head] ;
+		pthread_mutex_unlock( &lock ) ;
+
+		bam1_t *tmp = a.b ;
+		a.b = slot.b ;
+		slot.b = tmp ;
+		a.cur = slot.cur ;
+		a.segCnt = slot.segCnt ;
+		memcpy( a.segments, slot.segments, sizeof( a.segments[0] ) * slot.segCnt ) ;
+		a.segmentsSum = slot.segmentsSum ;
+		a.hasClipHead = slot.hasClipHead ;
+		a.hasClipTail = slot.hasClipTail ;
+		a.aux = slot.aux ;
+		a.totalReadCnt = slot.totalReadCnt ;
+		a.decoded = true ;
+
+		pthread_mutex_lock( &lock ) ;
+		head = ( head + 1 ) % capacity ;
+		--count ;
+		if ( count <= lowWater )
+			pthread_cond_signal( &notFull ) ;
+		pthread_mutex_unlock( &lock ) ;
+		return 1 ;
+	}
+} ;
+
+inline bool Alignments::IsFromCache()
+{
+	if ( prefetch != NULL )
+		return prefetch->fromCache ;
+	return cache.IsOpened() && !cache.IsWriting() ;
+}
+
+inline void Alignments::EnablePrefetch( int capacity )
+{
+	if ( prefetch != NULL || capacity <= 0 || !opened || useReadGroups || isReadGroupView )
+		return ; // the ring does not carry the read group of the records
+	// The source takes over the file and the reading state. This object keeps the view of the current record.
+	Alignments *source = new Alignments( *this ) ;
+	source->b = NULL ;
+	b = NULL ;
+	fpSam = NULL ;
+	index = NULL ;
+	iter = NULL ;
+	cache = AlignmentCache() ;
+	prefetch = new AlignmentsPrefetch( source, capacity ) ;
+	prefetch->Start() ;
+}
+
+inline void Alignments::DisablePrefetch()
+{
+	if ( prefetch == NULL )
+		return ;
+	AlignmentsPrefetch *p = prefetch ;
+	Alignments *source = p->GetSource() ;
+	prefetch = NULL ;
+	p->Stop() ;
+	source->Close() ;
+	delete source ;
+	delete p ;
+}
+
+inline void Alignments::GetDecodeStats( struct _alignmentsDecodeStats &stats )
+{
+	stats = decodeStats ;
+	if ( prefetch != NULL )
+	{
+		// The records are read and decoded by the source, the accessors run here.
+		struct _alignmentsDecodeStats s ;
+		prefetch->GetSource()->GetDecodeStats( s ) ;
+		stats.recordCnt += s.recordCnt ;
+		stats.allocSaved += s.allocSaved ;
+		stats.auxScanCnt += s.auxScanCnt ;
+		stats.auxScanSaved += s.auxScanSaved ;
+	}
+}
+
+inline void Alignments::GetPrefetchStats( double &consumerWait, double &producerWait )
+{
+	consumerWait = producerWait = 0 ;
+	if ( prefetch == NULL )
+		return ;
+	consumerWait = prefetch->consumerWait ;
+	producerWait = prefetch->producerWait ;
+}
+
+inline int Alignments::NextPrefetch()
+{
+	atBegin = false ;
+	if ( !prefetch->Take( *this ) )
+	{
+		atEnd = true ;
+		return 0 ;
+	}
+	return 1 ;
+}
+
+inline void Alignments::RewindPrefetch()
+{
+	prefetch->Stop() ;
+	prefetch->GetSource()->Rewind() ;
+	prefetch->Start() ;
+	atBegin = true ;
+	atEnd = false ;
+}
+
+inline void Alignments::SeekPrefetch( int tid, int64_t start, int64_t end )
+{
+	prefetch->Stop() ;
+	prefetch->GetSource()->Seek( tid, start, end ) ;
+	prefetch->Start() ;
+}
 #endif
@@ -53,7 +53,7 @@ struct _block
 
 	char leftStrand, rightStrand ;
 
-	int *depth ;
+	int *depth ; // the coverage difference of each base, in the depth arena of Blocks
 	int prevCnt, nextCnt ; // Some connection information for the subexons.
 	int *prev ;
 	int *next ;
@@ -72,6 +72,11 @@ class Blocks
 {
 	private:
 		std::map<int, int> exonBlocksChrIdOffset ;
+		int buildTag ; // the state of AddExonBlocks
+		int depthTag ; // the state of AddDepth
+		std::vector<struct _block> depthExonBlocks ;
+		std::vector<int> depthArena ; // the depth of all the blocks, in place of an array for each block
+		std::vector<int64_t> depthOffset ; // the start of each block in depthArena
 
 		int64_t Overlap( int64_t s0, int64_t e0, int64_t s1, int64_t e1, int64_t &s, int64_t &e )
 		{
@@ -308,7 +313,6 @@ class Blocks
 					lostDepthSum += depth[i - exonBlocks[tag].start ] ;
 				exonBlocks[tag].depthSum -= lostDepthSum ;
 
-				delete[] exonBlocks[tag].depth ;
 				exonBlocks[tag].depth = NULL ;
 				
 				//if ( exonBlocks[tag].start == 1562344 )
@@ -329,7 +333,10 @@ class Blocks
 	public:
 		std::vector<struct _block> exonBlocks ;
 
-		Blocks() { } 	
+		Blocks() 
+		{
+			buildTag = depthTag = 0 ;
+		}
 		~Blocks() 
 		{
 			int blockCnt = exonBlocks.size() ;
@@ -351,10 +358,21 @@ class Blocks
 			return block.depthSum / (double)( block.end - block.start + 1 ) ;
 		}
 
-		int BuildExonBlocks( Alignments &alignments )
+		template <class T>
+		int BuildExonBlocks( T &alignments )
 		{
-			int tag = 0 ;
+			buildTag = 0 ;
 			while ( alignments.Next() )
+				AddExonBlocks( alignments ) ;
+			return FinishExonBlocks() ;
+		}
+
+		// Extend the blocks by the current alignment. The alignments come in the coordinate order, 
+		// so the records of a merged file can be routed to the blocks of their samples.
+		template <class T>
+		void AddExonBlocks( T &alignments )
+		{
+			int &tag = buildTag ;
 			{
 				int i, j, k ;
 				int segCnt = alignments.segCnt ;
@@ -384,11 +402,18 @@ class Blocks
 					}
 					//if ( i == 0 )
 					//	printf( "hi %d %s %d %d\n", i, alignments.GetReadId(), segments[i].a, segments[i].b ) ;
-					for ( j = tag ; j < (int)exonBlocks.size() ; ++j )
+					// The blocks from tag on are on this chromosome and sorted, so bisect for the first one 
+					// that reaches the segment.
+					int lo = tag, hi = exonBlocks.size() ;
+					while ( lo < hi )
 					{
-						if ( exonBlocks[j].end >= segments[i].a - 1 )
-							break ;
+						int mid = ( lo + hi ) / 2 ;
+						if ( exonBlocks[mid].end >= segments[i].a - 1 )
+							hi = mid ;
+						else
+							lo = mid + 1 ;
 					}
+					j = lo ;
 					if ( j >= (int)exonBlocks.size() )
 					{
 						// Append a new block
@@ -443,11 +468,7 @@ class Blocks
 							if ( k > j + 1 )
 							{
 								// Remove the merged blocks
-								int a, b ;
-								for ( a = j + 1, b = k ; b < (int)exonBlocks.size() ; ++a, ++b )
-									exonBlocks[a] = exonBlocks[b] ;
-								for ( a = 0 ; a < k - ( j + 1 ) ; ++a )
-									exonBlocks.pop_back() ;
+								exonBlocks.erase( exonBlocks.begin() + j + 1, exonBlocks.begin() + k ) ;
 							}
 						}
 						else if ( exonBlocks[j].start > segments[i].a && exonBlocks[j].start <= segments[i].b + 1 ) 
@@ -482,20 +503,13 @@ class Blocks
 
 							if ( k < j - 1 )
 							{
-								int a, b ;
 								eid = k + 1 ;
-								for ( a = k + 2, b = j + 1 ; b < (int)exonBlocks.size() ; ++a, ++b )
-									exonBlocks[a] = exonBlocks[b] ;
-								for ( a = 0 ; a < ( j - 1 ) - k ; ++a )
-									exonBlocks.pop_back() ;
-
+								exonBlocks.erase( exonBlocks.begin() + k + 2, exonBlocks.begin() + j + 1 ) ;
 							}
 						}
 					}
 					else if ( exonBlocks[j].start > segments[i].b + 1 )
 					{
-						int size = exonBlocks.size() ;
-						int a ;
 						// No overlap, insert a new block
 						struct _block newSeg ;
 						newSeg.chrId = alignments.GetChromId() ;
@@ -510,12 +524,8 @@ class Blocks
 							newSeg.rightSplice = segments[i].b ;
 
 						// Insert at position j
-						exonBlocks.push_back( newSeg ) ;	
-						for ( a = size ; a > j ; --a )
-							exonBlocks[a] = exonBlocks[a - 1] ;
-						exonBlocks[a] = newSeg ;
-
-						eid = a ;
+						exonBlocks.insert( exonBlocks.begin() + j, newSeg ) ;
+						eid = j ;
 					}
 					else
 					{
@@ -554,6 +564,18 @@ class Blocks
 					}*/
 				}
 			}
+		}
+
+		// Move the first cnt exon blocks to blocks, e.g. the blocks the alignments have moved past.
+		void TakeExonBlocks( int cnt, std::vector<struct _block> &blocks )
+		{
+			blocks.assign( exonBlocks.begin(), exonBlocks.begin() + cnt ) ;
+			exonBlocks.erase( exonBlocks.begin(), exonBlocks.begin() + cnt ) ;
+			buildTag = buildTag > cnt ? buildTag - cnt : 0 ;
+		}
+
+		int FinishExonBlocks()
+		{
 			/*for ( int i = 0 ; i < (int)exonBlocks.size() ; ++i )
 			  {
 			  printf( "%d %d\n", exonBlocks[i].start, exonBlocks[i].end ) ;
@@ -733,9 +755,10 @@ class Blocks
 						continue ;
 					
 					for ( j = i + 1 ; j < bsize ; ++j )
-						if ( sites[k].oppositePos >= exonBlocks[j].start && sites[k].oppositePos <= exonBlocks[j].end )
+						if ( exonBlocks[j].chrId != exonBlocks[i].chrId || sites[k].oppositePos <= exonBlocks[j].end )
 							break ;
-					if ( sites[k].oppositePos >= exonBlocks[j].start && sites[k].oppositePos <= exonBlocks[j].end )
+					if ( j < bsize && exonBlocks[j].chrId == exonBlocks[i].chrId 
+						&& sites[k].oppositePos >= exonBlocks[j].start && sites[k].oppositePos <= exonBlocks[j].end )
 					{
 						int p ;
 						p = adj[i].next ;
@@ -967,7 +990,8 @@ class Blocks
 			delete[] adj ;
 		}
 
-		void SplitBlocks( Alignments &alignments, std::vector< struct _splitSite > &splitSites )	
+		template <class T>
+		void SplitBlocks( T &alignments, std::vector< struct _splitSite > &splitSites )	
 		{
 			std::vector<struct _block> rawExonBlocks = exonBlocks ;
 			int i, j ;
@@ -1060,16 +1084,42 @@ class Blocks
 			BuildBlockChrIdOffset() ;
 		}
 
-		void ComputeDepth( Alignments &alignments ) 
+		template <class T>
+		void ComputeDepth( T &alignments ) 
 		{
 			// Go through the alignment list again to fill in the depthSum;
+			StartDepth() ;
+			while ( alignments.Next() )
+				AddDepth( alignments ) ;
+			FinishDepth() ;
+		}
+
+		// Lay out the depth of the blocks in one arena. The arena keeps its memory for the next blocks.
+		void StartDepth()
+		{
 			int i ;
-			int j ;
-			int tag = 0 ;
 			int blockCnt = exonBlocks.size() ;
+			int64_t size = 0 ;
+			depthTag = 0 ;
+			depthExonBlocks.clear() ;
+			depthOffset.resize( blockCnt ) ;
+			for ( i = 0 ; i < blockCnt ; ++i )
+			{
+				depthOffset[i] = size ;
+				size += exonBlocks[i].end - exonBlocks[i].start + 2 ;
+			}
+			depthArena.assign( size, 0 ) ;
+		}
 
-			std::vector<struct _block> newExonBlocks ;
-			while ( alignments.Next() )
+		// Add the coverage of the current alignment after StartDepth. As AddExonBlocks, the alignments come in the coordinate order.
+		template <class T>
+		void AddDepth( T &alignments )
+		{
+			int i ;
+			int j ;
+			int &tag = depthTag ;
+			int blockCnt = exonBlocks.size() ;
+			std::vector<struct _block> &newExonBlocks = depthExonBlocks ;
 			{
 				int segCnt = alignments.segCnt ;
 				struct _pair *segments = alignments.segments ;
@@ -1091,9 +1141,7 @@ class Blocks
 
 						if ( exonBlocks[j].depth == NULL )
 						{
-							int len = exonBlocks[j].end - exonBlocks[j].start + 1 ;
-							exonBlocks[j].depth = new int[len + 1] ;
-							memset( exonBlocks[j].depth, 0, sizeof( int ) * ( len + 1 ) ) ;
+							exonBlocks[j].depth = &depthArena[ depthOffset[j] ] ;
 							exonBlocks[j].leftSplice = exonBlocks[j].start ;
 							exonBlocks[j].rightSplice = exonBlocks[j].end ;
 						}
@@ -1116,6 +1164,15 @@ class Blocks
 				}
 			}
 
+		}
+
+		void FinishDepth()
+		{
+			int i ;
+			int &tag = depthTag ;
+			int blockCnt = exonBlocks.size() ;
+			std::vector<struct _block> &newExonBlocks = depthExonBlocks ;
+
 			for ( ; tag < blockCnt ; ++tag )
 				AdjustAndCreateExonBlocks( tag, newExonBlocks ) ;
 			exonBlocks.clear() ;
@@ -1138,6 +1195,8 @@ class Blocks
 					newExonBlocks[i].rightType = 0 ;
 			}
 			exonBlocks = newExonBlocks ;
+			std::vector<struct _block>().swap( depthExonBlocks ) ;
+			depthArena.clear() ;
 		}
 
 		// If two blocks whose soft boundary are close to each other, we can merge them.
@@ -1194,7 +1253,8 @@ class Blocks
 			delete[] newIdx ;
 		}
 
-		void AddIntronInformation( std::vector<struct _splitSite> &sites, Alignments &alignments )
+		template <class T>
+		void AddIntronInformation( std::vector<struct _splitSite> &sites, T &alignments )
 		{
 			// Add the connection information, support information and the strand information.
 			int i, j, k, tag ;
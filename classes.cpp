@@ -26,6 +26,14 @@ char usage[] = "./classes [OPTIONS]:\n"
 	"\t--hasMateIdSuffix: the read id has suffix such as .1, .2 for a mate pair. (default: false)\n"
 	"\t--maxDpConstraintSize: the maximum number of subexons a constraint can cover in dynamic programming. (default: 7; -1 for inf)\n"
 	"\t--primaryParalog: use primary alignment to retain paralog genes instead of unique alignments. (default: not used)\n"
+	"\t--readThreads INT: number of threads decompressing each BAM file ahead of the reader. (default: 0, not used)\n"
+	"\t--alignmentCache: read the decoded alignments from the .dac file next to each BAM file when it is up to date. (default: not used)\n"
+	"\t--libraryStats: load the read and fragment length from the .stats file next to each BAM file when it is up to date. (default: not used)\n"
+	"\t--indexSampling: estimate the read and fragment length from records spread over the genome through the BAM index. (default: not used)\n"
+	"\t--maxOpenFiles INT: the maximum number of BAM files open at the same time; the idle ones are closed and reopened when needed. (default: 0, no limit)\n"
+	"\t--blockCacheSize INT: MB of the block cache shared by the BAM files closed by --maxOpenFiles. (default: 64)\n"
+	"\t--prefetch INT: decode up to the given number of records of each BAM file ahead on a background thread; not used with --maxOpenFiles. (default: 0, not used)\n"
+	"\t--readGroups: the single BAM file holds one sample per read group, in the order of the @RG lines. (default: not used)\n"
 	;
 
 static const char *short_options = "s:b:f:o:d:p:c:h" ;
@@ -37,6 +45,14 @@ static struct option long_options[] =
 		{ "primaryParalog", no_argument, 0, 10003 },
 		{ "maxDpConstraintSize", required_argument, 0, 10004 },
 		{ "stranded", required_argument, 0, 10005 }, 
+		{ "readThreads", required_argument, 0, 10006 },
+		{ "alignmentCache", no_argument, 0, 10007 },
+		{ "libraryStats", no_argument, 0, 10008 },
+		{ "indexSampling", no_argument, 0, 10009 },
+		{ "maxOpenFiles", required_argument, 0, 10010 },
+		{ "blockCacheSize", required_argument, 0, 10011 },
+		{ "prefetch", required_argument, 0, 10012 },
+		{ "readGroups", no_argument, 0, 10013 },
 		{ (char *)0, 0, 0, 0} 
 	} ;
 
@@ -45,6 +61,8 @@ struct _getAlignmentsInfoThreadArg
 	std::vector<Alignments> *pAlignmentFiles ;
 	int numThreads ;
 	int tid ;
+	bool useLibraryStats ;
+	bool indexSampling ;
 } ;
 
 struct _getConstraintsThreadArg
@@ -58,20 +76,32 @@ struct _getConstraintsThreadArg
 	int start, end ;
 } ;
 
+void GetAlignmentsInfo( Alignments &alignments, bool useLibraryStats, bool indexSampling )
+{
+	if ( useLibraryStats && alignments.LoadGeneralInfo() )
+		return ;
+	alignments.Acquire() ;
+	if ( indexSampling )
+		alignments.SampleGeneralInfo() ;
+	else
+		alignments.GetGeneralInfo( true ) ;
+	alignments.Rewind() ;
+	alignments.Release() ;
+}
+
 void *GetAlignmentsInfo_Thread( void *pArg )
 {
 	int i ;
 	std::vector <Alignments> &alignmentFiles = *( ( (struct _getAlignmentsInfoThreadArg *)pArg )->pAlignmentFiles ) ;
 	int tid = ( (struct _getAlignmentsInfoThreadArg *)pArg )->tid ;
 	int numThreads = ( (struct _getAlignmentsInfoThreadArg *)pArg )->numThreads ;
+	bool useLibraryStats = ( (struct _getAlignmentsInfoThreadArg *)pArg )->useLibraryStats ;
+	bool indexSampling = ( (struct _getAlignmentsInfoThreadArg *)pArg )->indexSampling ;
 	int size = alignmentFiles.size() ;
 	for ( i = 0 ; i < size ; ++i )
 	{
 		if ( i % numThreads == tid )
-		{
-			alignmentFiles[i].GetGeneralInfo( true ) ;
-			alignmentFiles[i].Rewind() ;
-		}
+			GetAlignmentsInfo( alignmentFiles[i], useLibraryStats, indexSampling ) ;
 	}
 	
 	pthread_exit( NULL ) ;
@@ -117,8 +147,19 @@ int main( int argc, char *argv[] )
 	bool usePrimaryAsUnique = false ;
 	int maxDpConstraintSize = 7 ;
 	int strandedLib = 0 ;
+	int readThreads = 0 ;
+	bool useAlignmentCache = false ;
+	bool useLibraryStats = false ;
+	bool indexSampling = false ;
+	int maxOpenFiles = 0 ;
+	int blockCacheSize = 64 ;
+	int prefetchSize = 0 ;
+	bool useReadGroups = false ;
+	std::vector<std::string> alignmentFileNames ;
+	AlignmentsCursorPool *cursorPool = NULL ;
 	
 	std::vector<Alignments> alignmentFiles ;
+	Alignments merged ; // the file read for all the samples with --readGroups
 	SubexonCorrelation subexonCorrelation ;
 	
 	classifierThreshold = 0.05 ;
@@ -134,10 +175,7 @@ int main( int argc, char *argv[] )
 		}
 		else if ( c == 'b' )
 		{
-			Alignments a ;
-			a.Open( optarg ) ;
-			//a.SetAllowClip( false ) ;
-			alignmentFiles.push_back( a ) ;
+			alignmentFileNames.push_back( std::string( optarg ) ) ;
 		}
 		else if ( c == 'c' )
 		{
@@ -176,9 +214,7 @@ int main( int argc, char *argv[] )
 					--len ;
 
 				}
-				Alignments a ;
-				a.Open( buffer ) ;
-				alignmentFiles.push_back( a ) ;
+				alignmentFileNames.push_back( std::string( buffer ) ) ;
 			}
 			fclose( fp ) ;
 		}
@@ -201,6 +237,38 @@ int main( int argc, char *argv[] )
 			else if (!strcmp(optarg, "fr"))
 				strandedLib = 2 ;
 		}
+		else if ( c == 10006 ) // readThreads
+		{
+			readThreads = atoi( optarg ) ;
+		}
+		else if ( c == 10007 ) // alignmentCache
+		{
+			useAlignmentCache = true ;
+		}
+		else if ( c == 10008 ) // libraryStats
+		{
+			useLibraryStats = true ;
+		}
+		else if ( c == 10009 ) // indexSampling
+		{
+			indexSampling = true ;
+		}
+		else if ( c == 10010 ) // maxOpenFiles
+		{
+			maxOpenFiles = atoi( optarg ) ;
+		}
+		else if ( c == 10011 ) // blockCacheSize
+		{
+			blockCacheSize = atoi( optarg ) ;
+		}
+		else if ( c == 10012 ) // prefetch
+		{
+			prefetchSize = atoi( optarg ) ;
+		}
+		else if ( c == 10013 ) // readGroups
+		{
+			useReadGroups = true ;
+		}
 		else
 		{
 			printf( "%s", usage ) ;
@@ -212,28 +280,71 @@ int main( int argc, char *argv[] )
 		printf( "Cannot find combined subexon file.\n" ) ;
 		exit( 1 ) ;
 	}
-	if ( alignmentFiles.size() < 1 )
+	if ( alignmentFileNames.size() < 1 )
 	{
 		printf( "Must use -b option to specify BAM files.\n" ) ;
 		exit( 1 ) ;
 	}
+	if ( useReadGroups && alignmentFileNames.size() != 1 )
+	{
+		printf( "--readGroups needs exactly one BAM file.\n" ) ;
+		exit( 1 ) ;
+	}
 
-	if (strandedLib != 0)
+	// Open the files after the options are known, so that no more than maxOpenFiles of them stay open.
+	if ( useReadGroups )
 	{
-		size = alignmentFiles.size() ;
+		// alignmentFiles only hold the statistics of the samples, and the alignments are read from the merged file.
+		char buffer[1024] ;
+		strcpy( buffer, alignmentFileNames[0].c_str() ) ;
+		if ( strandedLib != 0 )
+			merged.SetStrandedLib( strandedLib ) ;
+		if ( readThreads > 0 )
+			merged.SetReadThreads( readThreads ) ;
+		merged.UseReadGroups() ;
+		merged.Open( buffer ) ;
+		alignmentFiles.resize( merged.GetReadGroupCount() ) ;
+		if ( useAlignmentCache || useLibraryStats || indexSampling || maxOpenFiles > 0 )
+			fprintf( stderr, "--alignmentCache, --libraryStats, --indexSampling and --maxOpenFiles are not used with --readGroups.\n" ) ;
+	}
+	else
+	{
+		size = alignmentFileNames.size() ;
+		alignmentFiles.resize( size ) ;
+		if ( maxOpenFiles > 0 )
+			cursorPool = new AlignmentsCursorPool( maxOpenFiles, (int64_t)blockCacheSize << 20 ) ;
 		for ( i = 0 ; i < size ; ++i )
-			alignmentFiles[i].SetStrandedLib(strandedLib) ;
+		{
+			char buffer[1024] ;
+			strcpy( buffer, alignmentFileNames[i].c_str() ) ;
+
+			if ( strandedLib != 0 )
+				alignmentFiles[i].SetStrandedLib( strandedLib ) ;
+			if ( readThreads > 0 )
+				alignmentFiles[i].SetReadThreads( readThreads ) ;
+			if ( useAlignmentCache )
+				alignmentFiles[i].UseCache( false ) ;
+			//alignmentFiles[i].SetAllowClip( false ) ;
+			alignmentFiles[i].Open( buffer ) ;
+			if ( cursorPool != NULL )
+				cursorPool->Add( &alignmentFiles[i] ) ;
+		}
 	}
 
 
-	if ( alignmentFiles.size() < 50 )
+	if ( useReadGroups )
 	{
+		// One pass over the merged file samples the statistics of every read group.
+		GetAlignmentsInfo( merged, false, false ) ;
 		size = alignmentFiles.size() ;
 		for ( i = 0 ; i < size ; ++i )
-		{
-			alignmentFiles[i].GetGeneralInfo( true ) ;
-			alignmentFiles[i].Rewind() ;
-		}
+			alignmentFiles[i].OpenReadGroup( merged, i ) ;
+	}
+	else if ( alignmentFiles.size() < 50 )
+	{
+		size = alignmentFiles.size() ;
+		for ( i = 0 ; i < size ; ++i )
+			GetAlignmentsInfo( alignmentFiles[i], useLibraryStats, indexSampling ) ;
 	}
 	else
 	{
@@ -251,6 +362,8 @@ int main( int argc, char *argv[] )
 			args[i].pAlignmentFiles = &alignmentFiles ;
 			args[i].tid = i ;
 			args[i].numThreads = numThreads ;
+			args[i].useLibraryStats = useLibraryStats ;
+			args[i].indexSampling = indexSampling ;
 
 			pthread_create( &threads[i], &pthreadAttr, GetAlignmentsInfo_Thread, &args[i] ) ;
 		}
@@ -265,6 +378,18 @@ int main( int argc, char *argv[] )
 		delete[] threads ;
 	}
 
+	if ( prefetchSize > 0 )
+	{
+		if ( cursorPool != NULL || useReadGroups )
+			fprintf( stderr, "--prefetch is not used with --maxOpenFiles or --readGroups.\n" ) ;
+		else
+		{
+			size = alignmentFiles.size() ;
+			for ( i = 0 ; i < size ; ++i )
+				alignmentFiles[i].EnablePrefetch( prefetchSize ) ;
+		}
+	}
+
 	// Build the subexon graph
 	SubexonGraph subexonGraph( classifierThreshold, alignmentFiles[0], fpSubexon ) ;
 	subexonGraph.ComputeGeneIntervals() ;
@@ -302,8 +427,14 @@ int main( int argc, char *argv[] )
 			fflush( stdout ) ;
 
 			subexonCorrelation.ComputeCorrelation( intervalSubexons, gi.endIdx - gi.startIdx + 1, alignmentFiles[0] ) ;
-			for ( j = 0 ; j < sampleCnt ; ++j )
-				multiSampleConstraints[j].BuildConstraints( intervalSubexons, gi.endIdx - gi.startIdx + 1, gi.start, gi.end ) ;	
+			if ( useReadGroups )
+				Constraints::BuildReadGroupConstraints( merged, multiSampleConstraints, intervalSubexons, 
+					gi.endIdx - gi.startIdx + 1, gi.start, gi.end ) ;
+			else
+			{
+				for ( j = 0 ; j < sampleCnt ; ++j )
+					multiSampleConstraints[j].BuildConstraints( intervalSubexons, gi.endIdx - gi.startIdx + 1, gi.start, gi.end ) ;	
+			}
 
 			transcriptDecider.Solve( intervalSubexons, gi.endIdx - gi.startIdx + 1, multiSampleConstraints, subexonCorrelation ) ;
 
@@ -383,7 +514,12 @@ int main( int argc, char *argv[] )
 			fflush( stdout ) ;
 			
 			int gctCnt = ftCnt ;
-			if ( gctCnt > 1 && sampleCnt > 1 )
+			if ( useReadGroups ) // one reader routes the alignments to all the samples.
+			{
+				Constraints::BuildReadGroupConstraints( merged, multiSampleConstraints, intervalSubexons, 
+					gi.endIdx - gi.startIdx + 1, gi.start, gi.end ) ;
+			}
+			else if ( gctCnt > 1 && sampleCnt > 1 )
 			{
 				gctCnt = ( gctCnt < sampleCnt ? gctCnt : sampleCnt ) ;	
 				struct _getConstraintsThreadArg *args = new struct _getConstraintsThreadArg[ gctCnt ] ;
@@ -498,11 +634,54 @@ int main( int argc, char *argv[] )
 		}
 		outputHandler.OutputCommentToSampleGTF( i, buffer ) ;
 	}
+	if ( useReadGroups )
+	{
+		for ( i = 0 ; i < sampleCnt ; ++i )
+			alignmentFiles[i].totalReadCnt = merged.GetReadGroupReadCount( i ) ;
+	}
 	outputHandler.ComputeFPKMTPM( alignmentFiles ) ;
 	outputHandler.Flush() ;
-	
+
+	struct _alignmentsDecodeStats decodeStats, totalDecodeStats ;
+	memset( &totalDecodeStats, 0, sizeof( totalDecodeStats ) ) ;
+	for ( i = 0 ; i <= sampleCnt ; ++i )
+	{
+		if ( i < sampleCnt )
+			alignmentFiles[i].GetDecodeStats( decodeStats ) ;
+		else if ( useReadGroups )
+			merged.GetDecodeStats( decodeStats ) ;
+		else
+			break ;
+		totalDecodeStats.recordCnt += decodeStats.recordCnt ;
+		totalDecodeStats.allocSaved += decodeStats.allocSaved ;
+		totalDecodeStats.auxScanCnt += decodeStats.auxScanCnt ;
+		totalDecodeStats.auxScanSaved += decodeStats.auxScanSaved ;
+	}
+	printf( "Decoded records: %lld. Record allocations saved: %lld. Aux scans: %lld, saved: %lld\n",
+		(long long)totalDecodeStats.recordCnt, (long long)totalDecodeStats.allocSaved, 
+		(long long)totalDecodeStats.auxScanCnt, (long long)totalDecodeStats.auxScanSaved ) ;
+	if ( prefetchSize > 0 && cursorPool == NULL )
+	{
+		double consumerWait = 0, producerWait = 0 ;
+		for ( i = 0 ; i < sampleCnt ; ++i )
+		{
+			double c, p ;
+			alignmentFiles[i].GetPrefetchStats( c, p ) ;
+			consumerWait += c ;
+			producerWait += p ;
+		}
+		// Waiting mostly for the readers means I/O or inflation bound; waiting mostly for the ring to drain, CPU bound.
+		printf( "Prefetch waits: constraint building %.3lfs, readers %.3lfs\n", consumerWait, producerWait ) ;
+	}
+	if ( cursorPool != NULL )
+		printf( "Files suspended: %lld. Resumed: %lld, with the block cached: %lld\n", 
+			(long long)cursorPool->suspendCnt, (long long)cursorPool->resumeCnt, (long long)cursorPool->blockHitCnt ) ;
+
 	for ( i = 0 ; i < sampleCnt ; ++i )
 		alignmentFiles[i].Close() ;
+	if ( useReadGroups )
+		merged.Close() ;
+	delete cursorPool ;
 	fclose( fpSubexon ) ;
 	return 0 ;
 }
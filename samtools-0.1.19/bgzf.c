@@ -210,33 +210,34 @@ static int deflate_block(BGZF *fp, int block_length)
 	return comp_size;
 }
 
-// Inflate the block in fp->compressed_block into fp->uncompressed_block
-static int inflate_block(BGZF* fp, int block_length)
+// Inflate a complete BGZF block in _src_ into _dst_; return the uncompressed length or -1 on error
+static int bgzf_uncompress(void *dst, const void *src, int block_length)
 {
 	z_stream zs;
 	zs.zalloc = NULL;
 	zs.zfree = NULL;
-	zs.next_in = fp->compressed_block + 18;
+	zs.next_in = (Bytef*)src + 18;
 	zs.avail_in = block_length - 16;
-	zs.next_out = fp->uncompressed_block;
+	zs.next_out = dst;
 	zs.avail_out = BGZF_MAX_BLOCK_SIZE;
 
-	if (inflateInit2(&zs, -15) != Z_OK) {
-		fp->errcode |= BGZF_ERR_ZLIB;
-		return -1;
-	}
+	if (inflateInit2(&zs, -15) != Z_OK) return -1;
 	if (inflate(&zs, Z_FINISH) != Z_STREAM_END) {
 		inflateEnd(&zs);
-		fp->errcode |= BGZF_ERR_ZLIB;
-		return -1;
-	}
-	if (inflateEnd(&zs) != Z_OK) {
-		fp->errcode |= BGZF_ERR_ZLIB;
 		return -1;
 	}
+	if (inflateEnd(&zs) != Z_OK) return -1;
 	return zs.total_out;
 }
 
+// Inflate the block in fp->compressed_block into fp->uncompressed_block
+static int inflate_block(BGZF* fp, int block_length)
+{
+	int ret = bgzf_uncompress(fp->uncompressed_block, fp->compressed_block, block_length);
+	if (ret < 0) fp->errcode |= BGZF_ERR_ZLIB;
+	return ret;
+}
+
 static int check_header(const uint8_t *header)
 {
 	return (header[0] == 31 && header[1] == 139 && header[2] == 8 && (header[3] & 4) != 0
@@ -304,11 +305,212 @@ static int load_block_from_cache(BGZF *fp, int64_t block_address) {return 0;}
 static void cache_block(BGZF *fp, int size) {}
 #endif
 
+/***** BEGIN: multi-threaded read-ahead *****/
+
+/* Worker threads claim the upcoming blocks in file order, read them under
+ * the lock and inflate them outside of it. The reader takes the blocks back
+ * strictly in order from a ring of n_blks slots. */
+
+typedef struct {
+	void *cblock, *ublock;
+	int64_t address; // file offset of the block
+	int clen, ulen; // compressed and uncompressed length
+	int ready, eof, errcode;
+} rdslot_t;
+
+typedef struct {
+	int n_threads, n_blks;
+	int64_t claimed, consumed; // sequence numbers of the blocks
+	int busy, reading, pause, eof, done;
+	int64_t file_address; // where the next claimed block starts
+	int64_t next_address; // the block following the one handed to the reader
+	rdslot_t *slot;
+	pthread_t *tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cv_work, cv_ready;
+	BGZF *fp;
+} mtread_t;
+
+#define mt_reading(fp) (!(fp)->is_write && (fp)->mt)
+
+// Read the next compressed block into _slot_. Called with mt->reading set, so file access is exclusive.
+static void mt_read_raw(mtread_t *mt, rdslot_t *slot)
+{
+	uint8_t *header = (uint8_t*)slot->cblock;
+	int count, remaining;
+	slot->address = mt->file_address;
+	slot->clen = slot->ulen = 0;
+	count = _bgzf_read(mt->fp->fp, header, BLOCK_HEADER_LENGTH);
+	if (count == 0) {
+		slot->eof = 1;
+		return;
+	}
+	if (count != BLOCK_HEADER_LENGTH || !check_header(header)) {
+		slot->errcode |= BGZF_ERR_HEADER;
+		return;
+	}
+	slot->clen = unpackInt16(&header[16]) + 1;
+	remaining = slot->clen - BLOCK_HEADER_LENGTH;
+	count = _bgzf_read(mt->fp->fp, header + BLOCK_HEADER_LENGTH, remaining);
+	if (count != remaining) slot->errcode |= BGZF_ERR_IO;
+}
+
+static void *mt_read_worker(void *data)
+{
+	mtread_t *mt = (mtread_t*)data;
+	pthread_mutex_lock(&mt->lock);
+	for (;;) {
+		rdslot_t *slot;
+		while (!mt->done && (mt->pause || mt->reading || mt->eof || mt->claimed - mt->consumed >= mt->n_blks))
+			pthread_cond_wait(&mt->cv_work, &mt->lock);
+		if (mt->done) break;
+		slot = &mt->slot[mt->claimed % mt->n_blks];
+		++mt->claimed;
+		++mt->busy;
+		mt->reading = 1;
+		pthread_mutex_unlock(&mt->lock);
+
+		mt_read_raw(mt, slot);
+
+		pthread_mutex_lock(&mt->lock);
+		mt->reading = 0;
+		mt->file_address += slot->clen;
+		if (slot->eof || slot->errcode) mt->eof = 1; // nothing sensible follows
+		pthread_cond_broadcast(&mt->cv_work);
+		pthread_mutex_unlock(&mt->lock);
+
+		if (!slot->eof && !slot->errcode) {
+			slot->ulen = bgzf_uncompress(slot->ublock, slot->cblock, slot->clen);
+			if (slot->ulen < 0) slot->errcode |= BGZF_ERR_ZLIB;
+		}
+
+		pthread_mutex_lock(&mt->lock);
+		slot->ready = 1;
+		--mt->busy;
+		pthread_cond_broadcast(&mt->cv_ready);
+	}
+	pthread_mutex_unlock(&mt->lock);
+	return 0;
+}
+
+// Stop claiming new blocks and wait for the in-flight ones. Called with the lock held.
+static void mt_read_pause(mtread_t *mt)
+{
+	mt->pause = 1;
+	while (mt->busy) pthread_cond_wait(&mt->cv_ready, &mt->lock);
+}
+
+static void mt_read_resume(mtread_t *mt)
+{
+	mt->pause = 0;
+	pthread_cond_broadcast(&mt->cv_work);
+}
+
+// Drop the blocks read ahead and restart at _address_. The file must already be positioned there.
+static void mt_read_restart(mtread_t *mt, int64_t address)
+{
+	int i;
+	for (i = 0; i < mt->n_blks; ++i)
+		mt->slot[i].ready = mt->slot[i].eof = mt->slot[i].errcode = 0;
+	mt->claimed = mt->consumed = 0;
+	mt->eof = 0;
+	mt->file_address = mt->next_address = address;
+}
+
+int bgzf_mt_read(BGZF *fp, int n_threads, int n_sub_blks)
+{
+	int i;
+	mtread_t *mt;
+	pthread_attr_t attr;
+	if (fp->is_write || fp->mt || n_threads < 1 || n_sub_blks < 1) return -1;
+	mt = calloc(1, sizeof(mtread_t));
+	mt->fp = fp;
+	mt->n_threads = n_threads;
+	mt->n_blks = n_threads * n_sub_blks;
+	mt->slot = calloc(mt->n_blks, sizeof(rdslot_t));
+	for (i = 0; i < mt->n_blks; ++i) {
+		mt->slot[i].cblock = malloc(BGZF_MAX_BLOCK_SIZE);
+		mt->slot[i].ublock = malloc(BGZF_MAX_BLOCK_SIZE);
+	}
+	mt_read_restart(mt, _bgzf_tell((_bgzf_file_t)fp->fp));
+	mt->tid = calloc(mt->n_threads, sizeof(pthread_t));
+	pthread_mutex_init(&mt->lock, 0);
+	pthread_cond_init(&mt->cv_work, 0);
+	pthread_cond_init(&mt->cv_ready, 0);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	for (i = 0; i < mt->n_threads; ++i)
+		pthread_create(&mt->tid[i], &attr, mt_read_worker, mt);
+	pthread_attr_destroy(&attr);
+	fp->mt = mt;
+	return 0;
+}
+
+static void mt_read_destroy(mtread_t *mt)
+{
+	int i;
+	pthread_mutex_lock(&mt->lock);
+	mt->done = 1;
+	pthread_cond_broadcast(&mt->cv_work);
+	pthread_mutex_unlock(&mt->lock);
+	for (i = 0; i < mt->n_threads; ++i) pthread_join(mt->tid[i], 0);
+	for (i = 0; i < mt->n_blks; ++i) {
+		free(mt->slot[i].cblock);
+		free(mt->slot[i].ublock);
+	}
+	free(mt->slot); free(mt->tid);
+	pthread_cond_destroy(&mt->cv_work);
+	pthread_cond_destroy(&mt->cv_ready);
+	pthread_mutex_destroy(&mt->lock);
+	free(mt);
+}
+
+// Hand the next inflated block to the reader; mirrors the single-threaded path of bgzf_read_block()
+static int mt_read_block(BGZF *fp)
+{
+	mtread_t *mt = (mtread_t*)fp->mt;
+	rdslot_t *slot = &mt->slot[mt->consumed % mt->n_blks];
+	void *tmp;
+	pthread_mutex_lock(&mt->lock);
+	while (!slot->ready) pthread_cond_wait(&mt->cv_ready, &mt->lock);
+	pthread_mutex_unlock(&mt->lock);
+	if (slot->errcode) {
+		fp->errcode |= slot->errcode;
+		return -1;
+	}
+	if (slot->eof) { // the slot is kept, so further calls keep reporting the end of file
+		fp->block_length = 0;
+		return 0;
+	}
+	tmp = fp->uncompressed_block; fp->uncompressed_block = slot->ublock; slot->ublock = tmp;
+	if (fp->block_length != 0) fp->block_offset = 0; // Do not reset offset if this read follows a seek.
+	fp->block_address = slot->address;
+	fp->block_length = slot->ulen;
+
+	pthread_mutex_lock(&mt->lock);
+	mt->next_address = slot->address + slot->clen;
+	slot->ready = 0;
+	++mt->consumed;
+	pthread_cond_broadcast(&mt->cv_work);
+	pthread_mutex_unlock(&mt->lock);
+	return 0;
+}
+
+// The file offset of the block after the current one
+static inline int64_t bgzf_htell(BGZF *fp)
+{
+	if (mt_reading(fp)) return ((mtread_t*)fp->mt)->next_address;
+	return _bgzf_tell((_bgzf_file_t)fp->fp);
+}
+
+/***** END: multi-threaded read-ahead *****/
+
 int bgzf_read_block(BGZF *fp)
 {
 	uint8_t header[BLOCK_HEADER_LENGTH], *compressed_block;
 	int count, size = 0, block_length, remaining;
 	int64_t block_address;
+	if (mt_reading(fp)) return mt_read_block(fp);
 	block_address = _bgzf_tell((_bgzf_file_t)fp->fp);
 	if (fp->cache_size && load_block_from_cache(fp, block_address)) return 0;
 	count = _bgzf_read(fp->fp, header, sizeof(header));
@@ -361,7 +563,7 @@ ssize_t bgzf_read(BGZF *fp, void *data, ssize_t length)
 		bytes_read += copy_length;
 	}
 	if (fp->block_offset == fp->block_length) {
-		fp->block_address = _bgzf_tell((_bgzf_file_t)fp->fp);
+		fp->block_address = bgzf_htell(fp);
 		fp->block_offset = fp->block_length = 0;
 	}
 	return bytes_read;
@@ -581,7 +783,7 @@ int bgzf_close(BGZF* fp)
 			return -1;
 		}
 		if (fp->mt) mt_destroy(fp->mt);
-	}
+	} else if (fp->mt) mt_read_destroy(fp->mt);
 	ret = fp->is_write? fclose(fp->fp) : _bgzf_close(fp->fp);
 	if (ret != 0) return -1;
 	free(fp->uncompressed_block);
@@ -601,11 +803,23 @@ int bgzf_check_EOF(BGZF *fp)
 	static uint8_t magic[28] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
 	uint8_t buf[28];
 	off_t offset;
+	int ret = 0;
+	mtread_t *mt = mt_reading(fp)? (mtread_t*)fp->mt : 0;
+	if (mt) { // keep the workers off the file handle
+		pthread_mutex_lock(&mt->lock);
+		mt_read_pause(mt);
+	}
 	offset = _bgzf_tell((_bgzf_file_t)fp->fp);
-	if (_bgzf_seek(fp->fp, -28, SEEK_END) < 0) return 0;
-	_bgzf_read(fp->fp, buf, 28);
-	_bgzf_seek(fp->fp, offset, SEEK_SET);
-	return (memcmp(magic, buf, 28) == 0)? 1 : 0;
+	if (_bgzf_seek(fp->fp, -28, SEEK_END) >= 0) {
+		_bgzf_read(fp->fp, buf, 28);
+		_bgzf_seek(fp->fp, offset, SEEK_SET);
+		ret = (memcmp(magic, buf, 28) == 0)? 1 : 0;
+	}
+	if (mt) {
+		mt_read_resume(mt);
+		pthread_mutex_unlock(&mt->lock);
+	}
+	return ret;
 }
 
 int64_t bgzf_seek(BGZF* fp, int64_t pos, int where)
@@ -619,7 +833,20 @@ int64_t bgzf_seek(BGZF* fp, int64_t pos, int where)
 	}
 	block_offset = pos & 0xFFFF;
 	block_address = pos >> 16;
-	if (_bgzf_seek(fp->fp, block_address, SEEK_SET) < 0) {
+	if (mt_reading(fp)) {
+		mtread_t *mt = (mtread_t*)fp->mt;
+		int ret;
+		pthread_mutex_lock(&mt->lock);
+		mt_read_pause(mt);
+		ret = _bgzf_seek(fp->fp, block_address, SEEK_SET);
+		mt_read_restart(mt, block_address);
+		mt_read_resume(mt);
+		pthread_mutex_unlock(&mt->lock);
+		if (ret < 0) {
+			fp->errcode |= BGZF_ERR_IO;
+			return -1;
+		}
+	} else if (_bgzf_seek(fp->fp, block_address, SEEK_SET) < 0) {
 		fp->errcode |= BGZF_ERR_IO;
 		return -1;
 	}
@@ -629,6 +856,46 @@ int64_t bgzf_seek(BGZF* fp, int64_t pos, int where)
 	return 0;
 }
 
+int bgzf_save_block(BGZF *fp, void *data, int64_t *address, int64_t *next)
+{
+	if (fp->is_write || fp->block_length <= 0) return 0;
+	memcpy(data, fp->uncompressed_block, fp->block_length);
+	*address = fp->block_address;
+	*next = bgzf_htell(fp);
+	return fp->block_length;
+}
+
+int64_t bgzf_seek_block(BGZF *fp, int64_t pos, const void *data, int length, int64_t next)
+{
+	if (fp->is_write || length <= 0 || length > BGZF_MAX_BLOCK_SIZE || (pos & 0xFFFF) > length) {
+		fp->errcode |= BGZF_ERR_MISUSE;
+		return -1;
+	}
+	// Position the file at the following block, as if this one had just been read from it.
+	if (mt_reading(fp)) {
+		mtread_t *mt = (mtread_t*)fp->mt;
+		int ret;
+		pthread_mutex_lock(&mt->lock);
+		mt_read_pause(mt);
+		ret = _bgzf_seek(fp->fp, next, SEEK_SET);
+		mt_read_restart(mt, next);
+		mt_read_resume(mt);
+		pthread_mutex_unlock(&mt->lock);
+		if (ret < 0) {
+			fp->errcode |= BGZF_ERR_IO;
+			return -1;
+		}
+	} else if (_bgzf_seek(fp->fp, next, SEEK_SET) < 0) {
+		fp->errcode |= BGZF_ERR_IO;
+		return -1;
+	}
+	memcpy(fp->uncompressed_block, data, length);
+	fp->block_length = length;
+	fp->block_address = pos >> 16;
+	fp->block_offset = pos & 0xFFFF;
+	return 0;
+}
+
 int bgzf_is_bgzf(const char *fn)
 {
 	uint8_t buf[16];
@@ -650,7 +917,7 @@ int bgzf_getc(BGZF *fp)
 	}
 	c = ((unsigned char*)fp->uncompressed_block)[fp->block_offset++];
     if (fp->block_offset == fp->block_length) {
-        fp->block_address = _bgzf_tell((_bgzf_file_t)fp->fp);
+        fp->block_address = bgzf_htell(fp);
         fp->block_offset = 0;
         fp->block_length = 0;
     }
@@ -664,13 +931,14 @@ int bgzf_getc(BGZF *fp)
 int bgzf_getline(BGZF *fp, int delim, kstring_t *str)
 {
 	int l, state = 0;
-	unsigned char *buf = (unsigned char*)fp->uncompressed_block;
+	unsigned char *buf;
 	str->l = 0;
 	do {
 		if (fp->block_offset >= fp->block_length) {
 			if (bgzf_read_block(fp) != 0) { state = -2; break; }
 			if (fp->block_length == 0) { state = -1; break; }
 		}
+		buf = (unsigned char*)fp->uncompressed_block; // the read-ahead swaps the block buffer
 		for (l = fp->block_offset; l < fp->block_length && buf[l] != delim; ++l);
 		if (l < fp->block_length) state = 1;
 		l -= fp->block_offset;
@@ -683,7 +951,7 @@ int bgzf_getline(BGZF *fp, int delim, kstring_t *str)
 		str->l += l;
 		fp->block_offset += l + 1;
 		if (fp->block_offset >= fp->block_length) {
-			fp->block_address = _bgzf_tell((_bgzf_file_t)fp->fp);
+			fp->block_address = bgzf_htell(fp);
 			fp->block_offset = 0;
 			fp->block_length = 0;
 		} 
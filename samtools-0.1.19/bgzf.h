@@ -200,6 +200,43 @@ extern "C" {
 	 */
 	int bgzf_mt(BGZF *fp, int n_threads, int n_sub_blks);
 
+	/**
+	 * Enable multi-threaded read-ahead (only effective on reading). Worker
+	 * threads inflate the upcoming blocks, which bgzf_read() consumes in
+	 * file order; the reading API and virtual offsets are unchanged.
+	 *
+	 * @param fp          BGZF file handler; must be opened for reading
+	 * @param n_threads   #threads used for inflating
+	 * @param n_sub_blks  #blocks read ahead per thread; a value 4-16 is recommended
+	 * @return            0 on success and -1 on error
+	 */
+	int bgzf_mt_read(BGZF *fp, int n_threads, int n_sub_blks);
+
+	/**
+	 * Copy out the uncompressed block the reader is in, so a handle that is
+	 * about to be closed can later be reopened without inflating it again.
+	 *
+	 * @param fp       BGZF file handler opened for reading
+	 * @param data     buffer of at least BGZF_MAX_BLOCK_SIZE bytes
+	 * @param address  [out] file offset of the block
+	 * @param next     [out] file offset of the block after it
+	 * @return         length of the block; 0 if no block is loaded
+	 */
+	int bgzf_save_block(BGZF *fp, void *data, int64_t *address, int64_t *next);
+
+	/**
+	 * Like bgzf_seek(), but take the block at _pos_ from a copy made by
+	 * bgzf_save_block() instead of reading it from the file.
+	 *
+	 * @param fp      BGZF file handler opened for reading
+	 * @param pos     virtual file offset inside the saved block
+	 * @param data    the saved block
+	 * @param length  length returned by bgzf_save_block()
+	 * @param next    _next_ returned by bgzf_save_block()
+	 * @return        0 on success and -1 on error
+	 */
+	int64_t bgzf_seek_block(BGZF *fp, int64_t pos, const void *data, int length, int64_t next);
+
 #ifdef __cplusplus
 }
 #endif
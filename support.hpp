@@ -36,7 +36,8 @@ public:
 	{
 	} 
 
-	void Add( Alignments &align, bool ignoreCoord = false )
+	template <class T>
+	void Add( T &align, bool ignoreCoord = false )
 	{
 		if ( align.IsUnique() )
 			++uniqSupport ;